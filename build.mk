@@ -1,6 +1,6 @@
 # OSv-specific build file to compile fsmark inside the tree.
 
-fsmark-cmd-file-list = fs_mark lib_timing gettid_wrapper
+fsmark-cmd-file-list = fs_mark lib_timing lib_uring gettid_wrapper
 
 fsmark-cmd-objects = $(foreach x, $(fsmark-cmd-file-list), fsmark-osv/$x.o)
 
@@ -8,7 +8,7 @@ cflags-fsmark-cmd-includes =
 
 $(fsmark-cmd-objects): kernel-defines =
 
-$(fsmark-cmd-objects): CFLAGS += -D_GNU_SOURCE -D__OSV__
+$(fsmark-cmd-objects): CFLAGS += -D_GNU_SOURCE -D__OSV__ -DFS_MARK_CLOCK_MONOTONIC
 
 $(fsmark-cmd-objects): local-includes += $(cflags-fsmark-cmd-includes)
 
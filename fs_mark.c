@@ -31,11 +31,19 @@
  */
 char *fs_mark_version = "3.3";
 
+#define _GNU_SOURCE		/* syncfs(), sync_file_range() */
+
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -48,8 +56,13 @@ char *fs_mark_version = "3.3";
 #include <time.h>
 #include <assert.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <math.h>
+#include <limits.h>
+#include <sched.h>
 
 #ifndef __OSV__
+#include <linux/fs.h>
 #include <linux/types.h>
 #include <linux/limits.h>
 #include <linux/unistd.h>
@@ -61,6 +74,7 @@ char *fs_mark_version = "3.3";
 extern long __gettid();
 
 #include "fs_mark.h"
+#include "lib_uring.h"
 
 void cleanup_exit(void)
 {
@@ -70,1141 +84,5653 @@ void cleanup_exit(void)
 void usage(void)
 {
 	fprintf(stderr,
-		"Usage: fs_mark\n%s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s",
+		"Usage: fs_mark\n%s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s",
 		"\t-h <print usage and exit>\n",
 		"\t-k <keep files after each iteration>\n",
 		"\t-F <run until FS full>\n",
+		"\t-P <print p50/p99/p99.9 latency for each system call>\n",
+		"\t-T <keep worker threads alive across iterations>\n",
 		"\t-S Sync Method (0:No Sync, 1:fsyncBeforeClose, "
 		"2:sync/1_fsync, 3:PostReverseFsync, "
-		"4:syncPostReverseFsync, 5:PostFsync, 6:syncPostFsync)\n",
+		"4:syncPostReverseFsync, 5:PostFsync, 6:syncPostFsync, "
+		"7:BatchFsync, 8:ParallelBatchFsync, 9:syncfs, 10:SyncFileRange)\n",
 		"\t[-D number (of subdirectories)]\n",
 		"\t[-N number (of files in each subdirectory in Round Robin mode)]\n",
 		"\t[-d dir1 ... -d dirN]\n", "\t[-l log_file_name]\n",
+		"\t[-E sync|uring (IO engine for the file write loop)]\n",
+		"\t[-i interval (report progress every interval, e.g. 1s or 500ms)]\n",
 		"\t[-l log_file_name]\n",
 		"\t[-L number (of iterations)]\n",
 		"\t[-n number (of files per iteration)]\n",
 		"\t[-p number (of total bytes file names)]\n",
+		"\t[-Q number (of files in flight per thread with -E uring)]\n",
 		"\t[-r number (of random bytes in file names)]\n",
-		"\t[-s byte_count (size in bytes of each file)]\n",
+		"\t[-R stat,read,readdir|all (read back phases after the write loop)]\n",
+		"\t[-s byte_count|size[:weight],...|lognormal:median,sigma[,max] (file sizes)]\n",
 		"\t[-t number (of total threads)]\n",
-		"\t[-w number (of bytes per write() syscall)]\n");
+		"\t[-w number (of bytes per write() syscall)]\n",
+		"\t[--format text|json|csv (of the results on stdout)]\n",
+		"\t[--steal batch (share files between threads and directories in batches)]\n",
+		"\t[--rate files_per_sec (open loop file creation rate across all threads)]\n",
+		"\t[--sync-batch number (of files per fsync batch with -S 7 and -S 8)]\n",
+		"\t[--sync-threads number (of parallel fsync()s per thread with -S 8)]\n",
+		"\t[--dir-sync none|file|batch|subdir (fsync() the directories of new files)]\n",
+		"\t[--rename tmpdir|subdir (write each file elsewhere, then rename it into place)]\n",
+		"\t[--rename-noreplace (rename with renameat2(RENAME_NOREPLACE))]\n",
+		"\t[--rename-sync (fsync() both directories after each rename)]\n",
+		"\t[--direct (open the files with O_DIRECT)]\n",
+		"\t[--open-sync none|dsync|sync (open the files with O_DSYNC or O_SYNC)]\n",
+		"\t[--hugepages (allocate the IO buffers on huge pages)]\n",
+		"\t[--write-mode seq|fallocate|random|append|pwritev (how file data is written)]\n",
+		"\t[--iovecs number (of -w sized chunks per pwritev() call)]\n",
+		"\t[--payload zero|random (data written to the files)]\n",
+		"\t[--compress-ratio ratio (of random data to zeros, implies --payload random)]\n",
+		"\t[--dedup-ratio ratio (of chunks written to unique chunks, implies --payload random)]\n",
+		"\t[--mix create:weight,read:weight,stat:weight,unlink:weight (mixed workload of -n ops)]\n",
+		"\t[--mix-files number (of files per thread to start the --mix population with)]\n",
+		"\t[--churn percent (fill the file system to percent, then replace random files)]\n",
+		"\t[--affinity none|compact|scatter|node|cpu_list (pin the worker threads)]\n",
+		"\t[--cpu-stats (report CPU time, context switches and run queue wait per thread)]\n",
+		"\t[--dev-stats (report block device IO and write amplification per iteration)]\n");
 	cleanup_exit();
 	return;
 }
 
 /*
- * Run through the specified arguments and make sure that they make sense.
+ * Per thread pseudo random number generator (xoshiro256**).
+ * Each thread owns its state, so there is no shared lock as with random().
  */
-void process_args(int argc, char **argv, char **envp)
+static inline unsigned long long rng_rotl(unsigned long long x, int k)
 {
-	int ret;
-
-	/*
-	 * Parse all of the options that the user specified.
-	 */
-	while ((ret =
-		getopt(argc, argv, "vhkFr:S:N:D:d:l:L:n:p:s:t:w:")) != EOF) {
-		switch (ret) {
-		case 'v':	/* verbose stats */
-			verbose_stats = 1;
-			break;
-
-		case 'D':	/* Use Multiple directories */
-			num_subdirs = atoi(optarg);
-			if (num_subdirs < 2) {
-				fprintf(stderr,
-					"Number of subdirs needs to be greater than 1\n");
-				usage();
-			}
-			/*
-			 * Change the policy to a good multi-subdir one
-			 */
-			if (dir_policy == DIR_NO_SUBDIRS)
-			    dir_policy = DIR_TIME_HASH;
-			break;
-
-		case 'd':	/* Set directory path */
-			if (num_dirs > MAX_THREADS) {
-				fprintf(stderr,
-					"Max number of threads (and directories) is %d\n",
-					MAX_THREADS);
-				usage();
-			}
-			if (strlen(optarg) >= MAX_NAME_PATH) {
-				fprintf(stderr,
-					"fs_mark: %s directory pathname too long (must be less than %d bytes)\n",
-					optarg, MAX_NAME_PATH);
-				usage();
-			}
-			strncpy(child_tasks[num_dirs].test_dir, optarg,
-				PATH_MAX);
-			num_dirs++;
-			break;
-
-		case 'F':	/* Run until FS is full */
-			keep_files = 1;	/* Set keep files as well (hard to fill fs without this!) */
-			do_fill_fs = 1;
-			break;
-
-		case 'k':	/* Leave test files at end */
-			keep_files = 1;
-			break;
-
-		case 'l':	/* Log file name */
-			strncpy(log_file_name, optarg, PATH_MAX);
-			break;
-
-		case 'L':	/* number of iterations */
-			loop_count = atoi(optarg);
-			keep_files = 1;			/* Set keep files as well */
-			break;
-
-		case 'n':	/* Set number of files to test of each size */
-			num_files = atoi(optarg);
-			if (num_files > MAX_FILES) {
-				fprintf(stderr, "Max files is %d\n", MAX_FILES);
-				usage();
-			}
-			break;
+	return ((x << k) | (x >> (64 - k)));
+}
 
-		case 'N':	/* Set number of files to write into each subdirectory */
-			dir_policy = DIR_ROUND_ROBIN;
-			num_per_subdir = atoi(optarg);
-			break;
+static inline unsigned long long rng_next(child_job_t *child_task)
+{
+	unsigned long long *s = child_task->rng_state;
+	unsigned long long result, t;
 
-		case 'p':	/* Set size of names in directories */
-			name_len = atoi(optarg);
-			if (name_len > FILENAME_SIZE) {
-				fprintf(stderr, "Max filename size is %d\n",
-					FILENAME_SIZE);
-				usage();
-			}
-			break;
+	result = rng_rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 17;
 
-		case 's':	/* Set specific size to test */
-			file_size = atoi(optarg);
-			break;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rng_rotl(s[3], 45);
 
-		case 'r':	/* Use random file names */
-			rand_len = atoi(optarg);
-			break;
+	return (result);
+}
 
-		case 'S':	/* Turn off sync and fsync */
-			sync_method_type = atoi(optarg);
-			switch (sync_method_type) {
-			case 0:
-				sync_method = 0;
-				break;
-			case 1:
-				sync_method = SYNC_TEST_PER_FILE;
-				break;
-			case 2:
-				sync_method = SYNC_TEST_PER_THREAD;
-				break;
-			case 3:
-				sync_method = SYNC_TEST_REVERSE;
-				break;
-			case 4:
-				sync_method = SYNC_TEST_REVERSE_SYNC;
-				break;
-			case 5:
-				sync_method = SYNC_TEST_POST;
-				break;
-			case 6:
-				sync_method = SYNC_TEST_POST_SYNC;
-				break;
+/*
+ * Seed the generator from the thread index with splitmix64 so that runs are
+ * repeatable and every thread gets an independent stream.
+ */
+void rng_seed(child_job_t *child_task, unsigned long long seed)
+{
+	int i;
 
-			default:
-				fprintf(stderr, "Max filename size is %d\n",
-					FILENAME_SIZE);
-				usage();
-			}
-			break;
+	for (i = 0; i < 4; i++) {
+		unsigned long long z;
 
-		case 't':	/* Set number of threads */
-			num_threads = atoi(optarg);
-			if (num_threads > MAX_THREADS) {
-				fprintf(stderr, "Max threads is %d\n",
-					MAX_THREADS);
-				usage();
-			}
-			break;
+		seed += 0x9e3779b97f4a7c15ULL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		child_task->rng_state[i] = z ^ (z >> 31);
+	}
+}
 
-		case 'w':	/* Set write buffer size */
-			io_buffer_size = atoi(optarg);
-			if (io_buffer_size > MAX_IO_BUFFER_SIZE) {
-				fprintf(stderr, "MAX IO buffer size is %d\n",
-					MAX_IO_BUFFER_SIZE);
-				usage();
-			}
-			break;
+/*
+ * Seed the payload generator lanes the same way.
+ */
+void payload_seed(unsigned long long state[4][PAYLOAD_LANES],
+		  unsigned long long seed)
+{
+	int i, lane;
 
-		case 'h':	/* Print usage and exit */
-			usage();
-			break;
+	for (i = 0; i < 4; i++) {
+		for (lane = 0; lane < PAYLOAD_LANES; lane++) {
+			unsigned long long z;
 
-		default:
-			usage();
+			seed += 0x9e3779b97f4a7c15ULL;
+			z = seed;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			state[i][lane] = z ^ (z >> 31);
 		}
 	}
+}
 
-	if (num_dirs == 0) {
-		fprintf(stderr,
-			"Must specify at least one directory with -d switch\n");
-		usage();
-	}
-	if ((num_subdirs == 0) && (num_per_subdir > 0)) {
-		fprintf(stderr,
-			"Must specify at more than 1 subdirectory with -D switch"
-			" for -N num_per_subdir to make sense\n");
-		usage();
-	}
-
-	/*
-	 * We need at least one thread per specified directory.
-	 * Also, if we specify more threads than directories, divide 
-	 * up the threads & make sure that an even number of threads runs 
-	 * in each one.
-	 */
-	if (num_dirs > num_threads)
-		num_threads = num_dirs;
-	else {
-		int threads_per_dir, i, j;
-
-		threads_per_dir = num_threads / num_dirs;
-		if (((num_dirs * threads_per_dir) != num_threads) ||
-		    ((num_dirs * threads_per_dir) > MAX_THREADS)) {
-			fprintf(stderr,
-				"Threads (%d) must be an even multiple the number of directories"
-				" (%d) and less than %d \n",
-				num_threads, num_dirs, MAX_THREADS);
-			usage();
+/*
+ * Fill "len" bytes with random data. This is on the write path for every
+ * chunk, so it runs PAYLOAD_LANES xoshiro256+ generators side by side: the
+ * lanes do not depend on each other and xoshiro256+ needs no multiply, so
+ * the compiler turns the inner loops into SIMD adds, shifts and xors.
+ */
+static void payload_random(unsigned long long state[4][PAYLOAD_LANES],
+			   char *buf, int len)
+{
+	unsigned long long out[PAYLOAD_LANES], t[PAYLOAD_LANES];
+	int lane;
+
+	while (len > 0) {
+		for (lane = 0; lane < PAYLOAD_LANES; lane++) {
+			out[lane] = state[0][lane] + state[3][lane];
+			t[lane] = state[1][lane] << 17;
+			state[2][lane] ^= state[0][lane];
+			state[3][lane] ^= state[1][lane];
+			state[1][lane] ^= state[2][lane];
+			state[0][lane] ^= state[3][lane];
+			state[2][lane] ^= t[lane];
+			state[3][lane] = rng_rotl(state[3][lane], 45);
 		}
-		for (i = 0; i < num_dirs; i++)
-			for (j = 1; j < threads_per_dir; j++) {
-				strncpy(child_tasks[i + (j * num_dirs)].
-					test_dir, child_tasks[i].test_dir,
-					PATH_MAX);
-			}
+		memcpy(buf, out, len < (int)sizeof(out) ? len : (int)sizeof(out));
+		buf += sizeof(out);
+		len -= sizeof(out);
 	}
-	return;
 }
 
 /*
- * Extract & return the file name from the child_tasks array
+ * Fill a chunk with payload. With --compress-ratio each PAYLOAD_SEGMENT
+ * starts with 1/ratio of random bytes and the rest is zeros, which any
+ * block compressor at least as large as a segment reduces by the ratio.
  */
-char *find_dir_name(long tid)
+void fill_payload(unsigned long long state[4][PAYLOAD_LANES], char *buf,
+		  int len)
 {
-	int num_dir;
+	int off, seg, head;
 
-	for (num_dir = 0; num_dir < MAX_THREADS; num_dir++) {
-		if (child_tasks[num_dir].child_tid == tid)
-			break;
+	for (off = 0; off < len; off += PAYLOAD_SEGMENT) {
+		seg = (len - off < PAYLOAD_SEGMENT) ? len - off : PAYLOAD_SEGMENT;
+		head = (int)ceil(seg / compress_ratio);
+		payload_random(state, buf + off, head);
+		memset(buf + off + head, 0, seg - head);
 	}
-
-	return (child_tasks[num_dir].test_dir);
 }
 
 /*
- * Setup a file name.
+ * Parse the comma separated list of read back phases given to -R.
  */
-void setup_file_name(child_job_t *child_task, int file_index, long my_tid)
+void parse_read_phases(char *arg)
 {
-	int seq_len;
-	int j, pad, skip;
-	unsigned long sec_time;
-	char *my_dir;
-	my_dir = find_dir_name(my_tid);
-	char subdir_name[MAX_NAME_PATH];
-	struct timeval now;
-
-	/*
-	 * Get the current time.
-	 */
-	(void) gettimeofday(&now, (struct timezone *) 0);
-	sec_time = now.tv_sec;
-	
-	/*
-	 * If this is the first run, record this time in
-	 * start_sec_time.
-	 */
-	if (start_sec_time == 0) {
-	    start_sec_time = sec_time;
+	char list[MAX_STRING_SIZE];
+	char *name, *saveptr;
+	int phase;
+
+	strncpy(list, arg, sizeof(list) - 1);
+	list[sizeof(list) - 1] = 0;
+
+	for (name = strtok_r(list, ",", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		if (strcmp(name, "all") == 0) {
+			read_phases = (1 << NUM_READ_PHASES) - 1;
+			continue;
+		}
+		for (phase = 0; phase < NUM_READ_PHASES; phase++)
+			if (strcmp(name, read_phase_string[phase]) == 0)
+				break;
+		if (phase == NUM_READ_PHASES) {
+			fprintf(stderr, "Unknown read back phase %s\n", name);
+			usage();
+		}
+		read_phases |= (1 << phase);
 	}
+}
 
-	/*
-	 * Each filename will be name_len characters long.
-	 * If random characters are requested, they go at the end of the filename.
-	 * By default, all names are only sequential.
-	 */
-	seq_len = name_len - rand_len;
-
-	if (child_task->names == NULL) {
-		if ((child_task->names =
-		     calloc(sizeof(struct name_entry), num_files)) == NULL) {
-			fprintf(stderr,
-				"fs_mark: failed to allocate memory for file names: %s\n",
-				strerror(errno));
-			cleanup_exit();
+/*
+ * Parse the operation weights given to --mix, see fs_mark.h.
+ */
+void parse_mix(char *arg)
+{
+	char list[MAX_STRING_SIZE];
+	char *entry, *weight, *end, *saveptr;
+	double total = 0.0, sum = 0.0;
+	int op;
+
+	strncpy(mix_spec, arg, sizeof(mix_spec) - 1);
+	mix_spec[sizeof(mix_spec) - 1] = 0;
+	strncpy(list, arg, sizeof(list) - 1);
+	list[sizeof(list) - 1] = 0;
+
+	for (entry = strtok_r(list, ",", &saveptr); entry != NULL;
+	     entry = strtok_r(NULL, ",", &saveptr)) {
+		if ((weight = strchr(entry, ':')) != NULL)
+			*weight++ = 0;
+		for (op = 0; op < NUM_MIX_OPS; op++)
+			if (strcmp(entry, mix_op_string[op]) == 0)
+				break;
+		if ((op == NUM_MIX_OPS) || (weight == NULL)) {
+			fprintf(stderr, "Invalid --mix entry %s\n", entry);
+			usage();
+		}
+		mix_weight[op] = strtod(weight, &end);
+		if ((end == weight) || (*end != 0) || (mix_weight[op] < 0.0)) {
+			fprintf(stderr, "Invalid --mix weight %s for %s\n",
+				weight, entry);
+			usage();
 		}
+		total += mix_weight[op];
+	}
+	if (total <= 0.0) {
+		fprintf(stderr, "--mix needs at least one positive weight\n");
+		usage();
 	}
 
 	/*
-	 * Now pick a directory to stick this file in.
-	 * 
+	 * As for file sizes, a 32 bit random number picks the first
+	 * operation whose cumulative weight is above it.
 	 */
-	switch (dir_policy) {
-	case DIR_NO_SUBDIRS:
-		subdir_name[0] = 0;
-		break;
+	for (op = 0; op < NUM_MIX_OPS; op++) {
+		sum += mix_weight[op];
+		mix_cumul[op] = (unsigned long long)(sum / total * 4294967296.0);
+	}
+	mix_cumul[NUM_MIX_OPS - 1] = 1ULL << 32;
 
-	case DIR_ROUND_ROBIN:
-		if (num_per_subdir) {
-			/*
-			 * Stick the specified number of files in each directory before 
-			 * moving on.
-			 */
-			if (files_in_subdir >= num_per_subdir) {
-				current_subdir++;
-				files_in_subdir = 0;
-			}
-			current_subdir = current_subdir % num_subdirs;
-			files_in_subdir++;
-		}
-		sprintf(subdir_name, "%02x", current_subdir);
-		break;
+	mix_mode = 1;
+}
 
-	case DIR_TIME_HASH:
-		if ((sec_time - start_sec_time) > secs_per_directory) {
-			current_subdir = (current_subdir + 1) % num_subdirs;
-			start_sec_time = sec_time;
+/*
+ * Parse the file size distribution given to -s, see fs_mark.h.
+ */
+void parse_file_sizes(char *arg)
+{
+	char list[MAX_STRING_SIZE];
+	char *entry, *weight, *end, *saveptr;
+	double median, max, weights[MAX_SIZE_DIST_ENTRIES];
+	double total = 0.0, sum = 0.0, bytes = 0.0;
+	unsigned long size;
+	int i, n, len = 0;
+
+	strncpy(size_dist_spec, arg, sizeof(size_dist_spec) - 1);
+	size_dist_spec[sizeof(size_dist_spec) - 1] = 0;
+
+	if (strncmp(arg, "lognormal:", 10) == 0) {
+		max = 0.0;
+		n = sscanf(arg + 10, "%lf,%lf%n,%lf%n", &median, &size_dist_sigma,
+			   &len, &max, &len);
+		if ((n < 2) || (arg[10 + len] != 0) || (median < 1.0) ||
+		    (size_dist_sigma < 0.0) || ((n == 3) && (max < median))) {
+			fprintf(stderr, "Invalid log-normal file sizes %s\n", arg);
+			usage();
 		}
-		sprintf(subdir_name, "%02x", current_subdir);
-		break;
-
-	default:
-		fprintf(stderr, "fs_mark: invalid directory policy\n");
-		exit(1);
-		break;
+		if (n == 2)
+			max = median * LOGNORMAL_MAX_FACTOR;
+		if (max > (double)UINT_MAX)
+			max = (double)UINT_MAX;
+
+		size_dist = SIZE_DIST_LOGNORMAL;
+		size_dist_mu = log(median);
+		file_size = (unsigned int)max;
+		size_dist_mean = median * exp(size_dist_sigma * size_dist_sigma / 2.0);
+		if (size_dist_mean > max)
+			size_dist_mean = max;
+		return;
 	}
 
-	sprintf(child_task->names[file_index].target_dir, "%s/%s", my_dir, subdir_name);
-
 	/*
-	 * Make the base directory entry (i.e., /mnt/1/test/00)
+	 * A single size, the way -s always worked.
 	 */
-	if ((mkdir(child_task->names[file_index].target_dir, 0777) != 0)
-	    && (errno != EEXIST)) {
-		fprintf(stderr, "fs_mark: mkdir %s failed: %s\n",
-			child_task->names[file_index].target_dir, strerror(errno));
-		cleanup_exit();
+	if ((strchr(arg, ',') == NULL) && (strchr(arg, ':') == NULL)) {
+		file_size = atoi(arg);
+		size_dist_mean = file_size;
+		return;
 	}
 
-	sprintf(child_task->names[file_index].write_dir, "%s", child_task->names[file_index].target_dir);
+	strncpy(list, arg, sizeof(list) - 1);
+	list[sizeof(list) - 1] = 0;
 
-	/*
-	 * Set up the sequential name for this file
-	 */
-	sprintf(child_task->seq_name, "%lx", sec_time);
+	file_size = 0;
+	for (entry = strtok_r(list, ",", &saveptr), i = 0; entry != NULL;
+	     entry = strtok_r(NULL, ",", &saveptr), i++) {
+		if (i == MAX_SIZE_DIST_ENTRIES) {
+			fprintf(stderr, "At most %d file sizes can be given\n",
+				MAX_SIZE_DIST_ENTRIES);
+			usage();
+		}
 
-	/*
-	 * Compute a random name for the file
-	 */
-	for (j = 0; j < rand_len; j++) {
-		/*
-		 * Pick a random name, making sure that it is either a letter or digit
-		 */
-		do {
-			long int val;
+		errno = 0;
+		size = strtoul(entry, &end, 0);
+		if ((end == entry) || (errno != 0) || (size == 0) ||
+		    (size > UINT_MAX) || ((*end != 0) && (*end != ':'))) {
+			fprintf(stderr, "Invalid file size %s\n", entry);
+			usage();
+		}
+		weights[i] = 1.0;
+		if (*end == ':') {
+			weight = end + 1;
+			weights[i] = strtod(weight, &end);
+			if ((end == weight) || (*end != 0))
+				weights[i] = 0.0;
+		}
+		if (weights[i] <= 0.0) {
+			fprintf(stderr, "Invalid file size %s\n", entry);
+			usage();
+		}
 
-			val = random();
-			child_task->rand_name[j] = '0' + (val & 0x7f);
-		} while (!(isupper(child_task->rand_name[j]) || isdigit(child_task->rand_name[j])));
+		size_dist_size[i] = size;
+		if (size > file_size)
+			file_size = size;
+		total += weights[i];
+		bytes += size * weights[i];
 	}
-	child_task->rand_name[rand_len] = 0;	/* Terminate string with NULL */
+	size_dist_count = i;
 
 	/*
-	 * We want to create names with the specified number of sequential & random bytes.
-	 * Make sure to take the least signficant bytes of sequential (the most signficant
-	 * do not change)
+	 * A 32 bit random number picks the first entry whose cumulative
+	 * weight is above it.
 	 */
-	skip = strlen(child_task->seq_name) - seq_len;
-	if (skip > 0) {		/* More sequential bytes than we need */
-		strncat(child_task->names[file_index].f_name, &child_task->seq_name[skip], seq_len);
-	} else {
-		strncat(child_task->names[file_index].f_name, child_task->seq_name, seq_len);
+	for (i = 0; i < size_dist_count; i++) {
+		sum += weights[i];
+		size_dist_cumul[i] = (unsigned long long)(sum / total * 4294967296.0);
 	}
-	pad = seq_len - strlen(child_task->seq_name);
-	for (j = 0; j < pad; j++)
-		strcat(child_task->names[file_index].f_name, "~");
-	strncat(child_task->names[file_index].f_name, child_task->rand_name, rand_len);
+	size_dist_cumul[size_dist_count - 1] = 1ULL << 32;
 
-	return;
+	size_dist = SIZE_DIST_LIST;
+	size_dist_mean = bytes / total;
 }
 
 /*
- * Setup and initial state
+ * Parse an interval such as "1s", "500ms", "2m" or "3" (seconds) into nsecs.
+ * Returns 0 if the interval does not make sense.
  */
-void setup(child_job_t *child_task)
+unsigned long long parse_interval(char *arg)
 {
-	long tid = child_task->child_tid;
-	char *my_dir;
-	struct timeval now;
+	double value;
+	char *unit;
+
+	value = strtod(arg, &unit);
+	if ((unit == arg) || (value <= 0.0))
+		return (0ULL);
+
+	if ((*unit == 0) || (strcmp(unit, "s") == 0))
+		value *= 1000000000.0;
+	else if (strcmp(unit, "ms") == 0)
+		value *= 1000000.0;
+	else if (strcmp(unit, "us") == 0)
+		value *= 1000.0;
+	else if (strcmp(unit, "m") == 0)
+		value *= 60.0 * 1000000000.0;
+	else
+		return (0ULL);
 
-	/*
-	 * Initialize the random functions for this program.
-	 */
-	(void)gettimeofday(&now, (struct timezone *)0);
-	srandom((long)now.tv_usec);
+	return ((unsigned long long)value);
+}
 
-	if (num_subdirs > 0) {
-		/*
-		 * Pick a starting directory to write into.
-		 * To avoid having short runs always write into the first
-		 * few directories, pick a starting directory based on the time value.
-		 */
-		current_subdir = now.tv_sec % num_subdirs;
+/*
+ * Parse a CPU list such as "0-3,8,10-11", the format of the sysfs cpulist
+ * files, into at most "max" CPU numbers in the order given.
+ * Returns how many there are, or -1 if the list is malformed.
+ */
+int parse_cpu_list(const char *list, int *cpus, int max)
+{
+	const char *p = list;
+	char *end;
+	long first, last;
+	int count = 0;
+
+	while (*p && (*p != '\n')) {
+		first = strtol(p, &end, 10);
+		if ((end == p) || (first < 0) || (first >= CPU_SETSIZE))
+			return (-1);
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if ((end == p) || (last < first) || (last >= CPU_SETSIZE))
+				return (-1);
+		}
+		for (; first <= last; first++) {
+			if (count == max)
+				return (-1);
+			cpus[count++] = first;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end && (*end != '\n'))
+			return (-1);
+		p = end;
 	}
 
-	/*
-	 * Clear the io_buffer
-	 */
-	memset(child_task->io_buffer, 0, io_buffer_size);
-
-	/*
-	 * Create my high level test directory
-	 */
-	my_dir = find_dir_name(tid);
+	return (count);
+}
 
-	if ((mkdir(my_dir, 0777) != 0) && (errno != EEXIST)) {
-		fprintf(stderr,
-			"fill_dir:mkdir %s failed: %s\n", my_dir,
-			strerror(errno));
-		cleanup_exit();
+/*
+ * Format a CPU set as a list, the other way around.
+ */
+char *format_cpu_list(cpu_set_t *set, char *buf, int size)
+{
+	int cpu, last, len = 0;
+
+	buf[0] = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+		for (last = cpu; (last + 1 < CPU_SETSIZE) && CPU_ISSET(last + 1, set);
+		     last++)
+			;
+		if (last == cpu)
+			len += snprintf(buf + len, size - len, "%s%d",
+					len ? "," : "", cpu);
+		else
+			len += snprintf(buf + len, size - len, "%s%d-%d",
+					len ? "," : "", cpu, last);
+		if (len >= size)
+			break;
+		cpu = last;
 	}
 
-	return;
+	return (buf);
 }
 
 /*
- * Return an integer to represent the %full (similar hopefully to what df returns!)
+ * Find the NUMA nodes and which of the CPUs we may run on are on each.
+ * Without NUMA information (as on OSv) all CPUs are one node, numbered -1.
  */
-int get_df_full(char *dir_name)
+void read_numa_nodes(cpu_set_t *allowed)
 {
-	struct statfs fs_buf;
-	float df_used, used_blocks;
-	int df_percent_used;
-
-	if (statfs(dir_name, &fs_buf) == -1) {
-		fprintf(stderr, "fs_mark: statfs failed on %s %s\n", dir_name,
-			strerror(errno));
-		cleanup_exit();
+	char path[PATH_MAX], list[PATH_MAX * 4];
+	int cpus[CPU_SETSIZE];
+	int node, count, i;
+	FILE *fp;
+
+	for (node = 0; (node < MAX_NUMA_NODES) && (num_numa_nodes < MAX_NUMA_NODES);
+	     node++) {
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", NUMA_NODE_PATH, node);
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;
+		count = (fgets(list, sizeof(list), fp) != NULL) ?
+		    parse_cpu_list(list, cpus, CPU_SETSIZE) : -1;
+		fclose(fp);
+
+		CPU_ZERO(&numa_node_cpus[num_numa_nodes]);
+		for (i = 0; i < count; i++)
+			if (CPU_ISSET(cpus[i], allowed))
+				CPU_SET(cpus[i], &numa_node_cpus[num_numa_nodes]);
+		if (CPU_COUNT(&numa_node_cpus[num_numa_nodes]) == 0)
+			continue;
+		numa_node_id[num_numa_nodes++] = node;
 	}
 
-	used_blocks = (float)(fs_buf.f_blocks - fs_buf.f_bavail);
-
-	df_used = (used_blocks / fs_buf.f_blocks);
-
-	df_percent_used = (int)(100 * df_used);
-
-	return (df_percent_used);
+	if (num_numa_nodes == 0) {
+		numa_node_id[0] = -1;
+		numa_node_cpus[0] = *allowed;
+		num_numa_nodes = 1;
+	}
 }
 
 /*
- * Return an unsigned long long with number of bytes left in file system.
+ * The node a CPU is on, -1 if unknown.
  */
-unsigned long long get_bytes_free(char *dir_name)
+static int cpu_node(int cpu)
 {
-	struct statfs fs_buf;
-	unsigned long long bytes_free;
-
-	if (statfs(dir_name, &fs_buf) == -1) {
-		fprintf(stderr, "fs_mark: statfs failed on %s %s\n", dir_name,
-			strerror(errno));
-		cleanup_exit();
-	}
+	int i;
 
-	bytes_free = (unsigned long long)fs_buf.f_bavail;
-	bytes_free = bytes_free * fs_buf.f_bsize;
+	for (i = 0; i < num_numa_nodes; i++)
+		if (CPU_ISSET(cpu, &numa_node_cpus[i]))
+			return (numa_node_id[i]);
 
-	return (bytes_free);
+	return (-1);
 }
 
 /*
- * This routine opens, writes the amount of (zero filled) data to a file.
- * It chunks IO requests into the specified buffer size.  The data is just zeroed, 
- * nothing in the kernel inspects the contents of the buffer on its way to disk.
+ * Work out where each thread runs for --affinity.
  */
-void write_file(child_job_t *child_task,
-		int fd,
-		int sz,
-		unsigned long long *avg_write_usec,
-		unsigned long long *total_write_usec,
-		unsigned long long *min_write_usec,
-		unsigned long long *max_write_usec)
+void setup_affinity(void)
 {
-	int ret = 0;
-	int sz_left;
-	int write_size, write_calls;
-	unsigned long long local_write_usec, delta;
-	struct timeval start_tv, stop_tv;
-
-	write_calls = 0;
-	write_size = io_buffer_size;
-	sz_left = sz;
-	local_write_usec = 0ULL;
+	cpu_set_t allowed;
+	int order[CPU_SETSIZE];
+	int nr_cpus = 0, node, cpu, nth, added, thread;
 
-	do {
-		if (write_size > sz_left)
-			write_size = sz_left;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		fprintf(stderr, "fs_mark: sched_getaffinity failed: %s\n",
+			strerror(errno));
+		cleanup_exit();
+	}
+	read_numa_nodes(&allowed);
+
+	switch (affinity) {
+	case AFFINITY_COMPACT:
+		for (node = 0; node < num_numa_nodes; node++)
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &numa_node_cpus[node]))
+					order[nr_cpus++] = cpu;
+		break;
 
-		start(&start_tv);
-		if ((ret = write(fd, child_task->io_buffer, write_size)) != write_size) {
-			fprintf(stderr,
-				"fs_mark: write_file write failed: %d %s\n",
-				ret, strerror(errno));
-			cleanup_exit();
+	case AFFINITY_SCATTER:
+		/*
+		 * The nth CPU of every node, then the n+1th...
+		 */
+		for (nth = 0, added = 1; added; nth++) {
+			added = 0;
+			for (node = 0; node < num_numa_nodes; node++) {
+				int seen = 0;
+
+				for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+					if (!CPU_ISSET(cpu, &numa_node_cpus[node]))
+						continue;
+					if (seen++ == nth) {
+						order[nr_cpus++] = cpu;
+						added = 1;
+						break;
+					}
+				}
+			}
 		}
-		delta = stop(&start_tv, &stop_tv);
-
-		local_write_usec += delta;
-
-		if (delta > *max_write_usec)
-			*max_write_usec = delta;
-
-		if ((*min_write_usec == 0) || (delta < *min_write_usec))
-			*min_write_usec = delta;
+		break;
 
-		sz_left -= ret;
-		write_calls++;
-	} while (sz_left > 0);
+	case AFFINITY_LIST:
+		nr_cpus = parse_cpu_list(affinity_cpus, order, CPU_SETSIZE);
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (!CPU_ISSET(order[cpu], &allowed)) {
+				fprintf(stderr,
+					"fs_mark: --affinity CPU %d is not one we may run on\n",
+					order[cpu]);
+				cleanup_exit();
+			}
+		}
+		break;
 
-	*avg_write_usec += (local_write_usec / write_calls);
-	*total_write_usec += local_write_usec;
+	case AFFINITY_NODE:
+	default:
+		for (thread = 0; thread < num_threads; thread++) {
+			node = child_tasks[thread].dir_index % num_numa_nodes;
+			child_tasks[thread].cpus = numa_node_cpus[node];
+			child_tasks[thread].numa_node = numa_node_id[node];
+		}
+		return;
+	}
 
-	return;
+	for (thread = 0; thread < num_threads; thread++) {
+		cpu = order[thread % nr_cpus];
+		CPU_ZERO(&child_tasks[thread].cpus);
+		CPU_SET(cpu, &child_tasks[thread].cpus);
+		child_tasks[thread].numa_node = cpu_node(cpu);
+	}
 }
 
 /*
- * Verify that there is enough space for this run.
+ * Prefer the NUMA node of the thread for a buffer it is about to touch
+ * first. The pages would mostly land there anyway since the thread is
+ * pinned, this makes sure. Failure only costs locality, so it is ignored.
  */
-static void check_space(long my_tid)
+static void bind_to_node(void *buf, size_t size, int node)
 {
-	char *my_dir_name;
-	unsigned long long bytes_per_loop;
-
-	my_dir_name = find_dir_name(my_tid);
-
-	/*
-	 * No use in running this if the file system is already full.
-	 * Compute free bytes and compare to many bytes needed for this iteration.
-	 */
-	bytes_per_loop = (unsigned long long)file_size *num_files;
-	if (get_bytes_free(my_dir_name) < bytes_per_loop) {
-		fprintf(stdout,
-			"Insufficient free space in %s to create %d new files, exiting\n",
-			my_dir_name, num_files);
-		do_fill_fs = 0;	/* Setting this signals the main loop to exit */
-		cleanup_exit();
-	}
-
-	return;
+#ifdef __NR_mbind
+	unsigned long mask;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if ((num_numa_nodes < 2) || (node < 0) ||
+	    (node >= (int)(8 * sizeof(mask))))
+		return;
+
+	mask = 1UL << node;
+	size = (size + page_size - 1) & ~(page_size - 1);
+	(void)syscall(__NR_mbind, buf, size, FS_MARK_MPOL_PREFERRED, &mask,
+		      8 * sizeof(mask) + 1, 0);
+#endif
 }
 
 /*
- * Main loop in program - creates, writes and removes "num_files" files of each size. 
- * Each of the subcomponents is measured separately so we can track how specific aspects 
- * degrade.
+ * Run through the specified arguments and make sure that they make sense.
  */
-
-void do_run(child_job_t *child_task)
+void process_args(int argc, char **argv, char **envp)
 {
-	struct timeval loop_start_tv, loop_stop_tv;
-	struct timeval start_tv, stop_tv;
-	struct name_entry *names = NULL;
-	long my_tid = child_task->child_tid;
-	int file_index, fd;
-	float files_per_sec;
-	unsigned long long total_file_ops, delta, loop_usecs;
-	unsigned long long creat_usec, max_creat_usec, min_creat_usec;
-	unsigned long long avg_write_usec, max_write_usec, min_write_usec,
-	    total_write_usec;
-	unsigned long long fsync_usec, max_fsync_usec, min_fsync_usec;
-	unsigned long long close_usec, max_close_usec, min_close_usec;
-	unsigned long long unlink_usec, max_unlink_usec, min_unlink_usec;
-	unsigned long long avg_sync_usec, app_overhead_usec;
-	char file_write_name[MAX_NAME_PATH + FILENAME_SIZE];
-	char file_target_name[MAX_NAME_PATH + FILENAME_SIZE];
+	int ret, thread;
+	static struct option long_options[] = {
+		{"format", required_argument, NULL, OPT_FORMAT},
+		{"steal", required_argument, NULL, OPT_STEAL},
+		{"rate", required_argument, NULL, OPT_RATE},
+		{"sync-batch", required_argument, NULL, OPT_SYNC_BATCH},
+		{"sync-threads", required_argument, NULL, OPT_SYNC_THREADS},
+		{"dir-sync", required_argument, NULL, OPT_DIR_SYNC},
+		{"rename", required_argument, NULL, OPT_RENAME},
+		{"rename-noreplace", no_argument, NULL, OPT_RENAME_NOREPLACE},
+		{"rename-sync", no_argument, NULL, OPT_RENAME_SYNC},
+		{"direct", no_argument, NULL, OPT_DIRECT},
+		{"open-sync", required_argument, NULL, OPT_OPEN_SYNC},
+		{"hugepages", no_argument, NULL, OPT_HUGEPAGES},
+		{"write-mode", required_argument, NULL, OPT_WRITE_MODE},
+		{"iovecs", required_argument, NULL, OPT_IOVECS},
+		{"payload", required_argument, NULL, OPT_PAYLOAD},
+		{"compress-ratio", required_argument, NULL, OPT_COMPRESS_RATIO},
+		{"dedup-ratio", required_argument, NULL, OPT_DEDUP_RATIO},
+		{"mix", required_argument, NULL, OPT_MIX},
+		{"mix-files", required_argument, NULL, OPT_MIX_FILES},
+		{"churn", required_argument, NULL, OPT_CHURN},
+		{"affinity", required_argument, NULL, OPT_AFFINITY},
+		{"cpu-stats", no_argument, NULL, OPT_CPU_STATS},
+		{"dev-stats", no_argument, NULL, OPT_DEV_STATS},
+		{NULL, 0, NULL, 0}
+	};
+
+	saved_argc = argc;
+	saved_argv = argv;
 
 	/*
-	 * Verify that there is enough space for this run.
+	 * Parse all of the options that the user specified.
 	 */
-	check_space(my_tid);
+	while ((ret =
+		getopt_long(argc, argv, "vhkFPTr:E:S:N:D:d:i:l:L:n:p:Q:R:s:t:w:",
+			    long_options, NULL)) != EOF) {
+		switch (ret) {
+		case OPT_FORMAT:	/* Output format on stdout */
+			for (output_format = 0; output_format < NUM_FORMATS;
+			     output_format++)
+				if (strcmp(optarg, format_string[output_format]) == 0)
+					break;
+			if (output_format == NUM_FORMATS) {
+				fprintf(stderr, "Unknown output format %s\n", optarg);
+				usage();
+			}
+			break;
 
-	/*
-	 * This loop uses microsecond timers to measure each individual file operation.
-	 * Once all files of a given size have been processed, the sum of the times are 
-	 * recorded in operations/sec.
-	 */
-	files_per_sec = 0.0;
-	creat_usec = max_creat_usec = min_creat_usec = 0ULL;
-	avg_write_usec = max_write_usec = min_write_usec = total_write_usec = 0ULL;
-	fsync_usec = max_fsync_usec = min_fsync_usec = avg_sync_usec = 0ULL;
-	close_usec = max_close_usec = min_close_usec = 0ULL;
-	unlink_usec = max_unlink_usec = min_unlink_usec = 0ULL;
+		case OPT_STEAL:		/* Work stealing batch size */
+			steal_batch = atoi(optarg);
+			if (steal_batch < 1) {
+				fprintf(stderr, "Steal batch size must be positive\n");
+				usage();
+			}
+			break;
 
-	/*
-	 * MAIN FILE WRITE LOOP:
-	 * This loop measures the specific steps in creating files:
-	 *      Step 1: Make up a file name
-	 *      Step 2: Creat(file_name);
-	 *      Step 3: write file data
-	 *      Step 4: fsync() file data (optional)
-	 *      Step 5: close() file descriptor
-	 */
+		case OPT_RATE:		/* Open loop file creation rate */
+			target_rate = atof(optarg);
+			if (target_rate <= 0.0) {
+				fprintf(stderr, "Rate must be positive\n");
+				usage();
+			}
+			/*
+			 * The point of an open loop run is the latency
+			 * distribution, so always print it.
+			 */
+			print_percentiles = 1;
+			break;
 
-	start(&loop_start_tv);
-	for (file_index = 0; file_index < num_files; ++file_index) {
-		/*
-		 * To better mimic a running system, create the file names here during the run.
-		 * This lets us stick in the time of day and vary the distribution in interesting
-		 * ways across the directories.
-		 * Note: the file name is a full path, so it specifies both the directory and 
-		 * filename with the directory.
-		 */
-		setup_file_name(child_task, file_index, my_tid);
-		names = child_task->names;
+		case OPT_SYNC_BATCH:	/* Files per group commit batch */
+			sync_batch = atoi(optarg);
+			if (sync_batch < 1) {
+				fprintf(stderr, "Sync batch size must be positive\n");
+				usage();
+			}
+			break;
 
-		/*
-		 * Time the creation of the file.
-		 */
-		sprintf(file_write_name, "%s/%s", names[file_index].write_dir,
-			names[file_index].f_name);
-		sprintf(file_target_name, "%s/%s", names[file_index].target_dir,
-			names[file_index].f_name);
+		case OPT_SYNC_THREADS:	/* Parallel fsync()s with -S 8 */
+			sync_threads = atoi(optarg);
+			if (sync_threads < 1) {
+				fprintf(stderr, "Sync threads must be positive\n");
+				usage();
+			}
+			break;
 
-		start(&start_tv);
-		if ((fd =
-		     open(file_write_name, O_CREAT | O_RDWR | O_TRUNC,
-			  0666)) == -1) {
-			fprintf(stderr, "Error in creat: %s\n",
-				strerror(errno));
-			cleanup_exit();
-		}
-		delta = stop(&start_tv, &stop_tv);
-		creat_usec += delta;
+		case OPT_DIR_SYNC:	/* Directory fsync() policy */
+			for (dir_sync = 0; dir_sync < NUM_DIRSYNC_MODES; dir_sync++)
+				if (strcmp(optarg, dir_sync_string[dir_sync]) == 0)
+					break;
+			if (dir_sync == NUM_DIRSYNC_MODES) {
+				fprintf(stderr, "Unknown directory sync mode %s\n",
+					optarg);
+				usage();
+			}
+			break;
 
-		if (delta > max_creat_usec)
-			max_creat_usec = delta;
+		case OPT_RENAME:	/* Write then rename into place */
+			for (rename_mode = 0; rename_mode < NUM_RENAME_MODES;
+			     rename_mode++)
+				if (strcmp(optarg, rename_mode_string[rename_mode]) == 0)
+					break;
+			if (rename_mode == NUM_RENAME_MODES) {
+				fprintf(stderr, "Unknown rename mode %s\n", optarg);
+				usage();
+			}
+			break;
 
-		if ((min_creat_usec == 0) || (delta < min_creat_usec))
-			min_creat_usec = delta;
+		case OPT_RENAME_NOREPLACE:
+			rename_noreplace = 1;
+			break;
 
-		/*
-		 * Time writing data into the file.
-		 * The timing needs to be done inside the subroutine since
-		 * one file requires many writes.
-		 * In avg_write_usec, we acculumate the average of the average write times.
-		 * In total_write_usec, we track the total time spent in write().
-		 */
-		write_file(child_task, fd, file_size, &avg_write_usec, &total_write_usec,
-			   &min_write_usec, &max_write_usec);
+		case OPT_RENAME_SYNC:
+			rename_sync = 1;
+			break;
 
-		/*
-		 * Time the fsync() operation.
-		 * With the write barrier patch in the kernel,
-		 * this actually flushed the IDE write cache as well.
-		 */
-		if (sync_method & FSYNC_BEFORE_CLOSE) {
-			start(&start_tv);
+		case OPT_DIRECT:	/* Bypass the page cache */
+			direct_io = 1;
+			break;
 
-			if (fsync(fd) == -1) {
-				fprintf(stderr, "fs_mark: fsync failed %s\n",
-					strerror(errno));
-				cleanup_exit();
+		case OPT_OPEN_SYNC:	/* O_DSYNC or O_SYNC writes */
+			for (open_sync = 0; open_sync < NUM_OPEN_SYNC_MODES; open_sync++)
+				if (strcmp(optarg, open_sync_string[open_sync]) == 0)
+					break;
+			if (open_sync == NUM_OPEN_SYNC_MODES) {
+				fprintf(stderr, "Unknown open sync mode %s\n", optarg);
+				usage();
 			}
-			delta = stop(&start_tv, &stop_tv);
-			fsync_usec += delta;
+			break;
 
-			if (delta > max_fsync_usec)
-				max_fsync_usec = delta;
-			if ((min_fsync_usec == 0) || (delta < min_fsync_usec))
-				min_fsync_usec = delta;
-		}
+		case OPT_HUGEPAGES:	/* IO buffers on huge pages */
+			use_hugepages = 1;
+			break;
 
-		/*
-		 * Time the file close
-		 */
-		start(&start_tv);
-		close(fd);
-		delta = stop(&start_tv, &stop_tv);
+		case OPT_WRITE_MODE:	/* How file data is written */
+			for (write_mode = 0; write_mode < NUM_WRITE_MODES; write_mode++)
+				if (strcmp(optarg, write_mode_string[write_mode]) == 0)
+					break;
+			if (write_mode == NUM_WRITE_MODES) {
+				fprintf(stderr, "Unknown write mode %s\n", optarg);
+				usage();
+			}
+			break;
 
-		close_usec += delta;
-		if (delta > max_close_usec)
-			max_close_usec = delta;
+		case OPT_IOVECS:	/* Chunks per pwritev() */
+			write_iovecs = atoi(optarg);
+			if ((write_iovecs < 1) || (write_iovecs > IOV_MAX)) {
+				fprintf(stderr, "IO vectors must be between 1 and %d\n",
+					IOV_MAX);
+				usage();
+			}
+			break;
 
-		if ((min_close_usec == 0) || (delta < min_close_usec))
-			min_close_usec = delta;
+		case OPT_PAYLOAD:	/* What is written to the files */
+			for (payload = 0; payload < NUM_PAYLOADS; payload++)
+				if (strcmp(optarg, payload_string[payload]) == 0)
+					break;
+			if (payload == NUM_PAYLOADS) {
+				fprintf(stderr, "Unknown payload %s\n", optarg);
+				usage();
+			}
+			break;
 
-	}
-	assert(names);
+		case OPT_COMPRESS_RATIO:	/* Compressible random payload */
+			compress_ratio = atof(optarg);
+			if (compress_ratio < 1.0) {
+				fprintf(stderr, "Compression ratio must be at least 1\n");
+				usage();
+			}
+			break;
 
-	if (sync_method & FSYNC_SYNC_SYSCALL) {
-		start(&start_tv);
-		sync();
-		delta = stop(&start_tv, &stop_tv);
+		case OPT_DEDUP_RATIO:	/* Duplicate chunks in the payload */
+			dedup_ratio = atof(optarg);
+			if (dedup_ratio < 1.0) {
+				fprintf(stderr, "Dedup ratio must be at least 1\n");
+				usage();
+			}
+			break;
 
-		/*
-		 * Add the time spent in sync() to the total cost of fsync()
-		 */
-		avg_sync_usec = delta;
-	}
+		case OPT_MIX:	/* Mixed workload */
+			parse_mix(optarg);
+			break;
 
-	/*
-	 * Post writing, in order fsync method.
-	 * Note that we count three system calls into the time spent in fsync() here -
-	 * the open/fsync and close.
-	 */
-	if (sync_method & FSYNC_POST_IN_ORDER) {
-		for (file_index = 0; file_index < num_files; ++file_index) {
-			int fd;
+		case OPT_MIX_FILES:	/* Starting population of --mix */
+			mix_files = atoi(optarg);
+			if (mix_files < 0) {
+				fprintf(stderr, "--mix-files must not be negative\n");
+				usage();
+			}
+			break;
 
-			sprintf(file_target_name, "%s/%s",
-				names[file_index].target_dir,
-				names[file_index].f_name);
+		case OPT_CPU_STATS:	/* Per thread CPU and scheduler accounting */
+			cpu_stats = 1;
+			break;
 
-			start(&start_tv);
-			if ((fd = open(file_target_name, O_RDONLY, 0666)) == -1) {
-				fprintf(stderr, "Error in open of %s : %s\n",
-					file_target_name, strerror(errno));
-				cleanup_exit();
+		case OPT_DEV_STATS:	/* Block device and VM statistics */
+			dev_stats = 1;
+			break;
+
+		case OPT_AFFINITY:	/* Where the worker threads run */
+			for (affinity = 0; affinity < AFFINITY_LIST; affinity++)
+				if (strcmp(optarg, affinity_string[affinity]) == 0)
+					break;
+			if (affinity == AFFINITY_LIST) {
+				int cpus[CPU_SETSIZE];
+
+				free(affinity_cpus);
+				if ((affinity_cpus = strdup(optarg)) == NULL) {
+					fprintf(stderr, "fs_mark: strdup failed: %s\n",
+						strerror(errno));
+					cleanup_exit();
+				}
+				if (parse_cpu_list(affinity_cpus, cpus, CPU_SETSIZE) < 1) {
+					fprintf(stderr, "Invalid --affinity %s\n", optarg);
+					usage();
+				}
 			}
+			break;
 
-			if (fsync(fd) == -1) {
-				fprintf(stderr, "fs_mark: fsync failed %s\n",
-					strerror(errno));
-				cleanup_exit();
+		case OPT_CHURN:	/* Fill, then age the file system */
+			churn_target = atoi(optarg);
+			if ((churn_target < 1) || (churn_target > 99)) {
+				fprintf(stderr,
+					"--churn percent must be between 1 and 99\n");
+				usage();
 			}
+			break;
 
-			close(fd);
-			delta = stop(&start_tv, &stop_tv);
-			fsync_usec += delta;
+		case 'v':	/* verbose stats */
+			verbose_stats = 1;
+			break;
 
-			if (delta > max_fsync_usec)
-				max_fsync_usec = delta;
-			if ((min_fsync_usec == 0) || (delta < min_fsync_usec))
-				min_fsync_usec = delta;
-		}
+		case 'P':	/* latency percentiles */
+			print_percentiles = 1;
+			break;
+
+		case 'T':	/* Keep threads across iterations */
+			persistent_threads = 1;
+			break;
+
+		case 'D':	/* Use Multiple directories */
+			num_subdirs = atoi(optarg);
+			if (num_subdirs < 2) {
+				fprintf(stderr,
+					"Number of subdirs needs to be greater than 1\n");
+				usage();
+			}
+			/*
+			 * Change the policy to a good multi-subdir one
+			 */
+			if (dir_policy == DIR_NO_SUBDIRS)
+			    dir_policy = DIR_TIME_HASH;
+			break;
+
+		case 'd':	/* Set directory path */
+			if (strlen(optarg) >= MAX_NAME_PATH) {
+				fprintf(stderr,
+					"fs_mark: %s directory pathname too long (must be less than %d bytes)\n",
+					optarg, MAX_NAME_PATH);
+				usage();
+			}
+			if ((dir_args = realloc(dir_args,
+					       (num_dirs + 1) * sizeof(char *))) == NULL) {
+				fprintf(stderr,
+					"fs_mark: failed to allocate memory for directories: %s\n",
+					strerror(errno));
+				cleanup_exit();
+			}
+			dir_args[num_dirs] = optarg;
+			num_dirs++;
+			break;
+
+		case 'E':	/* IO engine for the write loop */
+			for (io_engine = 0; io_engine < NUM_IO_ENGINES; io_engine++)
+				if (strcmp(optarg, io_engine_string[io_engine]) == 0)
+					break;
+			if (io_engine == NUM_IO_ENGINES) {
+				fprintf(stderr, "Unknown IO engine %s\n", optarg);
+				usage();
+			}
+#ifndef HAVE_IO_URING
+			if (io_engine == IO_ENGINE_URING) {
+				fprintf(stderr, "io_uring is not supported on this platform\n");
+				usage();
+			}
+#endif
+			break;
+
+		case 'F':	/* Run until FS is full */
+			keep_files = 1;	/* Set keep files as well (hard to fill fs without this!) */
+			do_fill_fs = 1;
+			break;
+
+		case 'k':	/* Leave test files at end */
+			keep_files = 1;
+			break;
+
+		case 'i':	/* Interval reports */
+			if ((interval_nsecs = parse_interval(optarg)) == 0) {
+				fprintf(stderr, "Invalid report interval %s\n",
+					optarg);
+				usage();
+			}
+			break;
+
+		case 'l':	/* Log file name */
+			strncpy(log_file_name, optarg, PATH_MAX);
+			break;
+
+		case 'L':	/* number of iterations */
+			loop_count = atoi(optarg);
+			keep_files = 1;			/* Set keep files as well */
+			break;
+
+		case 'n':	/* Set number of files to test of each size */
+			num_files = atoi(optarg);
+			if (num_files < 1) {
+				fprintf(stderr, "Number of files must be positive\n");
+				usage();
+			}
+			break;
+
+		case 'N':	/* Set number of files to write into each subdirectory */
+			dir_policy = DIR_ROUND_ROBIN;
+			num_per_subdir = atoi(optarg);
+			break;
+
+		case 'p':	/* Set size of names in directories */
+			name_len = atoi(optarg);
+			if (name_len > FILENAME_SIZE) {
+				fprintf(stderr, "Max filename size is %d\n",
+					FILENAME_SIZE);
+				usage();
+			}
+			break;
+
+		case 'Q':	/* Files in flight per thread with -E uring */
+			files_in_flight = atoi(optarg);
+			if ((files_in_flight < 1) ||
+			    (files_in_flight > MAX_FILES_IN_FLIGHT)) {
+				fprintf(stderr,
+					"Files in flight must be between 1 and %d\n",
+					MAX_FILES_IN_FLIGHT);
+				usage();
+			}
+			break;
+
+		case 's':	/* Set specific size (or sizes) to test */
+			parse_file_sizes(optarg);
+			break;
+
+		case 'R':	/* Read back phases after the write loop */
+			parse_read_phases(optarg);
+			break;
+
+		case 'r':	/* Use random file names */
+			rand_len = atoi(optarg);
+			break;
+
+		case 'S':	/* Turn off sync and fsync */
+			sync_method_type = atoi(optarg);
+			switch (sync_method_type) {
+			case 0:
+				sync_method = 0;
+				break;
+			case 1:
+				sync_method = SYNC_TEST_PER_FILE;
+				break;
+			case 2:
+				sync_method = SYNC_TEST_PER_THREAD;
+				break;
+			case 3:
+				sync_method = SYNC_TEST_REVERSE;
+				break;
+			case 4:
+				sync_method = SYNC_TEST_REVERSE_SYNC;
+				break;
+			case 5:
+				sync_method = SYNC_TEST_POST;
+				break;
+			case 6:
+				sync_method = SYNC_TEST_POST_SYNC;
+				break;
+			case 7:
+				sync_method = SYNC_TEST_BATCH;
+				break;
+			case 8:
+				sync_method = SYNC_TEST_PARALLEL_BATCH;
+				break;
+			case 9:
+				sync_method = SYNC_TEST_SYNCFS;
+				break;
+			case 10:
+				sync_method = SYNC_TEST_RANGE;
+				break;
+
+			default:
+				fprintf(stderr, "Max filename size is %d\n",
+					FILENAME_SIZE);
+				usage();
+			}
+			break;
+
+		case 't':	/* Set number of threads */
+			num_threads = atoi(optarg);
+			if (num_threads < 1) {
+				fprintf(stderr, "Number of threads must be positive\n");
+				usage();
+			}
+			break;
+
+		case 'w':	/* Set write buffer size */
+			io_buffer_size = atoi(optarg);
+			if (io_buffer_size < 1) {
+				fprintf(stderr, "IO buffer size must be positive\n");
+				usage();
+			}
+			break;
+
+		case 'h':	/* Print usage and exit */
+			usage();
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if (num_dirs == 0) {
+		fprintf(stderr,
+			"Must specify at least one directory with -d switch\n");
+		usage();
+	}
+	if ((num_subdirs == 0) && (num_per_subdir > 0)) {
+		fprintf(stderr,
+			"Must specify at more than 1 subdirectory with -D switch"
+			" for -N num_per_subdir to make sense\n");
+		usage();
+	}
+
+	/*
+	 * We need at least one thread per specified directory.
+	 * Also, if we specify more threads than directories, divide 
+	 * up the threads & make sure that an even number of threads runs 
+	 * in each one.
+	 */
+	if (num_dirs > num_threads)
+		num_threads = num_dirs;
+	else {
+		int threads_per_dir;
+
+		threads_per_dir = num_threads / num_dirs;
+		if ((num_dirs * threads_per_dir) != num_threads) {
+			fprintf(stderr,
+				"Threads (%d) must be an even multiple the number of directories"
+				" (%d)\n",
+				num_threads, num_dirs);
+			usage();
+		}
+	}
+
+	/*
+	 * The io_uring chains have no place to hook per file work in between.
+	 */
+	if ((io_engine == IO_ENGINE_URING) &&
+	    (sync_method & (FSYNC_BATCH | FSYNC_RANGE))) {
+		fprintf(stderr,
+			"Sync method %d is not supported with -E uring\n",
+			sync_method_type);
+		usage();
+	}
+	if ((io_engine == IO_ENGINE_URING) &&
+	    ((dir_sync == DIRSYNC_FILE) || (dir_sync == DIRSYNC_BATCH))) {
+		fprintf(stderr,
+			"--dir-sync %s is not supported with -E uring\n",
+			dir_sync_string[dir_sync]);
+		usage();
+	}
+
+	if ((rename_noreplace || rename_sync) && (rename_mode == RENAME_NONE)) {
+		fprintf(stderr,
+			"--rename-noreplace and --rename-sync need --rename\n");
+		usage();
+	}
+	if ((rename_mode == RENAME_SUBDIR) && (num_subdirs < 2)) {
+		fprintf(stderr,
+			"--rename subdir needs at least 2 subdirectories with -D\n");
+		usage();
+	}
+	if ((io_engine == IO_ENGINE_URING) && rename_sync) {
+		fprintf(stderr, "--rename-sync is not supported with -E uring\n");
+		usage();
+	}
+	if ((io_engine == IO_ENGINE_URING) && (write_mode != WRITE_MODE_SEQ)) {
+		fprintf(stderr, "--write-mode %s is not supported with -E uring\n",
+			write_mode_string[write_mode]);
+		usage();
+	}
+	if ((write_mode == WRITE_MODE_PWRITEV) &&
+	    ((long long)write_iovecs * io_buffer_size > INT_MAX)) {
+		fprintf(stderr, "--iovecs %d of %d bytes is too much for one pwritev()\n",
+			write_iovecs, io_buffer_size);
+		usage();
+	}
+
+	/*
+	 * --churn runs the --mix loop with only creates, and unlinks in front
+	 * of them once it is full enough. The files have to outlive each
+	 * iteration for that.
+	 */
+	if (churn_target) {
+		if (mix_mode) {
+			fprintf(stderr, "--churn cannot be combined with --mix\n");
+			usage();
+		}
+		if (do_fill_fs) {
+			fprintf(stderr,
+				"--churn cannot be combined with -F, it fills the file system itself\n");
+			usage();
+		}
+		parse_mix("create:1");
+		mix_files = 0;
+		keep_files = 1;
+	}
+
+	/*
+	 * The mixed workload has no write loop for the batch, post loop and
+	 * rename machinery to hook into: its creates fsync() inline or not at all.
+	 */
+	if (mix_mode) {
+		if ((sync_method & ~FSYNC_BEFORE_CLOSE) || (io_engine != IO_ENGINE_SYNC) ||
+		    steal_batch || target_rate || do_fill_fs || read_phases ||
+		    (dir_sync != DIRSYNC_NONE) || (rename_mode != RENAME_NONE)) {
+			fprintf(stderr,
+				"%s only supports -S 0 or -S 1, without -E uring, -F, -R,"
+				" --steal, --rate, --dir-sync and --rename\n",
+				churn_target ? "--churn" : "--mix");
+			usage();
+		}
+		if (mix_files < 0)
+			mix_files = num_files;
+	}
+
+	/*
+	 * -S 10 only persists the file data, the directories make the new
+	 * entries stable.
+	 */
+	if ((sync_method & FSYNC_RANGE) && (dir_sync == DIRSYNC_NONE))
+		dir_sync = DIRSYNC_SUBDIR;
+
+	if (size_dist_spec[0] == 0)
+		snprintf(size_dist_spec, sizeof(size_dist_spec), "%u", file_size);
+
+	/*
+	 * A ratio only makes sense for generated data. Of every dedup_ratio
+	 * chunks written one is unique, the others are copies of dup_chunk.
+	 */
+	if ((compress_ratio > 1.0) || (dedup_ratio > 1.0))
+		payload = PAYLOAD_RANDOM;
+	dedup_threshold = (1.0 - 1.0 / dedup_ratio) * 4294967296.0;
+
+	/*
+	 * Flags for opening the test files. The read back phase bypasses the
+	 * page cache too, or it would only measure the copy out of it.
+	 */
+	write_open_flags = O_CREAT | O_RDWR | O_TRUNC;
+	read_open_flags = O_RDONLY;
+	if (direct_io) {
+		write_open_flags |= O_DIRECT;
+		read_open_flags |= O_DIRECT;
+	}
+	if (write_mode == WRITE_MODE_APPEND)
+		write_open_flags |= O_APPEND;
+	if (open_sync == OPEN_SYNC_DSYNC)
+		write_open_flags |= O_DSYNC;
+	else if (open_sync == OPEN_SYNC_SYNC)
+		write_open_flags |= O_SYNC;
+
+	/*
+	 * Split the open loop rate evenly over the threads.
+	 */
+	if (target_rate)
+		rate_interval_nsec = num_threads * 1000000000.0 / target_rate;
+
+	/*
+	 * Size the job table now that the thread count is known.
+	 * mmap() hands back zeroed, page aligned memory whose pages are not
+	 * touched until first use, so most of each entry gets faulted in by
+	 * the worker that owns it.
+	 */
+	child_tasks_size = num_threads * sizeof(child_job_t);
+	child_tasks = mmap(NULL, child_tasks_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (child_tasks == MAP_FAILED) {
+		fprintf(stderr,
+			"fs_mark: failed to allocate the job table for %d threads: %s\n",
+			num_threads, strerror(errno));
+		cleanup_exit();
+	}
+
+	/*
+	 * Threads are spread round robin over the directories.
+	 */
+	for (thread = 0; thread < num_threads; thread++) {
+		child_tasks[thread].dir_index = thread % num_dirs;
+		strcpy(child_tasks[thread].test_dir, dir_args[thread % num_dirs]);
+	}
+
+	/*
+	 * One queue per directory, holding the files of all of its threads.
+	 */
+	if (steal_batch) {
+		int dir;
+
+		if (posix_memalign((void **)&file_queues, CACHE_LINE_SIZE,
+				   num_dirs * sizeof(file_queue_t)) != 0) {
+			fprintf(stderr,
+				"fs_mark: failed to allocate the file queues\n");
+			cleanup_exit();
+		}
+		for (dir = 0; dir < num_dirs; dir++) {
+			file_queues[dir].next = 0;
+			file_queues[dir].total =
+			    (unsigned long long)num_files * (num_threads / num_dirs);
+		}
+	}
+
+	/*
+	 * One --mix population per directory.
+	 */
+	if (mix_mode) {
+		int dir;
+
+		if ((mix_populations = calloc(num_dirs,
+					      sizeof(mix_population_t))) == NULL) {
+			fprintf(stderr,
+				"fs_mark: failed to allocate the --mix populations\n");
+			cleanup_exit();
+		}
+		for (dir = 0; dir < num_dirs; dir++)
+			pthread_mutex_init(&mix_populations[dir].lock, NULL);
+	}
+
+	/*
+	 * Give each thread its own deterministic random stream.
+	 */
+	for (thread = 0; thread < num_threads; thread++) {
+		child_tasks[thread].thread_index = thread;
+		rng_seed(&child_tasks[thread], thread);
+		payload_seed(child_tasks[thread].payload_state,
+			     ~(unsigned long long)thread);
+		child_tasks[thread].numa_node = -1;
+	}
+	if (affinity != AFFINITY_NONE)
+		setup_affinity();
+	return;
+}
+
+/*
+ * Characters used for the random part of file names.
+ */
+static const char rand_name_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+#define NUM_RAND_NAME_CHARS	(sizeof(rand_name_chars) - 1)
+
+/*
+ * Build "dir/f_name" into buf without going through printf.
+ */
+static inline char *build_path(char *buf, const char *dir, const char *f_name)
+{
+	char *end;
+
+	end = stpcpy(buf, dir);
+	*end++ = '/';
+	strcpy(end, f_name);
+
+	return (buf);
+}
+
+/*
+ * Build the full path of a file into the thread's reusable path buffer.
+ */
+static inline char *file_path(child_job_t *child_task, const char *dir,
+			      const char *f_name)
+{
+	return (build_path(child_task->path, dir, f_name));
+}
+
+/*
+ * Rebuild the sequential part of the file names for a new second.
+ * Each filename will be name_len characters long, the sequential part is
+ * the least significant hex digits of the time stamp (the most significant
+ * do not change), padded with '~' if the time stamp is short.
+ * This runs once a second, not once a file.
+ */
+static void update_seq_name(child_job_t *child_task, unsigned long sec_time)
+{
+	char stamp[32];
+	int seq_len, stamp_len, skip;
+
+	seq_len = name_len - rand_len;
+	stamp_len = sprintf(stamp, "%lx", sec_time);
+
+	skip = stamp_len - seq_len;
+	if (skip > 0) {		/* More sequential bytes than we need */
+		memcpy(child_task->seq_name, &stamp[skip], seq_len);
+	} else {
+		memcpy(child_task->seq_name, stamp, stamp_len);
+		memset(child_task->seq_name + stamp_len, '~', seq_len - stamp_len);
+	}
+	child_task->seq_name[seq_len] = 0;
+	child_task->seq_sec = sec_time;
+}
+
+/*
+ * Pick the size of the next file from the -s distribution.
+ * A uniform number in (0, 1] built from the top 53 bits of the generator.
+ */
+static inline double rng_uniform(child_job_t *child_task)
+{
+	return (((rng_next(child_task) >> 11) + 1) * (1.0 / 9007199254740992.0));
+}
+
+static unsigned int pick_file_size(child_job_t *child_task)
+{
+	unsigned long long r;
+	double z, size;
+	int i;
+
+	switch (size_dist) {
+	case SIZE_DIST_LIST:
+		r = rng_next(child_task) >> 32;
+		for (i = 0; r >= size_dist_cumul[i]; i++)
+			;
+		return (size_dist_size[i]);
+
+	case SIZE_DIST_LOGNORMAL:
+		/*
+		 * Box-Muller for a standard normal, then scale it.
+		 * Sizes are kept within [1, max] and, with --direct,
+		 * rounded up to the alignment (max is aligned).
+		 */
+		z = sqrt(-2.0 * log(rng_uniform(child_task))) *
+		    cos(2.0 * M_PI * rng_uniform(child_task));
+		size = exp(size_dist_mu + size_dist_sigma * z);
+		if (size < 1.0)
+			size = 1.0;
+		if (size > file_size)
+			size = file_size;
+		if (direct_align)
+			return (((unsigned int)size + direct_align - 1) /
+				direct_align * direct_align);
+		return ((unsigned int)size);
+
+	default:
+		return (file_size);
+	}
+}
+
+/*
+ * Setup a file name and pick the file's size.
+ * This runs on every file inside the timed loop, so it does no system calls,
+ * no formatted printing and no directory lookups: the subdirectories are
+ * made in setup(), the time comes from the last time stamp the caller took,
+ * and the random characters are taken 16 bits at a time from the per thread
+ * generator.
+ */
+void setup_file_name(child_job_t *child_task, int file_index,
+		     unsigned long long now_nsec)
+{
+	struct name_entry *entry;
+	unsigned long sec_time;
+	unsigned long long val = 0;
+	int seq_len, j;
+	char *name;
+
+	sec_time = child_task->wall_base_sec +
+	    (now_nsec - child_task->clock_base_nsec) / 1000000000ULL;
+
+	/*
+	 * If this is the first run, record this time in
+	 * start_sec_time.
+	 */
+	if (child_task->start_sec_time == 0) {
+	    child_task->start_sec_time = sec_time;
+	}
+
+	entry = &child_task->names[file_index];
+
+	/*
+	 * Now pick a directory to stick this file in.
+	 * 
+	 */
+	switch (dir_policy) {
+	case DIR_NO_SUBDIRS:
+		break;
+
+	case DIR_ROUND_ROBIN:
+		if (num_per_subdir) {
+			/*
+			 * Stick the specified number of files in each directory before 
+			 * moving on.
+			 */
+			if (child_task->files_in_subdir >= num_per_subdir) {
+				child_task->current_subdir++;
+				child_task->files_in_subdir = 0;
+			}
+			child_task->current_subdir =
+			    child_task->current_subdir % num_subdirs;
+			child_task->files_in_subdir++;
+		}
+		break;
+
+	case DIR_TIME_HASH:
+		if ((sec_time - child_task->start_sec_time) > secs_per_directory) {
+			child_task->current_subdir =
+			    (child_task->current_subdir + 1) % num_subdirs;
+			child_task->start_sec_time = sec_time;
+		}
+		break;
+
+	default:
+		fprintf(stderr, "fs_mark: invalid directory policy\n");
+		exit(1);
+		break;
+	}
+
+	strcpy(entry->target_dir,
+	       child_task->subdir_names[child_task->current_subdir]);
+	child_task->subdir_dirty[child_task->current_subdir] = 1;
+
+	/*
+	 * With --rename the file is written somewhere else first.
+	 */
+	switch (rename_mode) {
+	case RENAME_TMPDIR:
+		strcpy(entry->write_dir, child_task->tmp_dir);
+		break;
+
+	case RENAME_SUBDIR:
+		strcpy(entry->write_dir,
+		       child_task->subdir_names[(child_task->current_subdir + 1) %
+						num_subdirs]);
+		break;
+
+	default:
+		strcpy(entry->write_dir, entry->target_dir);
+		break;
+	}
+
+	/*
+	 * Sequential part, only rebuilt when the second changes
+	 */
+	seq_len = name_len - rand_len;
+	if (sec_time != child_task->seq_sec)
+		update_seq_name(child_task, sec_time);
+	memcpy(entry->f_name, child_task->seq_name, seq_len);
+
+	/*
+	 * Random part: letters and digits picked from a table
+	 */
+	name = entry->f_name + seq_len;
+	for (j = 0; j < rand_len; j++) {
+		if ((j & 3) == 0)
+			val = rng_next(child_task);
+		name[j] = rand_name_chars[((val & 0xffff) * NUM_RAND_NAME_CHARS) >> 16];
+		val >>= 16;
+	}
+	name[rand_len] = 0;	/* Terminate string with NULL */
+
+	entry->size = pick_file_size(child_task);
+
+	return;
+}
+
+/*
+ * Make sure the names array has room for "count" files.
+ */
+void grow_names(child_job_t *child_task, int count)
+{
+	struct name_entry *names;
+	int size;
+
+	if (count <= child_task->names_size)
+		return;
+
+	for (size = child_task->names_size ? child_task->names_size : num_files;
+	     size < count; size *= 2)
+		;
+	if ((names = realloc(child_task->names,
+			     size * sizeof(struct name_entry))) == NULL) {
+		fprintf(stderr,
+			"fs_mark: failed to allocate memory for file names: %s\n",
+			strerror(errno));
+		cleanup_exit();
+	}
+	child_task->names = names;
+	child_task->names_size = size;
+}
+
+/*
+ * Claim the next batch of files (--steal), from our own directory's queue
+ * first and then from the others in turn.
+ * Returns the number of files claimed, 0 once every queue is empty.
+ */
+int claim_files(child_job_t *child_task)
+{
+	file_queue_t *queue;
+	unsigned long long first;
+	int i, count;
+
+	for (i = 0; i < num_dirs; i++) {
+		queue = &file_queues[(child_task->dir_index + i) % num_dirs];
+
+		/*
+		 * Skip empty queues without dirtying their cache line.
+		 */
+		if (__atomic_load_n(&queue->next, __ATOMIC_RELAXED) >= queue->total)
+			continue;
+
+		first = __atomic_fetch_add(&queue->next, steal_batch,
+					   __ATOMIC_RELAXED);
+		if (first >= queue->total)
+			continue;
+
+		count = steal_batch;
+		if (first + count > queue->total)
+			count = queue->total - first;
+		if (i)
+			child_task->files_stolen += count;
+		return (count);
+	}
+
+	return (0);
+}
+
+/*
+ * Return non zero if this thread has a file "file_index" to write.
+ * Without --steal each thread writes num_files files, with it the files
+ * are handed out one batch at a time until all the queues are empty.
+ */
+int have_file(child_job_t *child_task, int file_index)
+{
+	int count;
+
+	if (file_index < child_task->files_claimed)
+		return (1);
+
+	if (!steal_batch || ((count = claim_files(child_task)) == 0))
+		return (0);
+
+	child_task->files_claimed += count;
+	grow_names(child_task, child_task->files_claimed);
+	return (1);
+}
+
+/*
+ * Refill the file queues for the next iteration.
+ */
+void reset_file_queues(void)
+{
+	int dir;
+
+	if (!steal_batch)
+		return;
+
+	for (dir = 0; dir < num_dirs; dir++)
+		file_queues[dir].next = 0;
+}
+
+/*
+ * Allocate an IO buffer, page aligned so it can be used with O_DIRECT, or
+ * with --hugepages on huge pages, which also saves TLB misses on big
+ * buffers. The buffers live as long as the threads, so they are never freed.
+ */
+void *alloc_io_buffer(size_t size)
+{
+	void *buffer;
+	int ret;
+
+	if (use_hugepages) {
+		size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+		buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buffer == MAP_FAILED) {
+			fprintf(stderr,
+				"fs_mark: failed to allocate a %zu byte io buffer on huge pages"
+				" (see /proc/sys/vm/nr_hugepages): %s\n",
+				size, strerror(errno));
+			cleanup_exit();
+		}
+		return (buffer);
+	}
+
+	if ((ret = posix_memalign(&buffer, sysconf(_SC_PAGESIZE), size)) != 0) {
+		fprintf(stderr, "fs_mark: failed to allocate io buffer: %s\n",
+			strerror(ret));
+		cleanup_exit();
+	}
+	return (buffer);
+}
+
+/*
+ * Size the payload ring of a thread to "buffers" chunks. Each chunk in
+ * flight at the same time needs its own buffer: the iovecs of one
+ * pwritev(), or every write of every file in flight with -E uring. The
+ * engine does not change during a run, so this allocates once per thread.
+ */
+void alloc_payload_ring(child_job_t *child_task, int buffers)
+{
+	if (child_task->payload_ring_size >= buffers)
+		return;
+
+	child_task->payload_ring =
+	    alloc_io_buffer((size_t)buffers * io_buffer_size);
+	child_task->payload_ring_size = buffers;
+	bind_to_node(child_task->payload_ring, (size_t)buffers * io_buffer_size,
+		     child_task->numa_node);
+}
+
+/*
+ * Generate the chunk that every duplicate write repeats. It is the same in
+ * all threads, so copies dedup across the whole run.
+ */
+void setup_payload(void)
+{
+	unsigned long long state[4][PAYLOAD_LANES];
+
+	dup_chunk = alloc_io_buffer(io_buffer_size);
+	payload_seed(state, PAYLOAD_DUP_SEED);
+	fill_payload(state, dup_chunk, io_buffer_size);
+}
+
+/*
+ * Find the direct IO alignment of the file system a directory is on, by
+ * creating a probe file there. Returns 0 if it does not support O_DIRECT.
+ * Kernels that cannot report it through statx() get DEFAULT_DIRECT_ALIGN,
+ * the smallest logical block size of any device.
+ */
+/*
+ * The logical block size of the device an open file is on, for kernels
+ * that cannot report the direct IO alignment. Asks the device itself
+ * (through its /dev/block node), then sysfs, the disk's queue for a
+ * partition. Without a block device, st_blksize is the best guess.
+ */
+static unsigned int logical_block_size(int fd)
+{
+	char path[PATH_MAX];
+	unsigned int size = 0;
+	struct stat stat_buf;
+	int dev_fd, i;
+	FILE *fp;
+
+	if (fstat(fd, &stat_buf) == -1)
+		return (DEFAULT_DIRECT_ALIGN);
+
+	if (major(stat_buf.st_dev) != 0) {
+#ifdef BLKSSZGET
+		int block_size;
+
+		snprintf(path, sizeof(path), "/dev/block/%u:%u",
+			 major(stat_buf.st_dev), minor(stat_buf.st_dev));
+		if ((dev_fd = open(path, O_RDONLY)) >= 0) {
+			if ((ioctl(dev_fd, BLKSSZGET, &block_size) == 0) &&
+			    (block_size > 0))
+				size = block_size;
+			close(dev_fd);
+		}
+#endif
+		for (i = 0; (size == 0) && (i < 2); i++) {
+			snprintf(path, sizeof(path),
+				 "%s/%u:%u/%squeue/logical_block_size",
+				 SYS_DEV_BLOCK_PATH, major(stat_buf.st_dev),
+				 minor(stat_buf.st_dev), i ? "../" : "");
+			if ((fp = fopen(path, "r")) == NULL)
+				continue;
+			if (fscanf(fp, "%u", &size) != 1)
+				size = 0;
+			fclose(fp);
+		}
+	}
+
+	if (size == 0)
+		size = stat_buf.st_blksize;
+	return (size ? size : DEFAULT_DIRECT_ALIGN);
+}
+
+unsigned int get_direct_align(const char *dir_name)
+{
+	char probe[MAX_FILE_PATH];
+	unsigned int align = 0;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+#endif
+	int fd;
+
+	if ((mkdir(dir_name, 0777) != 0) && (errno != EEXIST)) {
+		fprintf(stderr, "fs_mark: mkdir %s failed: %s\n", dir_name,
+			strerror(errno));
+		cleanup_exit();
+	}
+
+	build_path(probe, dir_name, DIRECT_PROBE_NAME);
+	if ((fd = open(probe, O_CREAT | O_RDWR | O_TRUNC | O_DIRECT, 0666)) == -1) {
+		if (errno == EINVAL)
+			return (0);
+		fprintf(stderr, "fs_mark: open of %s failed: %s\n", probe,
+			strerror(errno));
+		cleanup_exit();
+	}
+
+#ifdef STATX_DIOALIGN
+	if ((statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0) &&
+	    (stx.stx_mask & STATX_DIOALIGN)) {
+		align = stx.stx_dio_offset_align;
+
+		/*
+		 * The IO buffers are only page aligned.
+		 */
+		if (stx.stx_dio_mem_align > sysconf(_SC_PAGESIZE)) {
+			fprintf(stderr,
+				"fs_mark: O_DIRECT on %s needs %u byte aligned buffers\n",
+				dir_name, stx.stx_dio_mem_align);
+			close(fd);
+			unlink(probe);
+			cleanup_exit();
+		}
+	}
+#endif
+	if (align == 0)
+		align = logical_block_size(fd);
+
+	close(fd);
+	unlink(probe);
+	return (align);
+}
+
+/*
+ * With --direct, check that every write and read the test makes is
+ * aligned for each -d file system.
+ */
+void check_direct_io(void)
+{
+	unsigned int align;
+	int i;
+
+	for (i = 0; i < num_dirs; i++) {
+		if ((align = get_direct_align(dir_args[i])) == 0) {
+			fprintf(stderr, "fs_mark: %s does not support O_DIRECT\n",
+				dir_args[i]);
+			cleanup_exit();
+		}
+		if (align > direct_align)
+			direct_align = align;
+	}
+
+	/*
+	 * Log-normal sizes are rounded up to the alignment as they are
+	 * picked, their limit is rounded down so that stays within it.
+	 */
+	if (size_dist == SIZE_DIST_LOGNORMAL)
+		file_size -= file_size % direct_align;
+
+	if ((file_size % direct_align) || (io_buffer_size % direct_align) ||
+	    (file_size == 0 && size_dist == SIZE_DIST_LOGNORMAL)) {
+		fprintf(stderr,
+			"fs_mark: with --direct the file size (%u) and IO size (%d)"
+			" must be multiples of %u bytes\n",
+			file_size, io_buffer_size, direct_align);
+		cleanup_exit();
+	}
+	for (i = 0; i < size_dist_count; i++) {
+		if (size_dist_size[i] % direct_align) {
+			fprintf(stderr,
+				"fs_mark: with --direct the file size %u must be a multiple of %u bytes\n",
+				size_dist_size[i], direct_align);
+			cleanup_exit();
+		}
+	}
+}
+
+/*
+ * Setup and initial state
+ */
+void setup(child_job_t *child_task)
+{
+	struct timeval now;
+	int subdir, subdir_count;
+
+	/*
+	 * The random number generator is seeded once per thread in process_args().
+	 * Tie the timing clock to the wall clock for the file name time stamps.
+	 */
+	(void)gettimeofday(&now, (struct timezone *)0);
+	child_task->clock_base_nsec = nsnow();
+	child_task->wall_base_sec = now.tv_sec;
+	child_task->seq_sec = 0;
+
+	if (num_subdirs > 0) {
+		/*
+		 * Pick a starting directory to write into.
+		 * To avoid having short runs always write into the first
+		 * few directories, pick a starting directory based on the time value.
+		 */
+		child_task->current_subdir = now.tv_sec % num_subdirs;
+		child_task->files_in_subdir = 0;
+		child_task->start_sec_time = 0;
+	}
+
+	/*
+	 * Allocate the io_buffer from this thread so it is local to the node
+	 * we run on, and keep it for the following iterations.
+	 */
+	if (child_task->io_buffer == NULL) {
+		child_task->io_buffer = alloc_io_buffer(io_buffer_size);
+		bind_to_node(child_task->io_buffer, io_buffer_size,
+			     child_task->numa_node);
+	}
+
+	/*
+	 * Room for the chunk order of the largest file, or for the IO
+	 * vectors of one pwritev().
+	 */
+	if ((write_mode == WRITE_MODE_RANDOM) && (child_task->chunk_order == NULL) &&
+	    ((child_task->chunk_order =
+	      calloc((file_size + io_buffer_size - 1) / io_buffer_size + 1,
+		     sizeof(int))) == NULL)) {
+		fprintf(stderr, "fs_mark: failed to allocate the chunk order: %s\n",
+			strerror(errno));
+		cleanup_exit();
+	}
+	if ((write_mode == WRITE_MODE_PWRITEV) && (child_task->iov == NULL) &&
+	    ((child_task->iov = calloc(write_iovecs, sizeof(struct iovec))) == NULL)) {
+		fprintf(stderr, "fs_mark: failed to allocate the IO vectors: %s\n",
+			strerror(errno));
+		cleanup_exit();
+	}
+
+	/*
+	 * Clear the io_buffer, it is the payload unless --payload random
+	 */
+	memset(child_task->io_buffer, 0, io_buffer_size);
+	if ((payload != PAYLOAD_ZERO) && (io_engine == IO_ENGINE_SYNC))
+		alloc_payload_ring(child_task, write_mode == WRITE_MODE_PWRITEV ?
+				   write_iovecs : 1);
+
+	/*
+	 * Create my high level test directory
+	 */
+	if ((mkdir(child_task->test_dir, 0777) != 0) && (errno != EEXIST)) {
+		fprintf(stderr,
+			"fill_dir:mkdir %s failed: %s\n", child_task->test_dir,
+			strerror(errno));
+		cleanup_exit();
+	}
+
+	/*
+	 * And the directory files are written in before being renamed.
+	 */
+	if (rename_mode == RENAME_TMPDIR) {
+		snprintf(child_task->tmp_dir, MAX_DIR_PATH, "%s/%s",
+			 child_task->test_dir, RENAME_TMP_DIR_NAME);
+		if ((mkdir(child_task->tmp_dir, 0777) != 0) && (errno != EEXIST)) {
+			fprintf(stderr, "fs_mark: mkdir %s failed: %s\n",
+				child_task->tmp_dir, strerror(errno));
+			cleanup_exit();
+		}
+	}
+
+	/*
+	 * Make all of the subdirectory entries (i.e., /mnt/1/test/00) up front
+	 * so the file loop never has to.
+	 * With no subdirectories, entry 0 is the test directory itself.
+	 */
+	subdir_count = (num_subdirs > 0) ? num_subdirs : 1;
+	if (child_task->subdir_names == NULL) {
+		if (((child_task->subdir_names =
+		      calloc(subdir_count, MAX_DIR_PATH)) == NULL) ||
+		    ((child_task->subdir_dirty = calloc(subdir_count, 1)) == NULL)) {
+			fprintf(stderr,
+				"fs_mark: failed to allocate memory for subdirectory names: %s\n",
+				strerror(errno));
+			cleanup_exit();
+		}
+	}
+
+	for (subdir = 0; subdir < subdir_count; subdir++) {
+		if (num_subdirs == 0) {
+			strcpy(child_task->subdir_names[subdir],
+			       child_task->test_dir);
+			continue;
+		}
+
+		snprintf(child_task->subdir_names[subdir], MAX_DIR_PATH,
+			 "%s/%02x", child_task->test_dir, subdir);
+		if ((mkdir(child_task->subdir_names[subdir], 0777) != 0)
+		    && (errno != EEXIST)) {
+			fprintf(stderr, "fs_mark: mkdir %s failed: %s\n",
+				child_task->subdir_names[subdir], strerror(errno));
+			cleanup_exit();
+		}
+	}
+
+	return;
+}
+
+/*
+ * Return an integer to represent the %full (similar hopefully to what df returns!)
+ */
+int get_df_full(char *dir_name)
+{
+	struct statfs fs_buf;
+	float df_used, used_blocks;
+	int df_percent_used;
+
+	if (statfs(dir_name, &fs_buf) == -1) {
+		fprintf(stderr, "fs_mark: statfs failed on %s %s\n", dir_name,
+			strerror(errno));
+		cleanup_exit();
+	}
+
+	used_blocks = (float)(fs_buf.f_blocks - fs_buf.f_bavail);
+
+	df_used = (used_blocks / fs_buf.f_blocks);
+
+	df_percent_used = (int)(100 * df_used);
+
+	return (df_percent_used);
+}
+
+/*
+ * Return an unsigned long long with number of bytes left in file system.
+ */
+unsigned long long get_bytes_free(char *dir_name)
+{
+	struct statfs fs_buf;
+	unsigned long long bytes_free;
+
+	if (statfs(dir_name, &fs_buf) == -1) {
+		fprintf(stderr, "fs_mark: statfs failed on %s %s\n", dir_name,
+			strerror(errno));
+		cleanup_exit();
+	}
+
+	bytes_free = (unsigned long long)fs_buf.f_bavail;
+	bytes_free = bytes_free * fs_buf.f_bsize;
+
+	return (bytes_free);
+}
+
+/*
+ * Find the block device a directory is on. File systems with an anonymous
+ * device number (btrfs, overlay...) are looked up in the mount table and
+ * their source is used if it is a block device.
+ * Returns -1 if there is none, as on tmpfs or NFS.
+ */
+int find_block_dev(const char *dir_name, dev_t *dev, char *name, int size)
+{
+	char path[PATH_MAX], line[PATH_MAX * 2], source[PATH_MAX];
+	struct stat st, dev_st;
+	unsigned int dev_major, dev_minor;
+	char *sep;
+	ssize_t len;
+	FILE *fp;
+
+	if (stat(dir_name, &st) == -1)
+		return (-1);
+
+	*dev = st.st_dev;
+	if ((major(*dev) == 0) && ((fp = fopen(MOUNTINFO_PATH, "r")) != NULL)) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			if ((sscanf(line, "%*d %*d %u:%u", &dev_major, &dev_minor) != 2) ||
+			    (makedev(dev_major, dev_minor) != st.st_dev) ||
+			    ((sep = strstr(line, " - ")) == NULL) ||
+			    (sscanf(sep + 3, "%*s %4095s", source) != 1))
+				continue;
+			if ((stat(source, &dev_st) == 0) && S_ISBLK(dev_st.st_mode)) {
+				*dev = dev_st.st_rdev;
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	if (major(*dev) == 0)
+		return (-1);
+
+	/*
+	 * The sysfs entry links to the device, named as in /proc/diskstats.
+	 */
+	snprintf(path, sizeof(path), "%s/%u:%u", SYS_DEV_BLOCK_PATH,
+		 major(*dev), minor(*dev));
+	if ((len = readlink(path, line, sizeof(line) - 1)) > 0) {
+		line[len] = 0;
+		sep = strrchr(line, '/');
+		snprintf(name, size, "%s", sep ? sep + 1 : line);
+	} else
+		snprintf(name, size, "%u:%u", major(*dev), minor(*dev));
+
+	return (0);
+}
+
+/*
+ * Read the IO counters of a block device from sysfs, or from
+ * /proc/diskstats without it. Returns -1 if neither has the device.
+ */
+int read_disk_stat(dev_t dev, disk_stat_t *stat)
+{
+	char path[PATH_MAX], line[PATH_MAX];
+	unsigned int dev_major, dev_minor;
+	int found = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%u:%u/stat", SYS_DEV_BLOCK_PATH,
+		 major(dev), minor(dev));
+	if ((fp = fopen(path, "r")) != NULL) {
+		found = (fscanf(fp,
+				"%llu %*u %llu %*u %llu %*u %llu %*u %*u %llu %llu",
+				&stat->read_ios, &stat->read_sectors,
+				&stat->write_ios, &stat->write_sectors,
+				&stat->io_ticks_ms, &stat->time_in_queue_ms) == 6);
+		fclose(fp);
+		if (found)
+			return (0);
+	}
+
+	if ((fp = fopen(DISKSTATS_PATH, "r")) == NULL)
+		return (-1);
+	while (!found && (fgets(line, sizeof(line), fp) != NULL)) {
+		found = (sscanf(line,
+				"%u %u %*s %llu %*u %llu %*u %llu %*u %llu %*u %*u %llu %llu",
+				&dev_major, &dev_minor, &stat->read_ios,
+				&stat->read_sectors, &stat->write_ios,
+				&stat->write_sectors, &stat->io_ticks_ms,
+				&stat->time_in_queue_ms) == 8) &&
+		    (makedev(dev_major, dev_minor) == dev);
+	}
+	fclose(fp);
+
+	return (found ? 0 : -1);
+}
+
+/*
+ * Read the dirty and writeback page counts.
+ */
+void read_vm_stat(vm_stat_t *vm)
+{
+	char line[MAX_STRING_SIZE];
+	FILE *fp;
+
+	memset(vm, 0, sizeof(*vm));
+	if ((fp = fopen(VMSTAT_PATH, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "nr_dirty %llu", &vm->nr_dirty) == 1)
+			continue;
+		(void)sscanf(line, "nr_writeback %llu", &vm->nr_writeback);
+	}
+	fclose(fp);
+}
+
+/*
+ * --churn only replaces files it created itself, so it has to start below
+ * the target on every file system to have any files to replace.
+ */
+void check_churn_start(void)
+{
+	int i, df_full;
+
+	for (i = 0; i < num_dirs; i++) {
+		if ((mkdir(dir_args[i], 0777) != 0) && (errno != EEXIST)) {
+			fprintf(stderr, "fs_mark: mkdir %s failed: %s\n",
+				dir_args[i], strerror(errno));
+			cleanup_exit();
+		}
+		if ((df_full = get_df_full(dir_args[i])) >= churn_target) {
+			fprintf(stderr,
+				"fs_mark: %s is already %d%% full, --churn needs to start"
+				" below its target of %d%%\n",
+				dir_args[i], df_full, churn_target);
+			cleanup_exit();
+		}
+	}
+}
+
+/*
+ * Work out which block device each -d directory is on for --dev-stats.
+ * Directories on the same device share one entry.
+ */
+void setup_dev_stats(void)
+{
+	char name[MAX_STRING_SIZE];
+	disk_stat_t stat;
+	dev_t dev;
+	int i, d;
+
+	if (((block_devs = calloc(num_dirs, sizeof(block_dev_t))) == NULL) ||
+	    ((dir_block_dev = calloc(num_dirs, sizeof(int))) == NULL)) {
+		fprintf(stderr, "fs_mark: failed to allocate the device table\n");
+		cleanup_exit();
+	}
+
+	for (i = 0; i < num_dirs; i++) {
+		dir_block_dev[i] = -1;
+		if ((find_block_dev(dir_args[i], &dev, name, sizeof(name)) == -1) ||
+		    (read_disk_stat(dev, &stat) == -1)) {
+			fprintf(stderr,
+				"fs_mark: %s is not on a block device, --dev-stats leaves it out\n",
+				dir_args[i]);
+			continue;
+		}
+		for (d = 0; d < num_block_devs; d++)
+			if (block_devs[d].dev == dev)
+				break;
+		if (d == num_block_devs) {
+			block_devs[d].dev = dev;
+			strcpy(block_devs[d].name, name);
+			num_block_devs++;
+		}
+		dir_block_dev[i] = d;
+	}
+}
+
+/*
+ * Sample the devices and the VM before an iteration.
+ */
+void dev_stats_start(void)
+{
+	int d;
+
+	for (d = 0; d < num_block_devs; d++)
+		(void)read_disk_stat(block_devs[d].dev, &block_devs[d].start);
+	read_vm_stat(&vm_start);
+	dev_start_nsec = nsnow();
+}
+
+/*
+ * ... and after it, once the thread stats are in, to work out what the
+ * devices did for the bytes the iteration wrote.
+ */
+void dev_stats_stop(fs_mark_stat_t *iteration_stats)
+{
+	unsigned long long queue_ms = 0, logical_bytes = 0;
+	disk_stat_t now, *delta;
+	double secs;
+	int d, i;
+
+	dev_wall_nsec = nsnow() - dev_start_nsec;
+	read_vm_stat(&vm_stop);
+	if (dev_wall_nsec == 0)
+		dev_wall_nsec = 1;
+	secs = dev_wall_nsec / 1000000000.0;
+
+	for (d = 0; d < num_block_devs; d++) {
+		if (read_disk_stat(block_devs[d].dev, &now) == -1)
+			now = block_devs[d].start;
+		delta = &block_devs[d].delta;
+		delta->read_ios = now.read_ios - block_devs[d].start.read_ios;
+		delta->read_sectors = now.read_sectors - block_devs[d].start.read_sectors;
+		delta->write_ios = now.write_ios - block_devs[d].start.write_ios;
+		delta->write_sectors =
+		    now.write_sectors - block_devs[d].start.write_sectors;
+		delta->io_ticks_ms = now.io_ticks_ms - block_devs[d].start.io_ticks_ms;
+		delta->time_in_queue_ms =
+		    now.time_in_queue_ms - block_devs[d].start.time_in_queue_ms;
+		block_devs[d].logical_bytes = 0ULL;
+
+		iteration_stats->dev_ios += delta->read_ios + delta->write_ios;
+		iteration_stats->dev_bytes_written +=
+		    delta->write_sectors * DISK_SECTOR_SIZE;
+		queue_ms += delta->time_in_queue_ms;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		if ((d = dir_block_dev[child_tasks[i].dir_index]) < 0)
+			continue;
+		block_devs[d].logical_bytes +=
+		    child_tasks[i].thread_stats.bytes_written;
+		logical_bytes += child_tasks[i].thread_stats.bytes_written;
+	}
+
+	iteration_stats->dev_iops = iteration_stats->dev_ios / secs;
+	iteration_stats->dev_queue_depth = queue_ms / (secs * 1000.0);
+	iteration_stats->write_amplification = logical_bytes ?
+	    (double)iteration_stats->dev_bytes_written / logical_bytes : 0.0;
+}
+
+/*
+ * Convert a measured time in nsecs into the units we report in.
+ */
+static inline unsigned long long report_time(unsigned long long nsecs)
+{
+	return (nsecs / REPORT_NSECS_PER_UNIT);
+}
+
+/*
+ * Map a latency value to its histogram bucket.
+ */
+static inline int hist_index(unsigned long long value)
+{
+	int msb, shift;
+
+	if (value < HIST_SUB_BUCKETS)
+		return ((int)value);
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - (HIST_SUB_BUCKET_BITS - 1);
+
+	return (HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF_BUCKETS +
+		(int)((value >> shift) - HIST_HALF_BUCKETS));
+}
+
+/*
+ * Return the highest value that maps into the given histogram bucket.
+ */
+static unsigned long long hist_bucket_value(int index)
+{
+	int shift;
+	unsigned long long top;
+
+	if (index < HIST_SUB_BUCKETS)
+		return ((unsigned long long)index);
+
+	shift = (index - HIST_SUB_BUCKETS) / HIST_HALF_BUCKETS + 1;
+	top = (index - HIST_SUB_BUCKETS) % HIST_HALF_BUCKETS + HIST_HALF_BUCKETS;
+
+	return (((top + 1) << shift) - 1);
+}
+
+/*
+ * Record one latency sample.
+ */
+static inline void hist_record(fs_mark_hist_t *hist, unsigned long long value)
+{
+	if ((hist->count == 0) || (value < hist->min))
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->total += value;
+	hist->buckets[hist_index(value)]++;
+}
+
+/*
+ * Record the latency of one system call made by a worker thread.
+ * Besides the histogram, this bumps the running counters sampled by the
+ * interval reporter (-i). Only the owning thread writes them, so plain
+ * relaxed atomic stores are enough and no lock is taken.
+ */
+static inline void record_op(child_job_t *child_task, int op,
+			     unsigned long long delta)
+{
+	hist_record(&child_task->thread_stats.op_hist[op], delta);
+
+	if (interval_nsecs) {
+		__atomic_store_n(&child_task->progress_op_count[op],
+				 child_task->progress_op_count[op] + 1,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&child_task->progress_op_nsec[op],
+				 child_task->progress_op_nsec[op] + delta,
+				 __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Count one more file written for the interval reporter.
+ */
+static inline void record_file_done(child_job_t *child_task)
+{
+	if (interval_nsecs)
+		__atomic_store_n(&child_task->progress_files,
+				 child_task->progress_files + 1,
+				 __ATOMIC_RELAXED);
+}
+
+/*
+ * Size class of a file, see size_class_string.
+ */
+static inline int size_class(unsigned int size)
+{
+	int class = 0;
+
+	for (size >>= SIZE_CLASS_SHIFT; size && (class < NUM_SIZE_CLASSES - 1);
+	     size >>= 2)
+		class++;
+
+	return (class);
+}
+
+/*
+ * Record a finished file: its FILE latency, overall and for its size
+ * class, and the bytes written.
+ */
+static inline void record_file(child_job_t *child_task, unsigned int size,
+			       unsigned long long delta)
+{
+	record_op(child_task, OP_FILE, delta);
+	hist_record(&child_task->thread_stats.size_hist[size_class(size)], delta);
+	child_task->thread_stats.bytes_written += size;
+	record_file_done(child_task);
+}
+
+/*
+ * Intended start time of a file with --rate.
+ * Each thread's timeline is offset by a fraction of the interval, so the
+ * files of all the threads arrive evenly spread instead of in bursts.
+ */
+static inline unsigned long long file_start_nsec(child_job_t *child_task,
+						 unsigned long long loop_start,
+						 int file_index)
+{
+	return (loop_start + (unsigned long long)
+		((file_index + (double)child_task->thread_index / num_threads) *
+		 rate_interval_nsec));
+}
+
+/*
+ * Sleep until the timing clock reaches "when".
+ * Stores the clock reading at wake up in *now and returns the time slept.
+ */
+static unsigned long long sleep_until(unsigned long long when,
+				      unsigned long long *now)
+{
+	unsigned long long begin, left;
+	struct timespec ts;
+
+	begin = *now = nsnow();
+	while (*now < when) {
+		left = when - *now;
+		ts.tv_sec = left / 1000000000ULL;
+		ts.tv_nsec = left % 1000000000ULL;
+		nanosleep(&ts, NULL);
+		*now = nsnow();
+	}
+
+	return (*now - begin);
+}
+
+/*
+ * Add all of the samples in "from" into "to".
+ */
+void hist_merge(fs_mark_hist_t *to, fs_mark_hist_t *from)
+{
+	int i;
+
+	if (from->count == 0)
+		return;
+
+	if ((to->count == 0) || (from->min < to->min))
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+	to->count += from->count;
+	to->total += from->total;
+
+	for (i = 0; i < HIST_NUM_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+}
+
+/*
+ * Return the value below which "percentile" percent of the samples fall.
+ */
+unsigned long long hist_percentile(fs_mark_hist_t *hist, double percentile)
+{
+	unsigned long long rank, seen;
+	unsigned long long value;
+	int i;
+
+	if (hist->count == 0)
+		return (0ULL);
+
+	rank = (unsigned long long)((percentile / 100.0) * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	seen = 0;
+	for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	/*
+	 * Report the top of the bucket, but never outside of what we actually saw.
+	 */
+	value = hist_bucket_value(i);
+	if (value > hist->max)
+		value = hist->max;
+	if (value < hist->min)
+		value = hist->min;
+
+	return (value);
+}
+
+/*
+ * Shuffle the order the "nr_chunks" chunks of a file are written in with
+ * --write-mode random (Fisher-Yates, from the thread's generator).
+ */
+static void shuffle_chunks(child_job_t *child_task, int nr_chunks)
+{
+	int *order = child_task->chunk_order;
+	int i, j, tmp;
+
+	for (i = 0; i < nr_chunks; i++)
+		order[i] = i;
+	for (i = nr_chunks - 1; i > 0; i--) {
+		j = ((rng_next(child_task) >> 32) * (i + 1)) >> 32;
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+/*
+ * Return the data for the next chunk written: the zeroed io_buffer, the
+ * shared duplicate chunk, or payload ring buffer "index" filled with new
+ * random data. Generating it is not part of the timed write.
+ */
+static char *payload_chunk(child_job_t *child_task, int index)
+{
+	char *buf;
+
+	if (payload == PAYLOAD_ZERO)
+		return (child_task->io_buffer);
+	if ((rng_next(child_task) >> 32) < dedup_threshold)
+		return (dup_chunk);
+
+	buf = child_task->payload_ring + (size_t)index * io_buffer_size;
+	fill_payload(child_task->payload_state, buf, io_buffer_size);
+	return (buf);
+}
+
+/*
+ * Point the IO vectors at "len" bytes of payload, io size at a time.
+ * Returns the number of vectors used.
+ */
+static int setup_iovecs(child_job_t *child_task, int len)
+{
+	struct iovec *iov = child_task->iov;
+	int i = 0;
+
+	do {
+		iov[i].iov_base = payload_chunk(child_task, i);
+		iov[i].iov_len = (len > io_buffer_size) ? io_buffer_size : len;
+		len -= iov[i].iov_len;
+		i++;
+	} while (len > 0);
+
+	return (i);
+}
+
+/*
+ * Preallocate a file before it is written: fallocate() the whole size, or
+ * with --write-mode random just ftruncate() it to its size.
+ */
+unsigned long long alloc_file(int fd, unsigned int size)
+{
+	unsigned long long start_ts, stop_ts;
+	int ret;
+
+	start_ns(&start_ts);
+	if (write_mode == WRITE_MODE_FALLOCATE)
+		ret = fallocate(fd, 0, 0, size);
+	else
+		ret = ftruncate(fd, size);
+	if (ret == -1) {
+		fprintf(stderr, "fs_mark: %s failed: %s\n",
+			write_mode == WRITE_MODE_FALLOCATE ? "fallocate" : "ftruncate",
+			strerror(errno));
+		cleanup_exit();
+	}
+
+	return (stop_ns(&start_ts, &stop_ts));
+}
+
+/*
+ * This routine opens, writes the amount of data to a file.
+ * It chunks IO requests into the specified buffer size.  The data is zeros
+ * unless --payload asks for data that compression and dedup cannot skip.
+ * Each write(), pwrite() or pwritev() call is timed on its own.
+ */
+void write_file(child_job_t *child_task,
+		int fd,
+		int sz,
+		unsigned long long *avg_write_nsec,
+		unsigned long long *total_write_nsec,
+		unsigned long long *min_write_nsec,
+		unsigned long long *max_write_nsec)
+{
+	int ret = 0;
+	int sz_left, iov_count = 0;
+	int write_size, write_calls;
+	char *buf = NULL;
+	off_t offset;
+	unsigned long long local_write_nsec, delta;
+	unsigned long long start_ts, stop_ts;
+
+	write_calls = 0;
+	sz_left = sz;
+	offset = 0;
+	local_write_nsec = 0ULL;
+
+	/*
+	 * An empty file still gets its one zero length write.
+	 */
+	if (write_mode == WRITE_MODE_RANDOM)
+		shuffle_chunks(child_task, sz ? (sz + io_buffer_size - 1) /
+			       io_buffer_size : 1);
+
+	do {
+		switch (write_mode) {
+		case WRITE_MODE_RANDOM:
+			offset = (off_t)child_task->chunk_order[write_calls] *
+			    io_buffer_size;
+			write_size = io_buffer_size;
+			if (write_size > sz - offset)
+				write_size = sz - offset;
+			break;
+
+		case WRITE_MODE_PWRITEV:
+			write_size = io_buffer_size * write_iovecs;
+			if (write_size > sz_left)
+				write_size = sz_left;
+			iov_count = setup_iovecs(child_task, write_size);
+			break;
+
+		default:
+			write_size = io_buffer_size;
+			if (write_size > sz_left)
+				write_size = sz_left;
+			break;
+		}
+		if (write_mode != WRITE_MODE_PWRITEV)
+			buf = payload_chunk(child_task, 0);
+
+		start_ns(&start_ts);
+		if (write_mode == WRITE_MODE_RANDOM)
+			ret = pwrite(fd, buf, write_size, offset);
+		else if (write_mode == WRITE_MODE_PWRITEV)
+			ret = pwritev(fd, child_task->iov, iov_count, offset);
+		else
+			ret = write(fd, buf, write_size);
+		if (ret != write_size) {
+			fprintf(stderr,
+				"fs_mark: write_file write failed: %d %s\n",
+				ret, strerror(errno));
+			cleanup_exit();
+		}
+		delta = stop_ns(&start_ts, &stop_ts);
+		record_op(child_task, OP_WRITE, delta);
+
+		local_write_nsec += delta;
+
+		if (delta > *max_write_nsec)
+			*max_write_nsec = delta;
+
+		if ((*min_write_nsec == 0) || (delta < *min_write_nsec))
+			*min_write_nsec = delta;
+
+		sz_left -= ret;
+		offset += ret;
+		write_calls++;
+	} while (sz_left > 0);
+
+	*avg_write_nsec += (local_write_nsec / write_calls);
+	*total_write_nsec += local_write_nsec;
+
+	return;
+}
+
+/*
+ * Verify that there is enough space for this run.
+ */
+static void check_space(child_job_t *child_task)
+{
+	char *my_dir_name = child_task->test_dir;
+	unsigned long long bytes_per_loop;
+
+	/*
+	 * No use in running this if the file system is already full.
+	 * Compute free bytes and compare to many bytes needed for this iteration.
+	 */
+	bytes_per_loop = (unsigned long long)(size_dist_mean * num_files);
+	if (get_bytes_free(my_dir_name) < bytes_per_loop) {
+		fprintf(stdout,
+			"Insufficient free space in %s to create %d new files, exiting\n",
+			my_dir_name, num_files);
+		do_fill_fs = 0;	/* Setting this signals the main loop to exit */
+		cleanup_exit();
+	}
+
+	return;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring version of the main file write loop.
+ *
+ * Every file is submitted as one linked chain of SQEs:
+ *	OPENAT -> WRITE ... WRITE -> FSYNC (optional) -> CLOSE
+ * The open installs a direct descriptor in a per-file slot, so the rest of the
+ * chain can reference the file without a round trip to user space.
+ * Up to files_in_flight chains are kept queued per thread.
+ *
+ * Linked requests run one after the other, so the latency of each step is
+ * taken as the time from the completion of the previous step in the chain (or
+ * from submission for the open) to its own completion. Those are recorded in
+ * the same histograms as the blocking system calls.
+ *
+ * Returns the time spent with nothing in flight waiting for the --rate
+ * timeline.
+ */
+#define URING_USER_DATA(slot, op)	(((unsigned long long)(slot) << 8) | (op))
+#define URING_TIMEOUT_USER_DATA		(~0ULL)	/* --rate wake up, not a file op */
+#define URING_SLOT(user_data)		((int)((user_data) >> 8))
+#define URING_OP(user_data)		((int)((user_data) & 0xff))
+
+unsigned long long uring_write_loop(child_job_t *child_task)
+{
+	uring_ctx_t *ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct name_entry *names;
+	int writes_per_file, chain_len, depth, entries;
+	int next_file, files_done, free_slots, slot, op, ret, pending;
+	int timeout_armed = 0;
+	int *free_slot;
+	unsigned long long now, offset, loop_start, start_nsec = 0;
+	unsigned long long wait_start, idle_nsec = 0;
+	struct __kernel_timespec timeout_ts;
+	struct {
+		char path[MAX_FILE_PATH];
+		char target_path[MAX_FILE_PATH];	/* --rename */
+		unsigned int size;
+		int ops_left;
+		unsigned long long start_nsec;	/* (Intended) start of the file */
+		unsigned long long last_nsec;
+	} *slots;
+
+	/*
+	 * chain_len is the chain without its writes, which depend on the
+	 * size of each file.
+	 */
+	writes_per_file = (file_size + io_buffer_size - 1) / io_buffer_size;
+	chain_len = 2 + ((sync_method & FSYNC_BEFORE_CLOSE) ? 1 : 0) +
+	    ((rename_mode != RENAME_NONE) ? 1 : 0);
+
+	/*
+	 * Every chain in flight needs its own SQEs, enough for the largest file.
+	 */
+	depth = files_in_flight;
+	if (depth * (writes_per_file + chain_len) > MAX_URING_ENTRIES)
+		depth = MAX_URING_ENTRIES / (writes_per_file + chain_len);
+	if (depth < 1) {
+		fprintf(stderr,
+			"fs_mark: %d writes per file do not fit in an io_uring submission queue\n",
+			writes_per_file);
+		cleanup_exit();
+	}
+	/*
+	 * One spare entry for the --rate wake up timeout.
+	 */
+	for (entries = 1; entries < depth * (writes_per_file + chain_len) + 1;
+	     entries <<= 1)
+		;
+
+	if ((ret = uring_init(&ring, entries, depth)) < 0) {
+		fprintf(stderr, "fs_mark: io_uring setup failed: %s\n",
+			strerror(-ret));
+		cleanup_exit();
+	}
+
+	slots = calloc(depth, sizeof(*slots));
+	free_slot = calloc(depth, sizeof(int));
+	if ((slots == NULL) || (free_slot == NULL)) {
+		fprintf(stderr,
+			"fs_mark: failed to allocate io_uring slots: %s\n",
+			strerror(errno));
+		cleanup_exit();
+	}
+	for (free_slots = 0; free_slots < depth; free_slots++)
+		free_slot[free_slots] = depth - free_slots - 1;
+
+	/*
+	 * Writes are only done once their whole chain completes, so each
+	 * slot gets its own payload buffers.
+	 */
+	if ((payload != PAYLOAD_ZERO) && (writes_per_file > 0))
+		alloc_payload_ring(child_task, depth * writes_per_file);
+
+	loop_start = now = nsnow();
+	next_file = files_done = 0;
+	for (;;) {
+		/*
+		 * Queue new files until every slot is busy, or with --rate
+		 * until the next file is not due yet.
+		 */
+		while ((free_slots > 0) && have_file(child_task, next_file)) {
+			if (target_rate) {
+				start_nsec = file_start_nsec(child_task, loop_start,
+							     next_file);
+				now = nsnow();
+				if (start_nsec > now)
+					break;
+			}
+			slot = free_slot[--free_slots];
+
+			setup_file_name(child_task, next_file, now);
+			names = child_task->names;
+			build_path(slots[slot].path, names[next_file].write_dir,
+				   names[next_file].f_name);
+
+			sqe = uring_get_sqe(ring);
+			uring_prep_openat_direct(sqe, slots[slot].path,
+						 write_open_flags, 0666, slot);
+			sqe->flags |= IOSQE_IO_LINK;
+			sqe->user_data = URING_USER_DATA(slot, OP_CREAT);
+
+			slots[slot].size = names[next_file].size;
+			slots[slot].ops_left = chain_len;
+			for (offset = 0; offset < slots[slot].size;
+			     offset += io_buffer_size) {
+				unsigned int len = io_buffer_size;
+
+				if (offset + len > slots[slot].size)
+					len = slots[slot].size - offset;
+				sqe = uring_get_sqe(ring);
+				uring_prep_write_fixed(sqe, slot,
+						       payload_chunk(child_task,
+								     slot * writes_per_file +
+								     offset / io_buffer_size),
+						       len, offset);
+				sqe->flags |= IOSQE_IO_LINK;
+				sqe->user_data = URING_USER_DATA(slot, OP_WRITE);
+				slots[slot].ops_left++;
+			}
+
+			if (sync_method & FSYNC_BEFORE_CLOSE) {
+				sqe = uring_get_sqe(ring);
+				uring_prep_fsync_fixed(sqe, slot);
+				sqe->flags |= IOSQE_IO_LINK;
+				sqe->user_data = URING_USER_DATA(slot, OP_FSYNC);
+			}
+
+			sqe = uring_get_sqe(ring);
+			uring_prep_close_direct(sqe, slot);
+			sqe->user_data = URING_USER_DATA(slot, OP_CLOSE);
+
+			if (rename_mode != RENAME_NONE) {
+				sqe->flags |= IOSQE_IO_LINK;
+				build_path(slots[slot].target_path,
+					   names[next_file].target_dir,
+					   names[next_file].f_name);
+				sqe = uring_get_sqe(ring);
+				uring_prep_renameat(sqe, slots[slot].path,
+						    slots[slot].target_path,
+						    rename_noreplace ? RENAME_NOREPLACE : 0);
+				sqe->user_data = URING_USER_DATA(slot, OP_RENAME);
+			}
+
+			slots[slot].last_nsec = nsnow();
+			slots[slot].start_nsec = target_rate ? start_nsec :
+			    slots[slot].last_nsec;
+			next_file++;
+		}
+
+		/*
+		 * Nothing in flight and nothing left to queue.
+		 */
+		pending = (free_slots > 0) && have_file(child_task, next_file);
+		if (!pending && (files_done == next_file))
+			break;
+
+		/*
+		 * The next file is not due yet: make sure we wake up for it
+		 * even if nothing in flight completes before then.
+		 */
+		if (pending && target_rate && !timeout_armed) {
+			timeout_ts.tv_sec = (start_nsec - now) / 1000000000ULL;
+			timeout_ts.tv_nsec = (start_nsec - now) % 1000000000ULL;
+			sqe = uring_get_sqe(ring);
+			uring_prep_timeout(sqe, &timeout_ts);
+			sqe->user_data = URING_TIMEOUT_USER_DATA;
+			timeout_armed = 1;
+		}
+
+		wait_start = nsnow();
+		if ((ret = uring_submit_and_wait(ring, 1)) < 0) {
+			fprintf(stderr, "fs_mark: io_uring submit failed: %s\n",
+				strerror(-ret));
+			cleanup_exit();
+		}
+		if (files_done == next_file)
+			idle_nsec += nsnow() - wait_start;
+
+		/*
+		 * Reap everything that has completed.
+		 * A short write breaks the chain, so it shows up as the rest of
+		 * the chain failing with ECANCELED.
+		 */
+		while ((cqe = uring_peek_cqe(ring)) != NULL) {
+			if (cqe->user_data == URING_TIMEOUT_USER_DATA) {
+				timeout_armed = 0;
+				uring_cqe_seen(ring);
+				continue;
+			}
+
+			slot = URING_SLOT(cqe->user_data);
+			op = URING_OP(cqe->user_data);
+
+			if (cqe->res < 0) {
+				fprintf(stderr, "fs_mark: io_uring %s of %s failed: %s\n",
+					op_name_string[op], slots[slot].path,
+					strerror(-cqe->res));
+				cleanup_exit();
+			}
+
+			now = nsnow();
+			record_op(child_task, op, now - slots[slot].last_nsec);
+			slots[slot].last_nsec = now;
+
+			if (--slots[slot].ops_left == 0) {
+				record_file(child_task, slots[slot].size,
+					    now - slots[slot].start_nsec);
+				free_slot[free_slots++] = slot;
+				files_done++;
+			}
+			uring_cqe_seen(ring);
+		}
+	}
+
+	free(slots);
+	free(free_slot);
+	uring_exit(ring);
+
+	return (idle_nsec);
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * Read back phase: stat() every file written in this iteration.
+ * Returns the number of files processed.
+ */
+unsigned long long stat_files(child_job_t *child_task)
+{
+	unsigned long long start_ts, stop_ts;
+	struct name_entry *names = child_task->names;
+	struct stat stat_buf;
+	char *file_target_name;
+	int file_index;
+
+	for (file_index = 0; file_index < child_task->files_claimed; ++file_index) {
+		file_target_name = file_path(child_task, names[file_index].target_dir,
+					     names[file_index].f_name);
+
+		start_ns(&start_ts);
+		if (stat(file_target_name, &stat_buf) == -1) {
+			fprintf(stderr, "Error in stat of %s : %s\n",
+				file_target_name, strerror(errno));
+			cleanup_exit();
+		}
+		record_op(child_task, OP_STAT, stop_ns(&start_ts, &stop_ts));
+	}
+
+	return (child_task->files_claimed);
+}
+
+/*
+ * Open, read fully and close one file.
+ * Returns -1 with errno set if the file could not be opened.
+ */
+static int read_file(child_job_t *child_task, const char *file_name)
+{
+	int fd, ret;
+
+	if ((fd = open(file_name, read_open_flags, 0666)) == -1)
+		return (-1);
+
+	while ((ret = read(fd, child_task->io_buffer, io_buffer_size)) > 0)
+		;
+	if (ret == -1) {
+		fprintf(stderr, "fs_mark: read of %s failed: %s\n",
+			file_name, strerror(errno));
+		cleanup_exit();
+	}
+
+	close(fd);
+	return (0);
+}
+
+/*
+ * Read back phase: open, read fully and close every file written in this iteration.
+ * Note that we count all of the system calls for a file into one READ time.
+ */
+unsigned long long read_files(child_job_t *child_task)
+{
+	unsigned long long start_ts, stop_ts;
+	struct name_entry *names = child_task->names;
+	char *file_target_name;
+	int file_index;
+
+	for (file_index = 0; file_index < child_task->files_claimed; ++file_index) {
+		file_target_name = file_path(child_task, names[file_index].target_dir,
+					     names[file_index].f_name);
+
+		start_ns(&start_ts);
+		if (read_file(child_task, file_target_name) == -1) {
+			fprintf(stderr, "Error in open of %s : %s\n",
+				file_target_name, strerror(errno));
+			cleanup_exit();
+		}
+		record_op(child_task, OP_READ, stop_ns(&start_ts, &stop_ts));
+	}
+
+	return (child_task->files_claimed);
+}
+
+/*
+ * Read back phase: read every entry of each (sub)directory of this thread.
+ * Returns the number of directory entries seen.
+ */
+unsigned long long readdir_subdirs(child_job_t *child_task)
+{
+	unsigned long long start_ts, stop_ts;
+	char *dir_name;
+	unsigned long long entries = 0;
+	struct dirent *dirent;
+	DIR *dir;
+	int subdir, subdir_count;
+
+	subdir_count = (num_subdirs > 0) ? num_subdirs : 1;
+
+	for (subdir = 0; subdir < subdir_count; subdir++) {
+		dir_name = child_task->subdir_names[subdir];
+
+		start_ns(&start_ts);
+		if ((dir = opendir(dir_name)) == NULL) {
+			fprintf(stderr, "Error in opendir of %s : %s\n",
+				dir_name, strerror(errno));
+			cleanup_exit();
+		}
+
+		while ((dirent = readdir(dir)) != NULL) {
+			if ((strcmp(dirent->d_name, ".") == 0) ||
+			    (strcmp(dirent->d_name, "..") == 0))
+				continue;
+			entries++;
+		}
+
+		closedir(dir);
+		record_op(child_task, OP_READDIR, stop_ns(&start_ts, &stop_ts));
+	}
+
+	return (entries);
+}
+
+/*
+ * Take a --cpu-stats sample of this thread. Without schedstat (no
+ * CONFIG_SCHED_INFO, or not Linux) the on CPU time is taken from the
+ * rusage times and the run queue wait reads 0.
+ */
+void sample_cpu_usage(child_job_t *child_task, cpu_usage_t *sample)
+{
+	char path[PATH_MAX], buf[128];
+#ifdef RUSAGE_THREAD
+	struct rusage usage;
+#endif
+	ssize_t len;
+	int fd;
+
+	memset(sample, 0, sizeof(*sample));
+	sample->wall_nsec = nsnow();
+#ifdef RUSAGE_THREAD
+	if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+		sample->user_nsec = usage.ru_utime.tv_sec * 1000000000ULL +
+		    usage.ru_utime.tv_usec * 1000ULL;
+		sample->sys_nsec = usage.ru_stime.tv_sec * 1000000000ULL +
+		    usage.ru_stime.tv_usec * 1000ULL;
+		sample->voluntary_csw = usage.ru_nvcsw;
+		sample->involuntary_csw = usage.ru_nivcsw;
+	}
+#endif
+
+	snprintf(path, sizeof(path), SCHEDSTAT_PATH, child_task->child_tid);
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		if ((len = read(fd, buf, sizeof(buf) - 1)) > 0) {
+			buf[len] = 0;
+			if (sscanf(buf, "%llu %llu", &sample->run_nsec,
+				   &sample->wait_nsec) != 2)
+				sample->run_nsec = sample->wait_nsec = 0ULL;
+		}
+		close(fd);
+	}
+	if (sample->run_nsec == 0ULL)
+		sample->run_nsec = sample->user_nsec + sample->sys_nsec;
+}
+
+/*
+ * Add what this thread used since "start" to a phase.
+ */
+void account_cpu_usage(child_job_t *child_task, int phase, cpu_usage_t *start)
+{
+	cpu_usage_t *usage = &child_task->thread_stats.cpu_usage[phase];
+	cpu_usage_t now;
+
+	sample_cpu_usage(child_task, &now);
+	usage->user_nsec += now.user_nsec - start->user_nsec;
+	usage->sys_nsec += now.sys_nsec - start->sys_nsec;
+	usage->voluntary_csw += now.voluntary_csw - start->voluntary_csw;
+	usage->involuntary_csw += now.involuntary_csw - start->involuntary_csw;
+	usage->run_nsec += now.run_nsec - start->run_nsec;
+	usage->wait_nsec += now.wait_nsec - start->wait_nsec;
+	usage->wall_nsec += now.wall_nsec - start->wall_nsec;
+}
+
+/*
+ * Phases that run (and are sampled) with the current arguments.
+ */
+int cpu_phase_used(int phase)
+{
+	if (phase == CPU_PHASE_WRITE)
+		return (1);
+	if (phase == CPU_PHASE_UNLINK)
+		return (!keep_files);
+	return (read_phases & (1 << (phase - 1)));
+}
+
+/*
+ * The part of a phase that was neither on a CPU nor waiting for one.
+ */
+unsigned long long cpu_blocked_nsec(cpu_usage_t *usage)
+{
+	if (usage->wall_nsec < usage->run_nsec + usage->wait_nsec)
+		return (0ULL);
+	return (usage->wall_nsec - usage->run_nsec - usage->wait_nsec);
+}
+
+/*
+ * Run the read back phases selected with -R and record their rates.
+ */
+void do_read_phases(child_job_t *child_task)
+{
+	unsigned long long phase_start_ts, phase_stop_ts;
+	unsigned long long items, phase_nsecs;
+	cpu_usage_t cpu_start;
+	int phase;
+
+	for (phase = 0; phase < NUM_READ_PHASES; phase++) {
+		if (!(read_phases & (1 << phase)))
+			continue;
+
+		if (cpu_stats)
+			sample_cpu_usage(child_task, &cpu_start);
+		start_ns(&phase_start_ts);
+		switch (phase) {
+		case PHASE_STAT:
+			items = stat_files(child_task);
+			break;
+		case PHASE_READ:
+			items = read_files(child_task);
+			break;
+		case PHASE_READDIR:
+		default:
+			items = readdir_subdirs(child_task);
+			break;
+		}
+		phase_nsecs = stop_ns(&phase_start_ts, &phase_stop_ts);
+		if (cpu_stats)
+			account_cpu_usage(child_task, phase + 1, &cpu_start);
+
+		if (phase_nsecs == 0)
+			phase_nsecs = 1;
+		child_task->thread_stats.phase_files_per_sec[phase] =
+		    items / (phase_nsecs / 1000000000.0);
+	}
+}
+
+/*
+ * Add a file to the --mix population.
+ */
+static void mix_add(child_job_t *child_task, struct name_entry *entry)
+{
+	mix_population_t *pop = &mix_populations[child_task->dir_index];
+	struct name_entry *files;
+	int size;
+
+	pthread_mutex_lock(&pop->lock);
+	if (pop->count == pop->size) {
+		size = pop->size ? pop->size * 2 :
+		    num_files * (num_threads / num_dirs) + 1;
+		if ((files = realloc(pop->files,
+				     size * sizeof(struct name_entry))) == NULL) {
+			fprintf(stderr,
+				"fs_mark: failed to allocate memory for the --mix files: %s\n",
+				strerror(errno));
+			cleanup_exit();
+		}
+		pop->files = files;
+		pop->size = size;
+	}
+	pop->files[pop->count++] = *entry;
+	pthread_mutex_unlock(&pop->lock);
+}
+
+/*
+ * Pick a random file of our directory's --mix population and build its path in
+ * child_task->path. With "take" the file leaves the population, so no
+ * other thread picks it once we unlink it.
+ * Returns 0 if the population is empty.
+ */
+static int mix_pick(child_job_t *child_task, int take)
+{
+	mix_population_t *pop = &mix_populations[child_task->dir_index];
+	struct name_entry *entry;
+	int index;
+
+	pthread_mutex_lock(&pop->lock);
+	if (pop->count == 0) {
+		pthread_mutex_unlock(&pop->lock);
+		return (0);
+	}
+	index = ((rng_next(child_task) >> 32) * pop->count) >> 32;
+	entry = &pop->files[index];
+	file_path(child_task, entry->target_dir, entry->f_name);
+	if (take)
+		*entry = pop->files[--pop->count];
+	pthread_mutex_unlock(&pop->lock);
+
+	return (1);
+}
+
+/*
+ * Create, write, (fsync) and close one new file for --mix and add it to
+ * the population. Each system call is recorded as in the write loop,
+ * and the whole file as FILE.
+ */
+static void mix_create(child_job_t *child_task)
+{
+	struct name_entry *entry = &child_task->names[0];
+	unsigned long long start_ts, stop_ts, file_start_ts;
+	unsigned long long avg_nsec = 0, total_nsec = 0, min_nsec = 0, max_nsec = 0;
+	char *file_name;
+	int fd;
+
+	start_ns(&file_start_ts);
+	setup_file_name(child_task, 0, file_start_ts);
+	file_name = file_path(child_task, entry->write_dir, entry->f_name);
+
+	start_ns(&start_ts);
+	if ((fd = open(file_name, write_open_flags, 0666)) == -1) {
+		fprintf(stderr, "Error in creat: %s\n", strerror(errno));
+		cleanup_exit();
+	}
+	record_op(child_task, OP_CREAT, stop_ns(&start_ts, &stop_ts));
+
+	if (((write_mode == WRITE_MODE_FALLOCATE) ||
+	     (write_mode == WRITE_MODE_RANDOM)) && entry->size)
+		record_op(child_task, OP_ALLOC, alloc_file(fd, entry->size));
+	write_file(child_task, fd, entry->size, &avg_nsec, &total_nsec,
+		   &min_nsec, &max_nsec);
+
+	if (sync_method & FSYNC_BEFORE_CLOSE) {
+		start_ns(&start_ts);
+		if (fsync(fd) == -1) {
+			fprintf(stderr, "fs_mark: fsync failed %s\n",
+				strerror(errno));
+			cleanup_exit();
+		}
+		record_op(child_task, OP_FSYNC, stop_ns(&start_ts, &stop_ts));
+	}
+
+	start_ns(&start_ts);
+	close(fd);
+	record_op(child_task, OP_CLOSE, stop_ns(&start_ts, &stop_ts));
+
+	record_file(child_task, entry->size, stop_ts - file_start_ts);
+	mix_add(child_task, entry);
+}
+
+/*
+ * Draw the next --mix operation by weight.
+ */
+static inline int pick_mix_op(child_job_t *child_task)
+{
+	unsigned long long r = rng_next(child_task) >> 32;
+	int op;
+
+	for (op = 0; op < NUM_MIX_OPS - 1; op++)
+		if (r < mix_cumul[op])
+			break;
+
+	return (op);
+}
+
+/*
+ * Do one --mix operation on the file mix_pick() left in child_task->path.
+ * A file another thread unlinks between our pick and our read or stat
+ * counts as a miss.
+ */
+static void mix_run_op(child_job_t *child_task, int op)
+{
+	unsigned long long start_ts, stop_ts;
+	struct stat stat_buf;
+	int ret;
+
+	if (op == MIX_CREATE) {
+		mix_create(child_task);
+		child_task->files_claimed++;
+		child_task->thread_stats.mix_ops[op]++;
+		return;
+	}
+
+	start_ns(&start_ts);
+	switch (op) {
+	case MIX_READ:
+		ret = read_file(child_task, child_task->path);
+		break;
+
+	case MIX_STAT:
+		ret = stat(child_task->path, &stat_buf);
+		break;
+
+	case MIX_UNLINK:
+	default:
+		ret = unlink(child_task->path);
+		break;
+	}
+	if (ret == -1) {
+		if ((errno == ENOENT) && (op != MIX_UNLINK)) {
+			child_task->thread_stats.mix_misses++;
+			return;
+		}
+		fprintf(stderr, "fs_mark: %s of %s failed: %s\n",
+			mix_op_string[op], child_task->path, strerror(errno));
+		cleanup_exit();
+	}
+	record_op(child_task, mix_op_hist[op], stop_ns(&start_ts, &stop_ts));
+	child_task->thread_stats.mix_ops[op]++;
+}
+
+/*
+ * Do one --mix operation. Reads, stats and unlinks of an empty population
+ * turn into creates.
+ */
+static void mix_op(child_job_t *child_task, int op)
+{
+	if ((op != MIX_CREATE) && !mix_pick(child_task, op == MIX_UNLINK))
+		op = MIX_CREATE;
+
+	mix_run_op(child_task, op);
+}
+
+/*
+ * The --mix loop: -n operations drawn by weight. With --churn these are
+ * -n creates, each after the unlink of a random file once we are no
+ * longer filling up.
+ */
+void mix_loop(child_job_t *child_task)
+{
+	int i;
+
+	for (i = 0; i < num_files; i++) {
+		/*
+		 * Look at the use every few files while filling, so the
+		 * target is not overshot by much.
+		 */
+		if (churn_target && child_task->churn_fill &&
+		    ((i % CHURN_CHECK_FILES) == 0))
+			child_task->churn_fill =
+			    get_df_full(child_task->test_dir) < churn_target;
+		if (churn_target && (i == 0))
+			child_task->thread_stats.churn_filling =
+			    child_task->churn_fill;
+		/*
+		 * Only ever replace once full: with none of our files left
+		 * to unlink, skip the create too, or the use would climb
+		 * past the target.
+		 */
+		if (churn_target && !child_task->churn_fill) {
+			if (!mix_pick(child_task, 1))
+				continue;
+			mix_run_op(child_task, MIX_UNLINK);
+		}
+		mix_op(child_task, pick_mix_op(child_task));
+	}
+}
+
+/*
+ * Unlink the --mix population once every thread is done with it. Each
+ * thread takes files of its directory until none are left; this is not
+ * timed.
+ */
+void mix_cleanup(child_job_t *child_task)
+{
+	while (mix_pick(child_task, 1)) {
+		if (unlink(child_task->path) == -1) {
+			fprintf(stderr, "Error in unlink of %s : %s\n",
+				child_task->path, strerror(errno));
+			cleanup_exit();
+		}
+	}
+}
+
+/*
+ * Move a file from its write_dir into its target_dir (--rename).
+ * Returns the time of the rename alone.
+ */
+unsigned long long rename_file(child_job_t *child_task, struct name_entry *entry)
+{
+	unsigned long long start_ts, stop_ts;
+	char *old_name, *new_name;
+	int ret;
+
+	old_name = file_path(child_task, entry->write_dir, entry->f_name);
+	new_name = build_path(child_task->target_path, entry->target_dir,
+			      entry->f_name);
+
+	start_ns(&start_ts);
+	if (rename_noreplace)
+		ret = renameat2(AT_FDCWD, old_name, AT_FDCWD, new_name,
+				RENAME_NOREPLACE);
+	else
+		ret = rename(old_name, new_name);
+	if (ret == -1) {
+		fprintf(stderr, "Error in rename of %s to %s : %s\n",
+			old_name, new_name, strerror(errno));
+		cleanup_exit();
+	}
+
+	return (stop_ns(&start_ts, &stop_ts));
+}
+
+/*
+ * Reopen, fsync() and close one file, as the post write loop methods do.
+ * With -S 10 the fsync() is replaced by waiting for the writeback started
+ * in the loop. Returns the time of all three system calls.
+ */
+unsigned long long fsync_file(char *path_buf, struct name_entry *entry)
+{
+	unsigned long long start_ts, stop_ts;
+	char *file_name;
+	int fd, ret;
+
+	file_name = build_path(path_buf, entry->target_dir, entry->f_name);
+
+	start_ns(&start_ts);
+	if ((fd = open(file_name, O_RDONLY, 0666)) == -1) {
+		fprintf(stderr, "Error in open of %s : %s\n",
+			file_name, strerror(errno));
+		cleanup_exit();
+	}
+
+	if (sync_method & FSYNC_RANGE)
+		ret = sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+				      SYNC_FILE_RANGE_WRITE |
+				      SYNC_FILE_RANGE_WAIT_AFTER);
+	else
+		ret = fsync(fd);
+	if (ret == -1) {
+		fprintf(stderr, "fs_mark: fsync failed %s\n",
+			strerror(errno));
+		cleanup_exit();
+	}
+
+	close(fd);
+	return (stop_ns(&start_ts, &stop_ts));
+}
+
+/*
+ * Open, sync and close a directory: fsync(), or syncfs() for the whole
+ * file system it is on.
+ */
+unsigned long long fsync_dir(const char *dir_name, int whole_fs)
+{
+	unsigned long long start_ts, stop_ts;
+	int fd, ret;
+
+	start_ns(&start_ts);
+	if ((fd = open(dir_name, O_RDONLY | O_DIRECTORY)) == -1) {
+		fprintf(stderr, "Error in open of %s : %s\n",
+			dir_name, strerror(errno));
+		cleanup_exit();
+	}
+
+	ret = whole_fs ? syncfs(fd) : fsync(fd);
+	if (ret == -1) {
+		fprintf(stderr, "fs_mark: %s of %s failed %s\n",
+			whole_fs ? "syncfs" : "fsync", dir_name, strerror(errno));
+		cleanup_exit();
 	}
 
+	close(fd);
+	return (stop_ns(&start_ts, &stop_ts));
+}
+
+/*
+ * Add one system call time to the totals of the loop.
+ */
+static inline void account_op(child_job_t *child_task, int op,
+			      unsigned long long delta,
+			      unsigned long long *total_nsec,
+			      unsigned long long *min_nsec,
+			      unsigned long long *max_nsec)
+{
+	record_op(child_task, op, delta);
+	*total_nsec += delta;
+
+	if (delta > *max_nsec)
+		*max_nsec = delta;
+	if ((*min_nsec == 0) || (delta < *min_nsec))
+		*min_nsec = delta;
+}
+
+static inline void account_fsync(child_job_t *child_task,
+				 unsigned long long delta,
+				 unsigned long long *fsync_nsec,
+				 unsigned long long *min_fsync_nsec,
+				 unsigned long long *max_fsync_nsec)
+{
+	account_op(child_task, OP_FSYNC, delta, fsync_nsec, min_fsync_nsec,
+		   max_fsync_nsec);
+}
+
+/*
+ * fsync() every (sub)directory that got new files since the last call
+ * (--dir-sync batch and subdir).
+ */
+void sync_dirty_dirs(child_job_t *child_task, unsigned long long *dirsync_nsec,
+		     unsigned long long *min_dirsync_nsec,
+		     unsigned long long *max_dirsync_nsec)
+{
+	int subdir, subdir_count;
+
+	subdir_count = (num_subdirs > 0) ? num_subdirs : 1;
+	for (subdir = 0; subdir < subdir_count; subdir++) {
+		if (!child_task->subdir_dirty[subdir])
+			continue;
+		account_op(child_task, OP_DIRSYNC,
+			   fsync_dir(child_task->subdir_names[subdir], 0),
+			   dirsync_nsec, min_dirsync_nsec, max_dirsync_nsec);
+		child_task->subdir_dirty[subdir] = 0;
+	}
+}
+
+/*
+ * Take files of the current batch until there are none left.
+ */
+static void sync_pool_work(sync_pool_t *pool, char *path_buf)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+	       pool->count)
+		pool->latency[i] =
+		    fsync_file(path_buf, &pool->child_task->names[pool->first + i]);
+}
+
+void *sync_helper(void *arg)
+{
+	sync_pool_t *pool = arg;
+	char path[MAX_FILE_PATH];
+
+	for (;;) {
+		pthread_barrier_wait(&pool->start_barrier);
+		if (pool->exit)
+			break;
+
+		sync_pool_work(pool, path);
+
+		pthread_barrier_wait(&pool->done_barrier);
+	}
+
+	return NULL;
+}
+
+/*
+ * Create the -S 8 helper threads of one worker.
+ */
+void start_sync_pool(child_job_t *child_task)
+{
+	sync_pool_t *pool;
+	int i;
+
+	if (((pool = calloc(1, sizeof(*pool))) == NULL) ||
+	    ((pool->latency = calloc(sync_batch,
+				     sizeof(unsigned long long))) == NULL) ||
+	    ((pool->threads = calloc(sync_threads,
+				     sizeof(pthread_t))) == NULL)) {
+		fprintf(stderr,
+			"fs_mark: failed to allocate the fsync helpers: %s\n",
+			strerror(errno));
+		cleanup_exit();
+	}
+	pool->child_task = child_task;
+	pool->nr_threads = sync_threads - 1;
+
+	/*
+	 * The worker takes part in both barriers and in the fsync()s.
+	 */
+	pthread_barrier_init(&pool->start_barrier, NULL, pool->nr_threads + 1);
+	pthread_barrier_init(&pool->done_barrier, NULL, pool->nr_threads + 1);
+
+	for (i = 0; i < pool->nr_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, sync_helper,
+				   (void *)pool) != 0) {
+			fprintf(stderr, "fs_mark: pthread_create failed\n");
+			cleanup_exit();
+		}
+	}
+	child_task->sync_pool = pool;
+}
+
+void stop_sync_pool(child_job_t *child_task)
+{
+	sync_pool_t *pool = child_task->sync_pool;
+	int i;
+
+	pool->exit = 1;
+	pthread_barrier_wait(&pool->start_barrier);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_barrier_destroy(&pool->start_barrier);
+	pthread_barrier_destroy(&pool->done_barrier);
+	free(pool->threads);
+	free(pool->latency);
+	free(pool);
+	child_task->sync_pool = NULL;
+}
+
+/*
+ * Start the -S 8 helpers of all workers once, the workers of every
+ * iteration (or the persistent ones) reuse them.
+ */
+void start_sync_pools(void)
+{
+	int i;
+
+	for (i = 0; i < num_threads; i++)
+		start_sync_pool(&child_tasks[i]);
+	sync_pools_running = 1;
+}
+
+void stop_sync_pools(void)
+{
+	int i;
+
+	if (!sync_pools_running)
+		return;
+
+	for (i = 0; i < num_threads; i++)
+		stop_sync_pool(&child_tasks[i]);
+	sync_pools_running = 0;
+}
+
+/*
+ * Group commit (-S 7, -S 8): fsync the "count" files starting at "first",
+ * one after the other or all at once from the helper pool.
+ * Each fsync() is timed on its own, like the post write loop methods.
+ */
+void fsync_batch(child_job_t *child_task, int first, int count,
+		 unsigned long long *fsync_nsec,
+		 unsigned long long *min_fsync_nsec,
+		 unsigned long long *max_fsync_nsec)
+{
+	sync_pool_t *pool = child_task->sync_pool;
+	int i;
+
+	if (sync_method & FSYNC_PARALLEL) {
+		pool->first = first;
+		pool->count = count;
+		pool->next = 0;
+
+		pthread_barrier_wait(&pool->start_barrier);
+		sync_pool_work(pool, child_task->path);
+		pthread_barrier_wait(&pool->done_barrier);
+
+		for (i = 0; i < count; i++)
+			account_fsync(child_task, pool->latency[i], fsync_nsec,
+				      min_fsync_nsec, max_fsync_nsec);
+		return;
+	}
+
+	for (i = first; i < first + count; i++)
+		account_fsync(child_task,
+			      fsync_file(child_task->path, &child_task->names[i]),
+			      fsync_nsec, min_fsync_nsec, max_fsync_nsec);
+}
+
+/*
+ * Main loop in program - creates, writes and removes "num_files" files of each size. 
+ * Each of the subcomponents is measured separately so we can track how specific aspects 
+ * degrade.
+ */
+
+void do_run(child_job_t *child_task)
+{
+	unsigned long long loop_start_ts, loop_stop_ts;
+	unsigned long long start_ts, stop_ts;
+	struct name_entry *names = NULL;
+	int file_index, fd, nr_files;
+	float files_per_sec;
+	unsigned long long total_file_ops, delta, loop_nsecs;
+	unsigned long long creat_nsec, max_creat_nsec, min_creat_nsec;
+	unsigned long long avg_write_nsec, max_write_nsec, min_write_nsec,
+	    total_write_nsec;
+	unsigned long long fsync_nsec, max_fsync_nsec, min_fsync_nsec;
+	unsigned long long close_nsec, max_close_nsec, min_close_nsec;
+	unsigned long long unlink_nsec, max_unlink_nsec, min_unlink_nsec;
+	unsigned long long dirsync_nsec, max_dirsync_nsec, min_dirsync_nsec;
+	unsigned long long rename_nsec, max_rename_nsec, min_rename_nsec;
+	unsigned long long alloc_nsec, max_alloc_nsec, min_alloc_nsec;
+	unsigned long long avg_sync_nsec, app_overhead_nsec;
+	unsigned long long file_start_ts = 0, idle_nsec = 0, mix_nsec = 0;
+	char *file_write_name, *file_target_name;
+	cpu_usage_t cpu_start;
+
+	/*
+	 * Verify that there is enough space for this run. --churn keeps
+	 * its own eye on the use and only needs room to replace files.
+	 */
+	if (!churn_target)
+		check_space(child_task);
+
+	/*
+	 * Add our share of the starting --mix population, before anything
+	 * is timed. With -k the population lives on across iterations,
+	 * otherwise it is unlinked at the end of each one.
+	 */
+	if (mix_mode && (!keep_files || !child_task->mix_filled)) {
+		grow_names(child_task, 1);
+		for (file_index = 0; file_index < mix_files; file_index++)
+			mix_create(child_task);
+		child_task->mix_filled = 1;
+	}
+	child_task->churn_fill = churn_target;
+
+	/*
+	 * This loop uses nanosecond timers to measure each individual file operation.
+	 * Once all files of a given size have been processed, the sum of the times are 
+	 * recorded in operations/sec.
+	 */
+	files_per_sec = 0.0;
+	creat_nsec = max_creat_nsec = min_creat_nsec = 0ULL;
+	avg_write_nsec = max_write_nsec = min_write_nsec = total_write_nsec = 0ULL;
+	fsync_nsec = max_fsync_nsec = min_fsync_nsec = avg_sync_nsec = 0ULL;
+	close_nsec = max_close_nsec = min_close_nsec = 0ULL;
+	unlink_nsec = max_unlink_nsec = min_unlink_nsec = 0ULL;
+	dirsync_nsec = max_dirsync_nsec = min_dirsync_nsec = 0ULL;
+	rename_nsec = max_rename_nsec = min_rename_nsec = 0ULL;
+	alloc_nsec = max_alloc_nsec = min_alloc_nsec = 0ULL;
+	memset(child_task->subdir_dirty, 0,
+	       (num_subdirs > 0) ? num_subdirs : 1);
+	memset(child_task->thread_stats.op_hist, 0,
+	       sizeof(child_task->thread_stats.op_hist));
+	memset(child_task->thread_stats.size_hist, 0,
+	       sizeof(child_task->thread_stats.size_hist));
+	child_task->thread_stats.bytes_written = 0ULL;
+	memset(child_task->thread_stats.phase_files_per_sec, 0,
+	       sizeof(child_task->thread_stats.phase_files_per_sec));
+	memset(child_task->thread_stats.mix_ops, 0,
+	       sizeof(child_task->thread_stats.mix_ops));
+	child_task->thread_stats.mix_misses = 0ULL;
+	memset(child_task->thread_stats.cpu_usage, 0,
+	       sizeof(child_task->thread_stats.cpu_usage));
+
+	/*
+	 * Without --steal every thread writes num_files files, with it the
+	 * files are claimed in batches as the loop goes. With --mix this
+	 * counts the creates.
+	 */
+	child_task->files_claimed = (steal_batch || mix_mode) ? 0 : num_files;
+	child_task->files_stolen = 0;
+	grow_names(child_task, num_files);
+
+	/*
+	 * MAIN FILE WRITE LOOP:
+	 * This loop measures the specific steps in creating files:
+	 *      Step 1: Make up a file name
+	 *      Step 2: Creat(file_name);
+	 *      Step 3: write file data
+	 *      Step 4: fsync() file data (optional)
+	 *      Step 5: close() file descriptor
+	 */
+
+	pthread_barrier_wait(&loop_start_barrier);
+	if (cpu_stats)
+		sample_cpu_usage(child_task, &cpu_start);
+	start_ns(&loop_start_ts);
+	stop_ts = loop_start_ts;
+	if (mix_mode) {
+		fs_mark_hist_t *op_hist = child_task->thread_stats.op_hist;
+
+		/*
+		 * Like the io_uring engine, the mixed loop records straight
+		 * into the histograms. Its reads, stats and unlinks are file
+		 * operations too, so they are not app overhead.
+		 */
+		mix_loop(child_task);
+
+		creat_nsec = op_hist[OP_CREAT].total;
+		min_creat_nsec = op_hist[OP_CREAT].min;
+		max_creat_nsec = op_hist[OP_CREAT].max;
+		total_write_nsec = op_hist[OP_WRITE].total;
+		min_write_nsec = op_hist[OP_WRITE].min;
+		max_write_nsec = op_hist[OP_WRITE].max;
+		if (op_hist[OP_WRITE].count)
+			avg_write_nsec = total_write_nsec * child_task->files_claimed /
+			    op_hist[OP_WRITE].count;
+		fsync_nsec = op_hist[OP_FSYNC].total;
+		min_fsync_nsec = op_hist[OP_FSYNC].min;
+		max_fsync_nsec = op_hist[OP_FSYNC].max;
+		close_nsec = op_hist[OP_CLOSE].total;
+		min_close_nsec = op_hist[OP_CLOSE].min;
+		max_close_nsec = op_hist[OP_CLOSE].max;
+		alloc_nsec = op_hist[OP_ALLOC].total;
+		min_alloc_nsec = op_hist[OP_ALLOC].min;
+		max_alloc_nsec = op_hist[OP_ALLOC].max;
+		mix_nsec = op_hist[OP_READ].total + op_hist[OP_STAT].total +
+		    op_hist[OP_UNLINK].total;
+	} else
+#ifdef HAVE_IO_URING
+	if (io_engine == IO_ENGINE_URING) {
+		fs_mark_hist_t *op_hist = child_task->thread_stats.op_hist;
+
+		/*
+		 * The io_uring engine records straight into the histograms,
+		 * pull the loop totals back out of them.
+		 * avg_write_nsec is kept as a sum of per file averages like
+		 * write_file() does.
+		 */
+		idle_nsec = uring_write_loop(child_task);
+
+		creat_nsec = op_hist[OP_CREAT].total;
+		min_creat_nsec = op_hist[OP_CREAT].min;
+		max_creat_nsec = op_hist[OP_CREAT].max;
+		total_write_nsec = op_hist[OP_WRITE].total;
+		min_write_nsec = op_hist[OP_WRITE].min;
+		max_write_nsec = op_hist[OP_WRITE].max;
+		if (op_hist[OP_WRITE].count)
+			avg_write_nsec = total_write_nsec * child_task->files_claimed /
+			    op_hist[OP_WRITE].count;
+		fsync_nsec = op_hist[OP_FSYNC].total;
+		min_fsync_nsec = op_hist[OP_FSYNC].min;
+		max_fsync_nsec = op_hist[OP_FSYNC].max;
+		close_nsec = op_hist[OP_CLOSE].total;
+		min_close_nsec = op_hist[OP_CLOSE].min;
+		max_close_nsec = op_hist[OP_CLOSE].max;
+		rename_nsec = op_hist[OP_RENAME].total;
+		min_rename_nsec = op_hist[OP_RENAME].min;
+		max_rename_nsec = op_hist[OP_RENAME].max;
+	} else
+#endif
+	for (file_index = 0; have_file(child_task, file_index); ++file_index) {
+		/*
+		 * Open loop (--rate): wait for this file's slot on the timeline.
+		 * If we are running late, start straight away; the lateness
+		 * shows up in the FILE latency.
+		 */
+		if (target_rate) {
+			file_start_ts = file_start_nsec(child_task, loop_start_ts,
+							file_index);
+			idle_nsec += sleep_until(file_start_ts, &stop_ts);
+		}
+
+		/*
+		 * To better mimic a running system, create the file names here during the run.
+		 * This lets us stick in the time of day and vary the distribution in interesting
+		 * ways across the directories.
+		 * Note: the file name is a full path, so it specifies both the directory and 
+		 * filename with the directory.
+		 * The name time stamp comes from the last timer reading, so
+		 * this costs no system calls.
+		 */
+		setup_file_name(child_task, file_index, stop_ts);
+		names = child_task->names;
+
+		/*
+		 * Time the creation of the file.
+		 */
+		file_write_name = file_path(child_task, names[file_index].write_dir,
+					    names[file_index].f_name);
+
+		start_ns(&start_ts);
+		if ((fd =
+		     open(file_write_name, write_open_flags, 0666)) == -1) {
+			fprintf(stderr, "Error in creat: %s\n",
+				strerror(errno));
+			cleanup_exit();
+		}
+		if (!target_rate)
+			file_start_ts = start_ts;
+		delta = stop_ns(&start_ts, &stop_ts);
+		record_op(child_task, OP_CREAT, delta);
+		creat_nsec += delta;
+
+		if (delta > max_creat_nsec)
+			max_creat_nsec = delta;
+
+		if ((min_creat_nsec == 0) || (delta < min_creat_nsec))
+			min_creat_nsec = delta;
+
+		/*
+		 * Time the preallocation of the file, if the write mode
+		 * does one.
+		 */
+		if (((write_mode == WRITE_MODE_FALLOCATE) ||
+		     (write_mode == WRITE_MODE_RANDOM)) && names[file_index].size)
+			account_op(child_task, OP_ALLOC,
+				   alloc_file(fd, names[file_index].size),
+				   &alloc_nsec, &min_alloc_nsec, &max_alloc_nsec);
+
+		/*
+		 * Time writing data into the file.
+		 * The timing needs to be done inside the subroutine since
+		 * one file requires many writes.
+		 * In avg_write_nsec, we acculumate the average of the average write times.
+		 * In total_write_nsec, we track the total time spent in write().
+		 */
+		write_file(child_task, fd, names[file_index].size, &avg_write_nsec,
+			   &total_write_nsec, &min_write_nsec, &max_write_nsec);
+
+		/*
+		 * Time the fsync() operation.
+		 * With the write barrier patch in the kernel,
+		 * this actually flushed the IDE write cache as well.
+		 */
+		if (sync_method & FSYNC_BEFORE_CLOSE) {
+			start_ns(&start_ts);
+
+			if (fsync(fd) == -1) {
+				fprintf(stderr, "fs_mark: fsync failed %s\n",
+					strerror(errno));
+				cleanup_exit();
+			}
+			delta = stop_ns(&start_ts, &stop_ts);
+			record_op(child_task, OP_FSYNC, delta);
+			fsync_nsec += delta;
+
+			if (delta > max_fsync_nsec)
+				max_fsync_nsec = delta;
+			if ((min_fsync_nsec == 0) || (delta < min_fsync_nsec))
+				min_fsync_nsec = delta;
+		}
+
+		/*
+		 * -S 10: start writeback of the file now, wait for it after
+		 * the loop.
+		 */
+		if (sync_method & FSYNC_RANGE) {
+			start_ns(&start_ts);
+			if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) == -1) {
+				fprintf(stderr,
+					"fs_mark: sync_file_range failed %s\n",
+					strerror(errno));
+				cleanup_exit();
+			}
+			account_fsync(child_task, stop_ns(&start_ts, &stop_ts),
+				      &fsync_nsec, &min_fsync_nsec,
+				      &max_fsync_nsec);
+		}
+
+		/*
+		 * Time the file close
+		 */
+		start_ns(&start_ts);
+		close(fd);
+		delta = stop_ns(&start_ts, &stop_ts);
+		record_op(child_task, OP_CLOSE, delta);
+
+		close_nsec += delta;
+		if (delta > max_close_nsec)
+			max_close_nsec = delta;
+
+		if ((min_close_nsec == 0) || (delta < min_close_nsec))
+			min_close_nsec = delta;
+
+		/*
+		 * Move the finished file into place, and optionally make
+		 * both directory changes durable.
+		 */
+		if (rename_mode != RENAME_NONE) {
+			account_op(child_task, OP_RENAME,
+				   rename_file(child_task, &names[file_index]),
+				   &rename_nsec, &min_rename_nsec, &max_rename_nsec);
+			if (rename_sync) {
+				account_op(child_task, OP_DIRSYNC,
+					   fsync_dir(names[file_index].write_dir, 0),
+					   &dirsync_nsec, &min_dirsync_nsec,
+					   &max_dirsync_nsec);
+				account_op(child_task, OP_DIRSYNC,
+					   fsync_dir(names[file_index].target_dir, 0),
+					   &dirsync_nsec, &min_dirsync_nsec,
+					   &max_dirsync_nsec);
+			}
+			stop_ts = nsnow();
+		}
+
+		/*
+		 * Make the new directory entry durable too. This is part
+		 * of the cost of the file, so it goes into the FILE time.
+		 */
+		if (dir_sync == DIRSYNC_FILE) {
+			account_op(child_task, OP_DIRSYNC,
+				   fsync_dir(names[file_index].target_dir, 0),
+				   &dirsync_nsec, &min_dirsync_nsec,
+				   &max_dirsync_nsec);
+			stop_ts = nsnow();
+		}
+
+		record_file(child_task, names[file_index].size,
+			    stop_ts - file_start_ts);
+
+		/*
+		 * Group commit: fsync the batch once its last file is written,
+		 * then the directories the batch went into.
+		 */
+		if (((file_index + 1) % sync_batch) == 0) {
+			if (sync_method & FSYNC_BATCH)
+				fsync_batch(child_task, file_index + 1 - sync_batch,
+					    sync_batch, &fsync_nsec, &min_fsync_nsec,
+					    &max_fsync_nsec);
+			if (dir_sync == DIRSYNC_BATCH)
+				sync_dirty_dirs(child_task, &dirsync_nsec,
+						&min_dirsync_nsec, &max_dirsync_nsec);
+		}
+	}
+	names = child_task->names;
+	nr_files = child_task->files_claimed;
+
+	/*
+	 * The last, partial, group commit batch.
+	 */
+	if ((sync_method & FSYNC_BATCH) && (nr_files % sync_batch))
+		fsync_batch(child_task, nr_files - (nr_files % sync_batch),
+			    nr_files % sync_batch, &fsync_nsec, &min_fsync_nsec,
+			    &max_fsync_nsec);
+	if (dir_sync == DIRSYNC_BATCH)
+		sync_dirty_dirs(child_task, &dirsync_nsec, &min_dirsync_nsec,
+				&max_dirsync_nsec);
+
+	if (sync_method & FSYNC_SYNC_SYSCALL) {
+		start_ns(&start_ts);
+		sync();
+		delta = stop_ns(&start_ts, &stop_ts);
+		record_op(child_task, OP_SYNC, delta);
+
+		/*
+		 * Add the time spent in sync() to the total cost of fsync()
+		 */
+		avg_sync_nsec = delta;
+	}
+
+	/*
+	 * Post writing, in order fsync method.
+	 * Note that we count three system calls into the time spent in fsync() here -
+	 * the open/fsync and close.
+	 */
+	if (sync_method & FSYNC_POST_IN_ORDER) {
+		for (file_index = 0; file_index < nr_files; ++file_index)
+			account_fsync(child_task,
+				      fsync_file(child_task->path, &names[file_index]),
+				      &fsync_nsec, &min_fsync_nsec, &max_fsync_nsec);
+	}
+
+	/*
+	 * Post writing, reverse order fsync method.
+	 * Note that we count three system calls into the time spent in fsync() here -
+	 * the open/fsync and close.
+	 */
+	if (sync_method & FSYNC_POST_REVERSE) {
+		for (file_index = (nr_files - 1); file_index >= 0;
+		     --file_index)
+			account_fsync(child_task,
+				      fsync_file(child_task->path, &names[file_index]),
+				      &fsync_nsec, &min_fsync_nsec, &max_fsync_nsec);
+	}
+
+	/*
+	 * Post writing, one per directory fsync method.
+	 * Note that we count three system calls into the time spent in fsync() here -
+	 * the open/fsync and close.
+	 */
+	if ((sync_method & FSYNC_FIRST_FILE) && (nr_files > 0)) {
+		delta = fsync_file(child_task->path, &names[0]);
+		record_op(child_task, OP_FSYNC, delta);
+		fsync_nsec += delta;
+	}
+
+	/*
+	 * Post writing, one syncfs() per directory: flushes the whole file
+	 * system the directory is on.
+	 */
+	if (sync_method & FSYNC_SYNCFS)
+		account_fsync(child_task, fsync_dir(child_task->test_dir, 1),
+			      &fsync_nsec, &min_fsync_nsec, &max_fsync_nsec);
+
+	/*
+	 * Post writing, sync_file_range() method: wait for the writeback of
+	 * each file started in the loop. The directories are synced below
+	 * (-S 10 turns on --dir-sync subdir).
+	 */
+	if (sync_method & FSYNC_RANGE) {
+		for (file_index = 0; file_index < nr_files; ++file_index)
+			account_fsync(child_task,
+				      fsync_file(child_task->path, &names[file_index]),
+				      &fsync_nsec, &min_fsync_nsec, &max_fsync_nsec);
+	}
+
+	/*
+	 * Post writing, fsync() each directory that got files.
+	 */
+	if (dir_sync == DIRSYNC_SUBDIR)
+		sync_dirty_dirs(child_task, &dirsync_nsec, &min_dirsync_nsec,
+				&max_dirsync_nsec);
+
+	/*
+	 * Record the total time spent in the file writing loop - we ignore the time spent unlinking files
+	 */
+	loop_nsecs = stop_ns(&loop_start_ts, &loop_stop_ts);
+	if (cpu_stats)
+		account_cpu_usage(child_task, CPU_PHASE_WRITE, &cpu_start);
+
+	/*
+	 * Read back phases, also not counted in the file writing loop.
+	 */
+	if (read_phases)
+		do_read_phases(child_task);
+
 	/*
-	 * Post writing, reverse order fsync method.
-	 * Note that we count three system calls into the time spent in fsync() here -
-	 * the open/fsync and close.
+	 * The --mix population is shared, so it can only go once every
+	 * thread is done with it.
 	 */
-	if (sync_method & FSYNC_POST_REVERSE) {
-		for (file_index = (num_files - 1); file_index >= 0;
-		     --file_index) {
-			int fd;
-
-			sprintf(file_target_name, "%s/%s",
-				names[file_index].target_dir,
-				names[file_index].f_name);
+	if (mix_mode && !keep_files) {
+		pthread_barrier_wait(&loop_start_barrier);
+		if (cpu_stats)
+			sample_cpu_usage(child_task, &cpu_start);
+		mix_cleanup(child_task);
+	}
 
-			start(&start_tv);
-			if ((fd = open(file_target_name, O_RDONLY, 0666)) == -1) {
-				fprintf(stderr, "Error in open of %s : %s\n",
+	/*
+	 * Time unlink of the file if files need removing for this run.
+	 */
+	if (!keep_files && !mix_mode) {
+		if (cpu_stats)
+			sample_cpu_usage(child_task, &cpu_start);
+		for (file_index = 0; file_index < nr_files; ++file_index) {
+			file_target_name = file_path(child_task,
+						     names[file_index].target_dir,
+						     names[file_index].f_name);
+
+			start_ns(&start_ts);
+			if (unlink(file_target_name) == -1) {
+				fprintf(stderr, "Error in unlink of %s : %s\n",
 					file_target_name, strerror(errno));
 				cleanup_exit();
 			}
+			delta = stop_ns(&start_ts, &stop_ts);
+			record_op(child_task, OP_UNLINK, delta);
 
-			if (fsync(fd) == -1) {
-				fprintf(stderr, "fs_mark: fsync failed %s\n",
-					strerror(errno));
-				cleanup_exit();
+			unlink_nsec += delta;
+			if (delta > max_unlink_nsec)
+				max_unlink_nsec = delta;
+
+			if ((min_unlink_nsec == 0) || (delta < min_unlink_nsec))
+				min_unlink_nsec = delta;
+		}
+	}
+	if (cpu_stats && !keep_files)
+		account_cpu_usage(child_task, CPU_PHASE_UNLINK, &cpu_start);
+
+	/*
+	 * Combine the file write operations into one metric
+	 */
+	/*
+	 * Time spent waiting for the --rate timeline is not overhead either.
+	 */
+	total_file_ops =
+	    creat_nsec + total_write_nsec + fsync_nsec + avg_sync_nsec +
+	    close_nsec + dirsync_nsec + rename_nsec + alloc_nsec + idle_nsec +
+	    mix_nsec;
+	/*
+	 * With -E uring several files are in flight at once, so the time spent
+	 * in file operations can add up to more than the wall clock time.
+	 */
+	if (total_file_ops < loop_nsecs)
+		app_overhead_nsec = loop_nsecs - total_file_ops;
+	else
+		app_overhead_nsec = 0ULL;
+
+	/*
+	 * Now compute the rate that we wrote files in files/sec.
+	 */
+	files_per_sec = nr_files / (loop_nsecs / 1000000000.0);
+	child_task->thread_stats.bytes_per_sec =
+	    child_task->thread_stats.bytes_written / (loop_nsecs / 1000000000.0);
+
+	/*
+	 * A thread can end up with no files at all when the others took them.
+	 */
+	if (nr_files == 0)
+		nr_files = 1;
+
+	child_task->thread_stats.loop_start_nsec = loop_start_ts;
+	child_task->thread_stats.loop_stop_nsec = loop_stop_ts;
+	child_task->thread_stats.file_count = child_task->files_claimed;
+	child_task->thread_stats.files_stolen = child_task->files_stolen;
+	child_task->thread_stats.files_per_sec = files_per_sec;
+	child_task->thread_stats.app_overhead_nsec = app_overhead_nsec;
+	child_task->thread_stats.min_creat_nsec = min_creat_nsec;
+	child_task->thread_stats.avg_creat_nsec = creat_nsec / nr_files;
+	child_task->thread_stats.max_creat_nsec = max_creat_nsec;
+	child_task->thread_stats.min_write_nsec = min_write_nsec;
+	child_task->thread_stats.avg_write_nsec = avg_write_nsec / nr_files;
+	child_task->thread_stats.max_write_nsec = max_write_nsec;
+	child_task->thread_stats.min_fsync_nsec = min_fsync_nsec;
+	child_task->thread_stats.avg_fsync_nsec = fsync_nsec / nr_files;
+	child_task->thread_stats.max_fsync_nsec = max_fsync_nsec;
+	child_task->thread_stats.avg_sync_nsec = avg_sync_nsec;
+	child_task->thread_stats.min_close_nsec= min_close_nsec;
+	child_task->thread_stats.avg_close_nsec = close_nsec / nr_files;
+	child_task->thread_stats.max_close_nsec = max_close_nsec;
+	child_task->thread_stats.min_unlink_nsec = min_unlink_nsec;
+	child_task->thread_stats.avg_unlink_nsec = unlink_nsec / nr_files;
+	child_task->thread_stats.max_unlink_nsec = max_unlink_nsec;
+	child_task->thread_stats.min_dirsync_nsec = min_dirsync_nsec;
+	child_task->thread_stats.avg_dirsync_nsec = dirsync_nsec / nr_files;
+	child_task->thread_stats.max_dirsync_nsec = max_dirsync_nsec;
+	child_task->thread_stats.min_rename_nsec = min_rename_nsec;
+	child_task->thread_stats.avg_rename_nsec = rename_nsec / nr_files;
+	child_task->thread_stats.max_rename_nsec = max_rename_nsec;
+	child_task->thread_stats.min_alloc_nsec = min_alloc_nsec;
+	child_task->thread_stats.avg_alloc_nsec = alloc_nsec / nr_files;
+	child_task->thread_stats.max_alloc_nsec = max_alloc_nsec;
+
+	return;
+}
+
+/*
+ * Add the thread_stats information into the global iteration statistics
+ */
+void aggregate_thread_stats(fs_mark_stat_t * thread_stats,
+			    fs_mark_stat_t * iteration_stats)
+{
+	unsigned long long first_start, last_start, first_stop, last_stop;
+	unsigned long long creat_sum = 0, write_sum = 0, fsync_sum = 0;
+	unsigned long long close_sum = 0, unlink_sum = 0, dirsync_sum = 0;
+	unsigned long long rename_sum = 0, alloc_sum = 0, files;
+	int i, op, phase, class;
+
+	first_start = last_start = child_tasks[0].thread_stats.loop_start_nsec;
+	first_stop = last_stop = child_tasks[0].thread_stats.loop_stop_nsec;
+
+	for (i = 0; i < num_threads; i++) {
+		thread_stats = &child_tasks[i].thread_stats;
+
+		/*
+		 * Histograms merge exactly, so percentiles are computed over every
+		 * sample taken by every thread.
+		 */
+		for (op = 0; op < NUM_OPS; op++)
+			hist_merge(&iteration_stats->op_hist[op],
+				   &thread_stats->op_hist[op]);
+		for (class = 0; class < NUM_SIZE_CLASSES; class++)
+			hist_merge(&iteration_stats->size_hist[class],
+				   &thread_stats->size_hist[class]);
+
+		for (phase = 0; phase < NUM_READ_PHASES; phase++)
+			iteration_stats->phase_files_per_sec[phase] +=
+			    thread_stats->phase_files_per_sec[phase];
+		for (op = 0; op < NUM_MIX_OPS; op++)
+			iteration_stats->mix_ops[op] += thread_stats->mix_ops[op];
+		iteration_stats->mix_misses += thread_stats->mix_misses;
+		iteration_stats->churn_filling += thread_stats->churn_filling;
+		for (phase = 0; phase < NUM_CPU_PHASES; phase++) {
+			cpu_usage_t *usage = &iteration_stats->cpu_usage[phase];
+			cpu_usage_t *thread_usage = &thread_stats->cpu_usage[phase];
+
+			usage->user_nsec += thread_usage->user_nsec;
+			usage->sys_nsec += thread_usage->sys_nsec;
+			usage->voluntary_csw += thread_usage->voluntary_csw;
+			usage->involuntary_csw += thread_usage->involuntary_csw;
+			usage->run_nsec += thread_usage->run_nsec;
+			usage->wait_nsec += thread_usage->wait_nsec;
+			usage->wall_nsec += thread_usage->wall_nsec;
+		}
+
+		/*
+		 * File count is a simple addition. Files/second is not: each
+		 * thread's rate is over its own loop time, so the iteration rate
+		 * is taken over the wall clock time of all the threads below.
+		 */
+		iteration_stats->file_count += thread_stats->file_count;
+		iteration_stats->files_stolen += thread_stats->files_stolen;
+		iteration_stats->bytes_written += thread_stats->bytes_written;
+		iteration_stats->app_overhead_nsec +=
+		    thread_stats->app_overhead_nsec;
+
+		if (thread_stats->loop_start_nsec < first_start)
+			first_start = thread_stats->loop_start_nsec;
+		if (thread_stats->loop_start_nsec > last_start)
+			last_start = thread_stats->loop_start_nsec;
+		if (thread_stats->loop_stop_nsec < first_stop)
+			first_stop = thread_stats->loop_stop_nsec;
+		if (thread_stats->loop_stop_nsec > last_stop)
+			last_stop = thread_stats->loop_stop_nsec;
+
+		/*
+		 * For each of the measured system calls, weight the per file
+		 * average times by the number of files the thread wrote and
+		 * compute the min and max.
+		 * We divide the sums after this loop by the file count.
+		 */
+		files = thread_stats->file_count;
+		creat_sum += thread_stats->avg_creat_nsec * files;
+		if ((iteration_stats->min_creat_nsec == 0) ||
+		    (thread_stats->min_creat_nsec <
+		     iteration_stats->min_creat_nsec))
+			iteration_stats->min_creat_nsec =
+			    thread_stats->min_creat_nsec;
+		if (thread_stats->max_creat_nsec >
+		    iteration_stats->max_creat_nsec)
+			iteration_stats->max_creat_nsec =
+			    thread_stats->max_creat_nsec;
+
+		write_sum += thread_stats->avg_write_nsec * files;
+		if ((iteration_stats->min_write_nsec == 0) ||
+		    (thread_stats->min_write_nsec <
+		     iteration_stats->min_write_nsec))
+			iteration_stats->min_write_nsec =
+			    thread_stats->min_write_nsec;
+		if (thread_stats->max_write_nsec >
+		    iteration_stats->max_write_nsec)
+			iteration_stats->max_write_nsec =
+			    thread_stats->max_write_nsec;
+
+		fsync_sum += thread_stats->avg_fsync_nsec * files;
+		if ((iteration_stats->min_fsync_nsec == 0) ||
+		    (thread_stats->min_fsync_nsec <
+		     iteration_stats->min_fsync_nsec))
+			iteration_stats->min_fsync_nsec =
+			    thread_stats->min_fsync_nsec;
+		if (thread_stats->max_fsync_nsec >
+		    iteration_stats->max_fsync_nsec)
+			iteration_stats->max_fsync_nsec =
+			    thread_stats->max_fsync_nsec;
+
+		iteration_stats->avg_sync_nsec += thread_stats->avg_sync_nsec;
+		if ((iteration_stats->min_sync_nsec == 0) ||
+		    (thread_stats->min_sync_nsec <
+		     iteration_stats->min_sync_nsec))
+			iteration_stats->min_sync_nsec =
+			    thread_stats->min_sync_nsec;
+		if (thread_stats->max_sync_nsec >
+		    iteration_stats->max_sync_nsec)
+			iteration_stats->max_sync_nsec =
+			    thread_stats->max_sync_nsec;
+
+		close_sum += thread_stats->avg_close_nsec * files;
+		if ((iteration_stats->min_close_nsec == 0) ||
+		    (thread_stats->min_close_nsec <
+		     iteration_stats->min_close_nsec))
+			iteration_stats->min_close_nsec =
+			    thread_stats->min_close_nsec;
+		if (thread_stats->max_close_nsec >
+		    iteration_stats->max_close_nsec)
+			iteration_stats->max_close_nsec =
+			    thread_stats->max_close_nsec;
+
+		unlink_sum += thread_stats->avg_unlink_nsec * files;
+		if ((iteration_stats->min_unlink_nsec == 0)
+		    || (thread_stats->min_unlink_nsec <
+			iteration_stats->min_unlink_nsec))
+			iteration_stats->min_unlink_nsec =
+			    thread_stats->min_unlink_nsec;
+		if (thread_stats->max_unlink_nsec >
+		    iteration_stats->max_unlink_nsec)
+			iteration_stats->max_unlink_nsec =
+			    thread_stats->max_unlink_nsec;
+
+		dirsync_sum += thread_stats->avg_dirsync_nsec * files;
+		if ((iteration_stats->min_dirsync_nsec == 0)
+		    || (thread_stats->min_dirsync_nsec <
+			iteration_stats->min_dirsync_nsec))
+			iteration_stats->min_dirsync_nsec =
+			    thread_stats->min_dirsync_nsec;
+		if (thread_stats->max_dirsync_nsec >
+		    iteration_stats->max_dirsync_nsec)
+			iteration_stats->max_dirsync_nsec =
+			    thread_stats->max_dirsync_nsec;
+
+		rename_sum += thread_stats->avg_rename_nsec * files;
+		if ((iteration_stats->min_rename_nsec == 0)
+		    || (thread_stats->min_rename_nsec <
+			iteration_stats->min_rename_nsec))
+			iteration_stats->min_rename_nsec =
+			    thread_stats->min_rename_nsec;
+		if (thread_stats->max_rename_nsec >
+		    iteration_stats->max_rename_nsec)
+			iteration_stats->max_rename_nsec =
+			    thread_stats->max_rename_nsec;
+
+		alloc_sum += thread_stats->avg_alloc_nsec * files;
+		if ((iteration_stats->min_alloc_nsec == 0)
+		    || (thread_stats->min_alloc_nsec <
+			iteration_stats->min_alloc_nsec))
+			iteration_stats->min_alloc_nsec =
+			    thread_stats->min_alloc_nsec;
+		if (thread_stats->max_alloc_nsec >
+		    iteration_stats->max_alloc_nsec)
+			iteration_stats->max_alloc_nsec =
+			    thread_stats->max_alloc_nsec;
+	}
+
+	/*
+	 * Per file averages over every file of the iteration. sync() runs once
+	 * per thread, so its average stays a plain mean over the threads.
+	 */
+	files = iteration_stats->file_count ? iteration_stats->file_count : 1;
+	iteration_stats->avg_creat_nsec = creat_sum / files;
+	iteration_stats->avg_write_nsec = write_sum / files;
+	iteration_stats->avg_fsync_nsec = fsync_sum / files;
+	iteration_stats->avg_close_nsec = close_sum / files;
+	iteration_stats->avg_unlink_nsec = unlink_sum / files;
+	iteration_stats->avg_dirsync_nsec = dirsync_sum / files;
+	iteration_stats->avg_rename_nsec = rename_sum / files;
+	iteration_stats->avg_alloc_nsec = alloc_sum / files;
+	iteration_stats->avg_sync_nsec =
+	    iteration_stats->avg_sync_nsec / num_threads;
+
+	/*
+	 * True aggregate rate: all files over the time from the first thread
+	 * starting its write loop to the last one finishing.
+	 */
+	iteration_stats->loop_start_nsec = first_start;
+	iteration_stats->loop_stop_nsec = last_stop;
+	iteration_stats->wall_nsec = last_stop - first_start;
+	iteration_stats->start_skew_nsec = last_start - first_start;
+	iteration_stats->finish_skew_nsec = last_stop - first_stop;
+	if (iteration_stats->wall_nsec) {
+		iteration_stats->files_per_sec = iteration_stats->file_count /
+		    (iteration_stats->wall_nsec / 1000000000.0);
+		iteration_stats->bytes_per_sec = iteration_stats->bytes_written /
+		    (iteration_stats->wall_nsec / 1000000000.0);
+		for (op = 0; op < NUM_MIX_OPS; op++)
+			iteration_stats->mix_ops_per_sec[op] =
+			    iteration_stats->mix_ops[op] /
+			    (iteration_stats->wall_nsec / 1000000000.0);
+	}
+
+	return;
+}
+
+/*
+ * Simple wrapper for the per thread work routines.
+ */
+void thread_work(child_job_t *child_task)
+{
+	/*
+	 * Do any initialization
+	 */
+	setup(child_task);
+
+	do_run(child_task);
+}
+
+/*
+ * Persistent worker: set up once, then run one iteration each time the main
+ * thread releases the start barrier.
+ * The names array and io_buffer are kept from one iteration to the next.
+ */
+void persistent_thread_work(child_job_t *child_task)
+{
+	setup(child_task);
+
+	for (;;) {
+		pthread_barrier_wait(&iteration_start_barrier);
+		if (worker_pool_exit)
+			break;
+
+		do_run(child_task);
+
+		pthread_barrier_wait(&iteration_done_barrier);
+	}
+}
+
+void *thread_function(void *p) 
+{
+	child_job_t *child_task = (child_job_t *) p;
+	child_task->child_tid = __gettid();
+
+	if (persistent_threads)
+		persistent_thread_work(child_task);
+	else
+		thread_work(child_task);
+	return NULL;
+}
+
+/*
+ * Start one worker thread, on its CPUs if --affinity asked for that.
+ */
+void start_worker(pthread_t *thread, child_job_t *child_task)
+{
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+	if ((affinity != AFFINITY_NONE) &&
+	    ((ret = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+						&child_task->cpus)) != 0)) {
+		fprintf(stderr, "fs_mark: pthread_attr_setaffinity_np failed: %s\n",
+			strerror(ret));
+		cleanup_exit();
+	}
+	if ((ret = pthread_create(thread, &attr, thread_function,
+				  (void *)child_task)) != 0) {
+		fprintf(stderr, "fs_mark: pthread_create failed: %s\n",
+			strerror(ret));
+		cleanup_exit();
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Create the persistent worker pool.
+ */
+void start_worker_pool(void)
+{
+	int i;
+
+	/*
+	 * The main thread takes part in both barriers.
+	 */
+	pthread_barrier_init(&iteration_start_barrier, NULL, num_threads + 1);
+	pthread_barrier_init(&iteration_done_barrier, NULL, num_threads + 1);
+
+	if ((worker_threads = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+		fprintf(stderr, "fs_mark: failed to allocate worker threads\n");
+		cleanup_exit();
+	}
+
+	for (i = 0; i < num_threads; i++)
+		start_worker(&worker_threads[i], &child_tasks[i]);
+	worker_pool_running = 1;
+}
+
+/*
+ * Release the parked workers and wait for them to exit.
+ */
+void stop_worker_pool(void)
+{
+	int i;
+
+	if (!worker_pool_running)
+		return;
+
+	worker_pool_exit = 1;
+	pthread_barrier_wait(&iteration_start_barrier);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(worker_threads[i], NULL);
+	}
+
+	pthread_barrier_destroy(&iteration_start_barrier);
+	pthread_barrier_destroy(&iteration_done_barrier);
+	free(worker_threads);
+	worker_pool_running = 0;
+}
+
+void fork_threads(void)
+{
+	int i;
+	pthread_t thread_id[num_threads];
+
+	fflush(stdout);
+	fflush(log_file_fp);
+
+	if ((sync_method & FSYNC_PARALLEL) && !sync_pools_running)
+		start_sync_pools();
+
+	/*
+	 * Persistent mode: run one iteration on the already created workers.
+	 */
+	if (persistent_threads) {
+		if (!worker_pool_running)
+			start_worker_pool();
+
+		pthread_barrier_wait(&iteration_start_barrier);
+		pthread_barrier_wait(&iteration_done_barrier);
+		return;
+	}
+
+	for (i = 0; i < num_threads; i++)
+		start_worker(&thread_id[i], &child_tasks[i]);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(thread_id[i], NULL);
+	}
+}
+
+/*
+ * Interval reporter thread (-i).
+ * Every interval it sums the running counters of all workers and prints the
+ * files/sec and the average latency of each system call over that interval.
+ * Lines go to stdout and, prefixed with '#' so plots of the log still work,
+ * to the log file.
+ */
+void *interval_reporter(void *arg)
+{
+	unsigned long long last_files, last_count[NUM_OPS], last_op_nsec[NUM_OPS];
+	unsigned long long files, count[NUM_OPS], op_nsec[NUM_OPS];
+	unsigned long long begin_nsec, last_nsec, now_nsec, elapsed;
+	struct timespec interval_ts;
+	struct tm now_tm;
+	time_t now_time;
+	char line[MAX_STRING_SIZE * 4], stamp[32];
+	int len, i, op;
+
+	interval_ts.tv_sec = interval_nsecs / 1000000000;
+	interval_ts.tv_nsec = interval_nsecs % 1000000000;
+
+	last_files = 0;
+	memset(last_count, 0, sizeof(last_count));
+	memset(last_op_nsec, 0, sizeof(last_op_nsec));
+	begin_nsec = last_nsec = nsnow();
+
+	while (!interval_exit) {
+		nanosleep(&interval_ts, NULL);
+		if (interval_exit)
+			break;
+
+		files = 0;
+		memset(count, 0, sizeof(count));
+		memset(op_nsec, 0, sizeof(op_nsec));
+		for (i = 0; i < num_threads; i++) {
+			files += __atomic_load_n(&child_tasks[i].progress_files,
+						 __ATOMIC_RELAXED);
+			for (op = 0; op < NUM_OPS; op++) {
+				count[op] += __atomic_load_n(&child_tasks[i].progress_op_count[op],
+							     __ATOMIC_RELAXED);
+				op_nsec[op] += __atomic_load_n(&child_tasks[i].progress_op_nsec[op],
+							       __ATOMIC_RELAXED);
 			}
+		}
 
-			close(fd);
-			delta = stop(&start_tv, &stop_tv);
-			fsync_usec += delta;
+		now_nsec = nsnow();
+		elapsed = now_nsec - last_nsec;
+		if (elapsed == 0)
+			elapsed = 1;
+
+		now_time = time(0);
+		localtime_r(&now_time, &now_tm);
+		strftime(stamp, sizeof(stamp), "%H:%M:%S", &now_tm);
+
+		len = snprintf(line, sizeof(line), "%10.1f %8s %12.1f",
+			       (now_nsec - begin_nsec) / 1000000000.0, stamp,
+			       (files - last_files) / (elapsed / 1000000000.0));
+		for (op = 0; op < NUM_OPS; op++) {
+			unsigned long long ops = count[op] - last_count[op];
+
+			len += snprintf(line + len, sizeof(line) - len, " %8llu",
+					report_time(ops ? (op_nsec[op] - last_op_nsec[op]) / ops : 0ULL));
+		}
+
+		if (output_format == FORMAT_TEXT) {
+			fprintf(stdout, "%s\n", line);
+			fflush(stdout);
+		}
+		fprintf(log_file_fp, "#%s\n", line);
+		fflush(log_file_fp);
+
+		last_files = files;
+		memcpy(last_count, count, sizeof(count));
+		memcpy(last_op_nsec, op_nsec, sizeof(op_nsec));
+		last_nsec = now_nsec;
+	}
+
+	return NULL;
+}
+
+/*
+ * Print the column names of the interval reports and start the reporter.
+ */
+void start_interval_reporter(void)
+{
+	char line[MAX_STRING_SIZE * 4];
+	int len, op;
+
+	len = snprintf(line, sizeof(line), "%10s %8s %12s",
+		       "Elapsed", "Time", "Files/sec");
+	for (op = 0; op < NUM_OPS; op++)
+		len += snprintf(line + len, sizeof(line) - len, " %8.8s",
+				op_name_string[op]);
+
+	if (output_format == FORMAT_TEXT)
+		fprintf(stdout, "\n# Interval reports every %.3f seconds, average system call times in %s.\n%s\n",
+			interval_nsecs / 1000000000.0, REPORT_UNIT_STRING, line);
+	fprintf(log_file_fp, "\n# Interval reports every %.3f seconds, average system call times in %s.\n#%s\n",
+		interval_nsecs / 1000000000.0, REPORT_UNIT_STRING, line);
+
+	if (pthread_create(&interval_thread, NULL, interval_reporter, NULL) != 0) {
+		fprintf(stderr, "fs_mark: failed to start interval reporter\n");
+		cleanup_exit();
+	}
+}
+
+void stop_interval_reporter(void)
+{
+	interval_exit = 1;
+	pthread_join(interval_thread, NULL);
+}
+
+/*
+ * Print some test information and basic parameters to help user understand the rather complex options.
+ */
+void print_run_info(FILE * log_fp, int argc, char **argv)
+{
+	time_t time_run;
+	int i, phase;
+
+	time_run = time(0);
+	fprintf(log_fp, "\n# ");
+	for (i = 0; i < argc; i++)
+		fprintf(log_fp, " %s ", argv[i]);
+	fprintf(log_fp, "\n#\tVersion %s, %d thread(s) starting at %s",
+		fs_mark_version, num_threads, ctime(&time_run));
+	fprintf(log_fp, "#\tSync method: %s\n",
+		sync_policy_string[sync_method_type]);
+	if (write_mode != WRITE_MODE_SEQ) {
+		fprintf(log_fp, "#\tWrite mode: %s", write_mode_desc[write_mode]);
+		if (write_mode == WRITE_MODE_PWRITEV)
+			fprintf(log_fp, " %d chunks per call.", write_iovecs);
+		fprintf(log_fp, "\n");
+	}
+	if (payload != PAYLOAD_ZERO)
+		fprintf(log_fp,
+			"#\tPayload: random data, %.2f:1 compressible, %.2f:1 dedupable"
+			" in %d byte chunks.\n",
+			compress_ratio, dedup_ratio, io_buffer_size);
+	if (rename_mode != RENAME_NONE)
+		fprintf(log_fp,
+			"#\tRename: each file is written %s and renamed into place%s%s.\n",
+			rename_mode == RENAME_TMPDIR ?
+			"in <dir>/" RENAME_TMP_DIR_NAME : "in the next subdirectory",
+			rename_noreplace ? " with RENAME_NOREPLACE" : "",
+			rename_sync ? ", then both directories are fsync()'d" : "");
+	if (dir_sync != DIRSYNC_NONE)
+		fprintf(log_fp, "#\tDirectory sync: fsync() the directories of new files, %s%s.\n",
+			dir_sync == DIRSYNC_FILE ? "after each file" :
+			dir_sync == DIRSYNC_BATCH ? "after every batch of files" :
+			"once per directory after the write loop",
+			sync_method & FSYNC_RANGE ? " (-S 10)" : "");
+	if (sync_method & FSYNC_PARALLEL)
+		fprintf(log_fp,
+			"#\tGroup commit: fsync() every %d files, %d at a time per thread.\n",
+			sync_batch, sync_threads);
+	else if (sync_method & FSYNC_BATCH)
+		fprintf(log_fp, "#\tGroup commit: fsync() every %d files.\n",
+			sync_batch);
+	fprintf(log_fp, "#\tTiming clock: %s\n", timing_clock_name());
+	if (io_engine == IO_ENGINE_URING)
+		fprintf(log_fp,
+			"#\tIO engine: io_uring, %d files in flight per thread.\n",
+			files_in_flight);
+	if (target_rate)
+		fprintf(log_fp,
+			"#\tOpen loop: %.1f files/sec across all threads, FILE latency is taken from each file's intended start.\n",
+			target_rate);
+	if (steal_batch)
+		fprintf(log_fp,
+			"#\tWork stealing: files are claimed in batches of %d from per directory queues.\n",
+			steal_batch);
+	if (affinity != AFFINITY_NONE) {
+		char cpus[MAX_STRING_SIZE];
+
+		fprintf(log_fp, "#\tAffinity: %s,",
+			affinity == AFFINITY_LIST ? affinity_cpus :
+			affinity_string[affinity]);
+		for (i = 0; i < num_threads; i++)
+			fprintf(log_fp, " %d:%s(node %d)", i,
+				format_cpu_list(&child_tasks[i].cpus, cpus,
+						sizeof(cpus)),
+				child_tasks[i].numa_node);
+		fprintf(log_fp, "\n");
+	}
+	if (dev_stats) {
+		fprintf(log_fp, "#\tDevice stats:");
+		for (i = 0; i < num_dirs; i++)
+			fprintf(log_fp, "%s %s %s%s", i ? "," : "", dir_args[i],
+				dir_block_dev[i] < 0 ? "(no block device)" : "on ",
+				dir_block_dev[i] < 0 ? "" :
+				block_devs[dir_block_dev[i]].name);
+		fprintf(log_fp, ". Dev MB and WAmp are bytes written by the device,"
+			" and that over the bytes fs_mark wrote to it.\n");
+	}
+	if (churn_target)
+		fprintf(log_fp,
+			"#\tChurn: create files until the file system is %d%% full, then each new file"
+			" replaces a random one. Filling iterations do not count in -L.\n",
+			churn_target);
+	else if (mix_mode) {
+		double total = 0.0;
+		int op;
+
+		for (op = 0; op < NUM_MIX_OPS; op++)
+			total += mix_weight[op];
+		fprintf(log_fp, "#\tMixed workload: %d operations per thread,", num_files);
+		for (op = 0; op < NUM_MIX_OPS; op++)
+			fprintf(log_fp, " %s %.1f%%%s", mix_op_string[op],
+				100.0 * mix_weight[op] / total,
+				op < NUM_MIX_OPS - 1 ? "," : "");
+		fprintf(log_fp,
+			", on files shared by the threads of each directory"
+			" (%d per thread to start).\n",
+			mix_files);
+	}
+	if (read_phases) {
+		fprintf(log_fp, "#\tRead back phases after the write loop:");
+		for (phase = 0; phase < NUM_READ_PHASES; phase++)
+			if (read_phases & (1 << phase))
+				fprintf(log_fp, " %s", read_phase_string[phase]);
+		fprintf(log_fp, "\n");
+	}
+	if (num_subdirs > 1) {
+		fprintf(log_fp,
+			"#\tDirectories:  %s across %d subdirectories with %d %s.\n",
+			dir_policy_string[dir_policy], num_subdirs,
+			dir_policy ==
+			DIR_ROUND_ROBIN ? num_per_subdir : (int) secs_per_directory,
+			dir_policy == DIR_ROUND_ROBIN ? "files per subdirectory" :
+			"seconds per subdirectory");
+	} else
+		fprintf(log_fp, "#\tDirectories:  no subdirectories used\n");
+	fprintf(log_fp,
+		"#\tFile names: %d bytes long, (%d initial bytes of time stamp with %d random bytes at end of name)\n",
+		name_len, name_len - rand_len, rand_len);
+	if (size_dist == SIZE_DIST_FIXED)
+		fprintf(log_fp,
+			"#\tFiles info: size %d bytes, written with an IO size of %d bytes per write\n",
+			file_size, io_buffer_size);
+	else
+		fprintf(log_fp,
+			"#\tFiles info: sizes %s (%s, mean %.0f max %u bytes), written with an IO size of %d bytes per write\n",
+			size_dist_spec,
+			size_dist == SIZE_DIST_LIST ? "weighted list" : "log-normal",
+			size_dist_mean, file_size, io_buffer_size);
+	if (direct_io || open_sync || use_hugepages) {
+		fprintf(log_fp, "#\tOpen flags:");
+		if (direct_io)
+			fprintf(log_fp, " O_DIRECT (IO aligned to %u bytes)",
+				direct_align);
+		if (open_sync)
+			fprintf(log_fp, "%s%s", direct_io ? "," : "",
+				open_sync == OPEN_SYNC_DSYNC ? " O_DSYNC" : " O_SYNC");
+		if (!direct_io && !open_sync)
+			fprintf(log_fp, " buffered");
+		fprintf(log_fp, "%s\n",
+			use_hugepages ? "; IO buffers on huge pages." : ".");
+	}
+	fprintf(log_fp,
+		"#\tApp overhead is time in %s spent in the test not doing file writing related system calls.\n",
+		REPORT_UNIT_STRING);
+
+	if (print_percentiles)
+		fprintf(log_fp,
+			"#\tPercentiles are computed from log bucketed histograms merged across all threads.\n");
+
+	if (log_fp != stdout)
+		fprintf(log_fp, "#");
+	if (verbose_stats)
+		fprintf(log_fp,
+			"#\tAll system call times are reported in %s.\n\n",
+			REPORT_UNIT_STRING);
+	else
+		fprintf(log_fp, "\n");
+	fprintf(log_fp, "%6s %12s %12s %12s %16s",
+		"FSUse%", "Count", "Size", "Files/sec", "App Overhead");
+	if (size_dist != SIZE_DIST_FIXED)
+		fprintf(log_fp, " %12s", "MB/sec");
+	if (dev_stats)
+		fprintf(log_fp, " %12s %12s %8s %8s", "Dev IOPS", "Dev MB", "QDepth",
+			"WAmp");
+	if (verbose_stats) {
+		fprintf(log_fp, " %26s %26s %26s %26s %26s %26s",
+			"CREAT (Min/Avg/Max)", "WRITE (Min/Avg/Max)",
+			"FSYNC (Min/Avg/Max)", "SYNC (Min/Avg/Max)",
+			"CLOSE (Min/Avg/Max)", "UNLINK (Min/Avg/Max)");
+		if ((dir_sync != DIRSYNC_NONE) || rename_sync)
+			fprintf(log_fp, " %26s", "DIRSYNC (Min/Avg/Max)");
+		if (rename_mode != RENAME_NONE)
+			fprintf(log_fp, " %26s", "RENAME (Min/Avg/Max)");
+		if ((write_mode == WRITE_MODE_FALLOCATE) ||
+		    (write_mode == WRITE_MODE_RANDOM))
+			fprintf(log_fp, " %26s", "ALLOC (Min/Avg/Max)");
+	}
 
-			if (delta > max_fsync_usec)
-				max_fsync_usec = delta;
-			if ((min_fsync_usec == 0) || (delta < min_fsync_usec))
-				min_fsync_usec = delta;
+	for (phase = 0; phase < NUM_READ_PHASES; phase++) {
+		char column[MAX_STRING_SIZE];
 
+		if (!(read_phases & (1 << phase)))
+			continue;
+		fprintf(log_fp, " %12s", read_phase_column[phase]);
+		if (verbose_stats) {
+			snprintf(column, sizeof(column), "%.32s (Min/Avg/Max)",
+				 op_name_string[read_phase_op[phase]]);
+			fprintf(log_fp, " %26s", column);
 		}
 	}
 
-	/*
-	 * Post writing, one per directory fsync method.
-	 * Note that we count three system calls into the time spent in fsync() here -
-	 * the open/fsync and close.
-	 */
-	if (sync_method & FSYNC_FIRST_FILE) {
-		int fd;
-
-		sprintf(file_target_name, "%s/%s", names[0].target_dir,
-			names[0].f_name);
+	for (i = 0; mix_mode && (i < NUM_MIX_OPS); i++) {
+		char column[MAX_STRING_SIZE];
 
-		start(&start_tv);
-		if ((fd = open(file_target_name, O_RDONLY, 0666)) == -1) {
-			fprintf(stderr, "Error in open of %s : %s\n",
-				file_target_name, strerror(errno));
-			cleanup_exit();
+		fprintf(log_fp, " %12s", mix_op_column[i]);
+		if (verbose_stats) {
+			snprintf(column, sizeof(column), "%.32s (Min/Avg/Max)",
+				 op_name_string[mix_op_hist[i]]);
+			fprintf(log_fp, " %26s", column);
 		}
+	}
+	if (mix_mode)
+		fprintf(log_fp, " %12s", "Misses");
 
-		if (fsync(fd) == -1) {
-			fprintf(stderr, "fs_mark: fsync failed %s\n",
-				strerror(errno));
-			cleanup_exit();
-		}
+	if (print_percentiles) {
+		int op;
+		char column[MAX_STRING_SIZE];
 
-		close(fd);
-		fsync_usec += stop(&start_tv, &stop_tv);
+		for (op = 0; op < NUM_OPS; op++) {
+			snprintf(column, sizeof(column), "%.32s (p50/p99/p99.9)",
+				 op_name_string[op]);
+			fprintf(log_fp, " %26s", column);
+		}
 	}
+	fprintf(log_fp, "\n");
+
+	return;
+}
+
+/*
+ * Keep this routine's stdout logging coordinated with the logging done above
+ * in print_run_info().
+ */
+void print_iteration_stats(FILE * log_fp, fs_mark_stat_t * iteration_stats,
+			   unsigned int files_written)
+{
+	unsigned long long avg_size;
+	int df_full, phase, op;
 
 	/*
-	 * Record the total time spent in the file writing loop - we ignore the time spent unlinking files
+	 * Check how full the first directory is after each run
 	 */
-	loop_usecs = stop(&loop_start_tv, &loop_stop_tv);
+	df_full = get_df_full(child_tasks[0].test_dir);
 
 	/*
-	 * Time unlink of the file if files need removing for this run.
+	 * Size is the average size of the files of this iteration, which
+	 * is the -s size unless a distribution was given.
 	 */
-	if (!keep_files) {
-		for (file_index = 0; file_index < num_files; ++file_index) {
-			sprintf(file_target_name, "%s/%s",
-				names[file_index].target_dir,
-				names[file_index].f_name);
-
-			start(&start_tv);
-			if (unlink(file_target_name) == -1) {
-				fprintf(stderr, "Error in unlink of %s : %s\n",
-					file_target_name, strerror(errno));
-				cleanup_exit();
-			}
-			delta = stop(&start_tv, &stop_tv);
+	avg_size = iteration_stats->file_count ?
+	    iteration_stats->bytes_written / iteration_stats->file_count : 0ULL;
 
-			unlink_usec += delta;
-			if (delta > max_unlink_usec)
-				max_unlink_usec = delta;
+	fprintf(log_fp,
+		"%6u %12u %12llu %12.1f %16llu",
+		df_full,
+		files_written,
+		avg_size,
+		iteration_stats->files_per_sec,
+		report_time(iteration_stats->app_overhead_nsec));
+	if (size_dist != SIZE_DIST_FIXED)
+		fprintf(log_fp, " %12.1f",
+			iteration_stats->bytes_per_sec / (1024.0 * 1024.0));
+	if (dev_stats)
+		fprintf(log_fp, " %12.1f %12.1f %8.2f %8.2f",
+			iteration_stats->dev_iops,
+			iteration_stats->dev_bytes_written / (1024.0 * 1024.0),
+			iteration_stats->dev_queue_depth,
+			iteration_stats->write_amplification);
 
-			if ((min_unlink_usec == 0) || (delta < min_unlink_usec))
-				min_unlink_usec = delta;
+	if (verbose_stats)
+		fprintf(log_fp,
+			" %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu",
+			report_time(iteration_stats->min_creat_nsec),
+			report_time(iteration_stats->avg_creat_nsec),
+			report_time(iteration_stats->max_creat_nsec),
+			report_time(iteration_stats->min_write_nsec),
+			report_time(iteration_stats->avg_write_nsec),
+			report_time(iteration_stats->max_write_nsec),
+			report_time(iteration_stats->min_fsync_nsec),
+			report_time(iteration_stats->avg_fsync_nsec),
+			report_time(iteration_stats->max_fsync_nsec),
+			report_time(iteration_stats->min_sync_nsec),
+			report_time(iteration_stats->avg_sync_nsec),
+			report_time(iteration_stats->max_sync_nsec),
+			report_time(iteration_stats->min_close_nsec),
+			report_time(iteration_stats->avg_close_nsec),
+			report_time(iteration_stats->max_close_nsec),
+			report_time(iteration_stats->min_unlink_nsec),
+			report_time(iteration_stats->avg_unlink_nsec),
+			report_time(iteration_stats->max_unlink_nsec));
+
+	if (verbose_stats && ((dir_sync != DIRSYNC_NONE) || rename_sync))
+		fprintf(log_fp, " %8llu %8llu %8llu",
+			report_time(iteration_stats->min_dirsync_nsec),
+			report_time(iteration_stats->avg_dirsync_nsec),
+			report_time(iteration_stats->max_dirsync_nsec));
+	if (verbose_stats && (rename_mode != RENAME_NONE))
+		fprintf(log_fp, " %8llu %8llu %8llu",
+			report_time(iteration_stats->min_rename_nsec),
+			report_time(iteration_stats->avg_rename_nsec),
+			report_time(iteration_stats->max_rename_nsec));
+	if (verbose_stats && ((write_mode == WRITE_MODE_FALLOCATE) ||
+			      (write_mode == WRITE_MODE_RANDOM)))
+		fprintf(log_fp, " %8llu %8llu %8llu",
+			report_time(iteration_stats->min_alloc_nsec),
+			report_time(iteration_stats->avg_alloc_nsec),
+			report_time(iteration_stats->max_alloc_nsec));
+
+	for (phase = 0; phase < NUM_READ_PHASES; phase++) {
+		fs_mark_hist_t *hist;
+
+		if (!(read_phases & (1 << phase)))
+			continue;
+		fprintf(log_fp, " %12.1f",
+			iteration_stats->phase_files_per_sec[phase]);
+		if (verbose_stats) {
+			hist = &iteration_stats->op_hist[read_phase_op[phase]];
+			fprintf(log_fp, " %8llu %8llu %8llu",
+				report_time(hist->min),
+				report_time(hist->count ? hist->total / hist->count : 0ULL),
+				report_time(hist->max));
 		}
 	}
 
-	/*
-	 * Combine the file write operations into one metric
-	 */
-	total_file_ops =
-	    creat_usec + total_write_usec + fsync_usec + avg_sync_usec +
-	    close_usec;
-	app_overhead_usec = loop_usecs - total_file_ops;
+	for (op = 0; mix_mode && (op < NUM_MIX_OPS); op++) {
+		fs_mark_hist_t *hist;
 
-	/*
-	 * Keep track of how many total files we have written since the program
-	 * started
-	 */
-	file_count += num_files;
+		fprintf(log_fp, " %12.1f", iteration_stats->mix_ops_per_sec[op]);
+		if (verbose_stats) {
+			hist = &iteration_stats->op_hist[mix_op_hist[op]];
+			fprintf(log_fp, " %8llu %8llu %8llu",
+				report_time(hist->min),
+				report_time(hist->count ? hist->total / hist->count : 0ULL),
+				report_time(hist->max));
+		}
+	}
+	if (mix_mode)
+		fprintf(log_fp, " %12llu", iteration_stats->mix_misses);
 
-	/*
-	 * Now compute the rate that we wrote files in files/sec.
-	 */
-	files_per_sec = num_files / (loop_usecs / 1000000.0);
+	if (print_percentiles) {
+		for (op = 0; op < NUM_OPS; op++) {
+			fs_mark_hist_t *hist = &iteration_stats->op_hist[op];
 
-	child_task->thread_stats.file_count = file_count;
-	child_task->thread_stats.files_per_sec = files_per_sec;
-	child_task->thread_stats.app_overhead_usec = app_overhead_usec;
-	child_task->thread_stats.min_creat_usec = min_creat_usec;
-	child_task->thread_stats.avg_creat_usec = creat_usec / num_files;
-	child_task->thread_stats.max_creat_usec = max_creat_usec;
-	child_task->thread_stats.min_write_usec = min_write_usec;
-	child_task->thread_stats.avg_write_usec = avg_write_usec / num_files;
-	child_task->thread_stats.max_write_usec = max_write_usec;
-	child_task->thread_stats.min_fsync_usec = min_fsync_usec;
-	child_task->thread_stats.avg_fsync_usec = fsync_usec / num_files;
-	child_task->thread_stats.max_fsync_usec = max_fsync_usec;
-	child_task->thread_stats.avg_sync_usec = avg_sync_usec;
-	child_task->thread_stats.min_close_usec= min_close_usec;
-	child_task->thread_stats.avg_close_usec = close_usec / num_files;
-	child_task->thread_stats.max_close_usec = max_close_usec;
-	child_task->thread_stats.min_unlink_usec = min_unlink_usec;
-	child_task->thread_stats.avg_unlink_usec = unlink_usec / num_files;
-	child_task->thread_stats.max_unlink_usec = max_unlink_usec;
+			fprintf(log_fp, " %8llu %8llu %8llu",
+				report_time(hist_percentile(hist, 50.0)),
+				report_time(hist_percentile(hist, 99.0)),
+				report_time(hist_percentile(hist, 99.9)));
+		}
+	}
+	fprintf(log_fp, "\n");
 
+	fflush(log_fp);
 	return;
 }
 
 /*
- * Add the thread_stats information into the global iteration statistics
+ * With --churn, show how far the aging has got, with the use and the files
+ * of each file system (directories on the same one are counted together,
+ * under the first one's name). Prefixed with '#' so plots of the log still
+ * work.
  */
-void aggregate_thread_stats(fs_mark_stat_t * thread_stats,
-			    fs_mark_stat_t * iteration_stats)
+void print_churn_status(FILE * log_fp, fs_mark_stat_t * iteration_stats,
+			unsigned long long elapsed_nsec)
 {
-	int i;
+	unsigned long long secs = elapsed_nsec / 1000000000ULL;
+	dev_t fs_dev[num_dirs];
+	int fs_dir[num_dirs], fs_files[num_dirs];
+	int nr_fs = 0, i, fs;
+	struct stat stat_buf;
+
+	for (i = 0; i < num_dirs; i++) {
+		if (stat(dir_args[i], &stat_buf) == -1)
+			stat_buf.st_dev = 0;
+		for (fs = 0; fs < nr_fs; fs++)
+			if (stat_buf.st_dev && (fs_dev[fs] == stat_buf.st_dev))
+				break;
+		if (fs == nr_fs) {
+			fs_dev[fs] = stat_buf.st_dev;
+			fs_dir[fs] = i;
+			fs_files[fs] = 0;
+			nr_fs++;
+		}
+		fs_files[fs] += mix_populations[i].count;
+	}
 
-	for (i = 0; i < num_threads; i++) {
-		thread_stats = &child_tasks[i].thread_stats;
+	fprintf(log_fp,
+		"#\tChurn: %s, %llu files replaced, %llu:%02llu:%02llu elapsed,"
+		" target %d%%:",
+		iteration_stats->churn_filling ? "filling" : "replacing",
+		iteration_stats->mix_ops[MIX_UNLINK], secs / 3600,
+		(secs / 60) % 60, secs % 60, churn_target);
+	for (fs = 0; fs < nr_fs; fs++)
+		fprintf(log_fp, "%s %s %d%% full %d files", fs ? "," : "",
+			dir_args[fs_dir[fs]], get_df_full(dir_args[fs_dir[fs]]),
+			fs_files[fs]);
+	fprintf(log_fp, "\n");
 
-		/*
-		 * File count and files/second are simple additions
-		 */
-		iteration_stats->file_count += thread_stats->file_count;
-		iteration_stats->files_per_sec += thread_stats->files_per_sec;
-		iteration_stats->app_overhead_usec +=
-		    thread_stats->app_overhead_usec;
+	fflush(log_fp);
+}
 
-		/*
-		 * For each of the measured system calls, sum up the average times and
-		 * compute the min and max.
-		 * We divide the averages after this loop by thread count.
-		 */
-		iteration_stats->avg_creat_usec += thread_stats->avg_creat_usec;
-		if ((iteration_stats->min_creat_usec == 0) ||
-		    (thread_stats->min_creat_usec <
-		     iteration_stats->min_creat_usec))
-			iteration_stats->min_creat_usec =
-			    thread_stats->min_creat_usec;
-		if (thread_stats->max_creat_usec >
-		    iteration_stats->max_creat_usec)
-			iteration_stats->max_creat_usec =
-			    thread_stats->max_creat_usec;
-
-		iteration_stats->avg_write_usec += thread_stats->avg_write_usec;
-		if ((iteration_stats->min_write_usec == 0) ||
-		    (thread_stats->min_write_usec <
-		     iteration_stats->min_write_usec))
-			iteration_stats->min_write_usec =
-			    thread_stats->min_write_usec;
-		if (thread_stats->max_write_usec >
-		    iteration_stats->max_write_usec)
-			iteration_stats->max_write_usec =
-			    thread_stats->max_write_usec;
-
-		iteration_stats->avg_fsync_usec += thread_stats->avg_fsync_usec;
-		if ((iteration_stats->min_fsync_usec == 0) ||
-		    (thread_stats->min_fsync_usec <
-		     iteration_stats->min_fsync_usec))
-			iteration_stats->min_fsync_usec =
-			    thread_stats->min_fsync_usec;
-		if (thread_stats->max_fsync_usec >
-		    iteration_stats->max_fsync_usec)
-			iteration_stats->max_fsync_usec =
-			    thread_stats->max_fsync_usec;
-
-		iteration_stats->avg_sync_usec += thread_stats->avg_sync_usec;
-		if ((iteration_stats->min_sync_usec == 0) ||
-		    (thread_stats->min_sync_usec <
-		     iteration_stats->min_sync_usec))
-			iteration_stats->min_sync_usec =
-			    thread_stats->min_sync_usec;
-		if (thread_stats->max_sync_usec >
-		    iteration_stats->max_sync_usec)
-			iteration_stats->max_sync_usec =
-			    thread_stats->max_sync_usec;
-
-		iteration_stats->avg_close_usec += thread_stats->avg_close_usec;
-		if ((iteration_stats->min_close_usec == 0) ||
-		    (thread_stats->min_close_usec <
-		     iteration_stats->min_close_usec))
-			iteration_stats->min_close_usec =
-			    thread_stats->min_close_usec;
-		if (thread_stats->max_close_usec >
-		    iteration_stats->max_close_usec)
-			iteration_stats->max_close_usec =
-			    thread_stats->max_close_usec;
-
-		iteration_stats->avg_unlink_usec +=
-		    thread_stats->avg_unlink_usec;
-		if ((iteration_stats->min_unlink_usec == 0)
-		    || (thread_stats->min_unlink_usec <
-			iteration_stats->min_unlink_usec))
-			iteration_stats->min_unlink_usec =
-			    thread_stats->min_unlink_usec;
-		if (thread_stats->max_unlink_usec >
-		    iteration_stats->max_unlink_usec)
-			iteration_stats->max_unlink_usec =
-			    thread_stats->max_unlink_usec;
-	}
-
-	/*
-	 * Recompute the avgerage "average" of the per thread times
-	 */
-	if (num_threads > 1) {
-		iteration_stats->avg_creat_usec =
-		    iteration_stats->avg_creat_usec / num_threads;
-		iteration_stats->avg_write_usec =
-		    iteration_stats->avg_write_usec / num_threads;
-		iteration_stats->avg_fsync_usec =
-		    iteration_stats->avg_fsync_usec / num_threads;
-		iteration_stats->avg_sync_usec =
-		    iteration_stats->avg_sync_usec / num_threads;
-		iteration_stats->avg_close_usec =
-		    iteration_stats->avg_close_usec / num_threads;
-		iteration_stats->avg_unlink_usec =
-		    iteration_stats->avg_unlink_usec / num_threads;
-	}
+/*
+ * Sum the files written into each -d directory in this iteration.
+ */
+void dir_file_counts(unsigned long long *dir_files)
+{
+	int i;
 
-	return;
+	memset(dir_files, 0, num_dirs * sizeof(*dir_files));
+	for (i = 0; i < num_threads; i++)
+		dir_files[child_tasks[i].dir_index] +=
+		    child_tasks[i].thread_stats.file_count;
 }
 
 /*
- * Simple wrapper for the per thread work routines.
+ * With --steal, show how the files of the iteration were actually shared
+ * out. Prefixed with '#' so plots of the log still work.
  */
-void thread_work(child_job_t *child_task)
+void print_work_distribution(FILE * log_fp, fs_mark_stat_t * iteration_stats)
 {
-	/*
-	 * Do any initialization
-	 */
-	setup(child_task);
+	unsigned long long dir_files[num_dirs];
+	unsigned int min_files, max_files, count;
+	int i;
 
-	do_run(child_task);
+	dir_file_counts(dir_files);
+	min_files = max_files = child_tasks[0].thread_stats.file_count;
+	for (i = 1; i < num_threads; i++) {
+		count = child_tasks[i].thread_stats.file_count;
+		if (count < min_files)
+			min_files = count;
+		if (count > max_files)
+			max_files = count;
+	}
+
+	fprintf(log_fp, "#\tWork distribution:");
+	for (i = 0; i < num_dirs; i++)
+		fprintf(log_fp, "%s %s %llu files", i ? "," : "",
+			child_tasks[i].test_dir, dir_files[i]);
+	fprintf(log_fp,
+		"; per thread min %u max %u files; %u files stolen\n",
+		min_files, max_files, iteration_stats->files_stolen);
+
+	fflush(log_fp);
 }
 
-void *thread_function(void *p) 
+/*
+ * With several threads, show how far apart they started and finished and
+ * the spread of their loop times. Prefixed with '#' so plots of the log
+ * still work.
+ */
+void print_thread_skew(FILE * log_fp, fs_mark_stat_t * iteration_stats)
 {
-	child_job_t *child_task = (child_job_t *) p;
-	child_task->child_tid = __gettid();
-	child_task->names = NULL;
+	unsigned long long loop_nsec, min_loop, max_loop;
+	int i, min_thread = 0, max_thread = 0;
+
+	min_loop = max_loop = child_tasks[0].thread_stats.loop_stop_nsec -
+	    child_tasks[0].thread_stats.loop_start_nsec;
+	for (i = 1; i < num_threads; i++) {
+		loop_nsec = child_tasks[i].thread_stats.loop_stop_nsec -
+		    child_tasks[i].thread_stats.loop_start_nsec;
+		if (loop_nsec < min_loop) {
+			min_loop = loop_nsec;
+			min_thread = i;
+		}
+		if (loop_nsec > max_loop) {
+			max_loop = loop_nsec;
+			max_thread = i;
+		}
+	}
 
-	thread_work(child_task);
-	return NULL;
+	fprintf(log_fp,
+		"#\tThread skew (%s): wall %llu, start spread %llu, finish spread %llu,"
+		" loop time min %llu (thread %d) max %llu (thread %d)\n",
+		REPORT_UNIT_STRING, report_time(iteration_stats->wall_nsec),
+		report_time(iteration_stats->start_skew_nsec),
+		report_time(iteration_stats->finish_skew_nsec),
+		report_time(min_loop), min_thread, report_time(max_loop),
+		max_thread);
+
+	fflush(log_fp);
 }
 
-void fork_threads(void)
+/*
+ * With a file size distribution, break the FILE latency down by size
+ * class. Prefixed with '#' so plots of the log still work.
+ */
+void print_size_classes(FILE * log_fp, fs_mark_stat_t * iteration_stats)
 {
-	int i;
-	pthread_t thread_id[num_threads];
-
-	fflush(stdout);
-	fflush(log_file_fp);
+	fs_mark_hist_t *hist;
+	int class;
 
-	for (i = 0; i < num_threads; i++) {
-		pthread_create(&thread_id[i], NULL, thread_function, (void *)&child_tasks[i]);
+	for (class = 0; class < NUM_SIZE_CLASSES; class++) {
+		hist = &iteration_stats->size_hist[class];
+		if (hist->count == 0)
+			continue;
+		fprintf(log_fp,
+			"#\tSize class %8s: %8llu files, FILE (%s) avg %llu p50 %llu p99 %llu p99.9 %llu\n",
+			size_class_string[class], hist->count, REPORT_UNIT_STRING,
+			report_time(hist->total / hist->count),
+			report_time(hist_percentile(hist, 50.0)),
+			report_time(hist_percentile(hist, 99.0)),
+			report_time(hist_percentile(hist, 99.9)));
 	}
 
-	for (i = 0; i < num_threads; i++) {
-		pthread_join(thread_id[i], NULL);
-	}
+	fflush(log_fp);
 }
 
 /*
- * Print some test information and basic parameters to help user understand the rather complex options.
+ * With --dev-stats, show what each block device did in the iteration and
+ * how the dirty and writeback pages moved. Prefixed with '#' so plots of
+ * the log still work.
  */
-void print_run_info(FILE * log_fp, int argc, char **argv)
+void print_dev_stats(FILE * log_fp)
 {
-	time_t time_run;
-	int i;
+	double secs = dev_wall_nsec / 1000000000.0;
+	block_dev_t *bdev;
+	int d;
 
-	time_run = time(0);
-	fprintf(log_fp, "\n# ");
-	for (i = 0; i < argc; i++)
-		fprintf(log_fp, " %s ", argv[i]);
-	fprintf(log_fp, "\n#\tVersion %s, %d thread(s) starting at %s",
-		fs_mark_version, num_threads, ctime(&time_run));
-	fprintf(log_fp, "#\tSync method: %s\n",
-		sync_policy_string[sync_method_type]);
-	if (num_subdirs > 1) {
+	for (d = 0; d < num_block_devs; d++) {
+		bdev = &block_devs[d];
 		fprintf(log_fp,
-			"#\tDirectories:  %s across %d subdirectories with %d %s.\n",
-			dir_policy_string[dir_policy], num_subdirs,
-			dir_policy ==
-			DIR_ROUND_ROBIN ? num_per_subdir : (int) secs_per_directory,
-			dir_policy == DIR_ROUND_ROBIN ? "files per subdirectory" :
-			"seconds per subdirectory");
-	} else
-		fprintf(log_fp, "#\tDirectories:  no subdirectories used\n");
-	fprintf(log_fp,
-		"#\tFile names: %d bytes long, (%d initial bytes of time stamp with %d random bytes at end of name)\n",
-		name_len, name_len - rand_len, rand_len);
-	fprintf(log_fp,
-		"#\tFiles info: size %d bytes, written with an IO size of %d bytes per write\n",
-		file_size, io_buffer_size);
+			"#\tDevice %s: %llu reads %llu writes (%.1f IOPS), %.1f MB read"
+			" %.1f MB written, queue depth %.2f, %.0f%% busy,"
+			" write amplification %.2f\n",
+			bdev->name, bdev->delta.read_ios, bdev->delta.write_ios,
+			(bdev->delta.read_ios + bdev->delta.write_ios) / secs,
+			bdev->delta.read_sectors * DISK_SECTOR_SIZE / (1024.0 * 1024.0),
+			bdev->delta.write_sectors * DISK_SECTOR_SIZE / (1024.0 * 1024.0),
+			bdev->delta.time_in_queue_ms / (secs * 1000.0),
+			bdev->delta.io_ticks_ms / (secs * 10.0),
+			bdev->logical_bytes ?
+			(double)bdev->delta.write_sectors * DISK_SECTOR_SIZE /
+			bdev->logical_bytes : 0.0);
+	}
 	fprintf(log_fp,
-		"#\tApp overhead is time in microseconds spent in the test not doing file writing related system calls.\n");
+		"#\tVM: dirty %llu -> %llu pages, writeback %llu -> %llu pages\n",
+		vm_start.nr_dirty, vm_stop.nr_dirty, vm_start.nr_writeback,
+		vm_stop.nr_writeback);
 
-	if (log_fp != stdout)
-		fprintf(log_fp, "#");
-	if (verbose_stats) {
+	fflush(log_fp);
+}
+
+/*
+ * With --cpu-stats, split the time of each phase into user and system CPU,
+ * run queue wait and time blocked, and count the context switches. The
+ * CPU times are per file, the rest is summed over the threads, and the
+ * write loop is also shown for each thread. Prefixed with '#' so plots of
+ * the log still work.
+ */
+void print_cpu_usage(FILE * log_fp, fs_mark_stat_t * iteration_stats)
+{
+	unsigned long long files = iteration_stats->file_count ?
+	    iteration_stats->file_count : 1;
+	cpu_usage_t *usage;
+	int i, phase;
+
+	for (phase = 0; phase < NUM_CPU_PHASES; phase++) {
+		if (!cpu_phase_used(phase))
+			continue;
+		usage = &iteration_stats->cpu_usage[phase];
 		fprintf(log_fp,
-			"#\tAll system call times are reported in microseconds.\n\n");
+			"#\tCPU %-7s (%s): user %llu sys %llu per file, %llu voluntary"
+			" %llu involuntary switches, run queue wait %llu, blocked %llu\n",
+			cpu_phase_string[phase], REPORT_UNIT_STRING,
+			report_time(usage->user_nsec / files),
+			report_time(usage->sys_nsec / files), usage->voluntary_csw,
+			usage->involuntary_csw, report_time(usage->wait_nsec),
+			report_time(cpu_blocked_nsec(usage)));
+	}
+
+	for (i = 0; (num_threads > 1) && (i < num_threads); i++) {
+		usage = &child_tasks[i].thread_stats.cpu_usage[CPU_PHASE_WRITE];
+		files = child_tasks[i].thread_stats.file_count ?
+		    child_tasks[i].thread_stats.file_count : 1;
 		fprintf(log_fp,
-			"%6s %12s %12s %12s %16s %26s %26s %26s %26s %26s %26s\n",
-			"FSUse%", "Count", "Size", "Files/sec", "App Overhead",
-			"CREAT (Min/Avg/Max)", "WRITE (Min/Avg/Max)",
-			"FSYNC (Min/Avg/Max)", "SYNC (Min/Avg/Max)",
-			"CLOSE (Min/Avg/Max)", "UNLINK (Min/Avg/Max)");
-	} else {
-		fprintf(log_fp, "\n");
-		fprintf(log_fp, "%6s %12s %12s %12s %16s\n",
-			"FSUse%", "Count", "Size", "Files/sec", "App Overhead");
+			"#\t  thread %d: user %llu sys %llu per file, %llu voluntary"
+			" %llu involuntary switches, run queue wait %llu, blocked %llu\n",
+			i, report_time(usage->user_nsec / files),
+			report_time(usage->sys_nsec / files), usage->voluntary_csw,
+			usage->involuntary_csw, report_time(usage->wait_nsec),
+			report_time(cpu_blocked_nsec(usage)));
 	}
 
-	return;
+	fflush(log_fp);
 }
 
 /*
- * Keep this routine's stdout logging coordinated with the logging done above
- * in print_run_info().
+ * Machine readable output (--format json|csv).
+ * Times are always raw nanoseconds here, whatever the clock build reports in text.
  */
-void print_iteration_stats(FILE * log_fp, fs_mark_stat_t * iteration_stats,
-			   unsigned int files_written)
+
+/*
+ * Print a string as a JSON string literal.
+ */
+void json_print_string(FILE *fp, const char *str)
 {
-	int df_full;
+	fputc('"', fp);
+	for (; *str; str++) {
+		if ((*str == '"') || (*str == '\\'))
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
 
-	/*
-	 * Check how full the first directory is after each run
-	 */
-	df_full = get_df_full(child_tasks[0].test_dir);
+/*
+ * Print a string as a CSV field.
+ */
+void csv_print_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++) {
+		if (*str == '"')
+			fputc('"', fp);
+		fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
 
-	if (verbose_stats)
-		fprintf(log_fp,
-			"%6u %12u %12u %12.1f %16llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
-			df_full,
-			files_written,
-			file_size,
-			iteration_stats->files_per_sec,
-			iteration_stats->app_overhead_usec,
-			iteration_stats->min_creat_usec,
-			iteration_stats->avg_creat_usec,
-			iteration_stats->max_creat_usec,
-			iteration_stats->min_write_usec,
-			iteration_stats->avg_write_usec,
-			iteration_stats->max_write_usec,
-			iteration_stats->min_fsync_usec,
-			iteration_stats->avg_fsync_usec,
-			iteration_stats->max_fsync_usec,
-			iteration_stats->min_sync_usec,
-			iteration_stats->avg_sync_usec,
-			iteration_stats->max_sync_usec,
-			iteration_stats->min_close_usec,
-			iteration_stats->avg_close_usec,
-			iteration_stats->max_close_usec,
-			iteration_stats->min_unlink_usec,
-			iteration_stats->avg_unlink_usec,
-			iteration_stats->max_unlink_usec);
-	else
-		fprintf(log_fp,
-			"%6u %12u %12u %12.1f %16llu\n",
-			df_full,
-			files_written,
-			file_size,
-			iteration_stats->files_per_sec,
-			iteration_stats->app_overhead_usec);
+/*
+ * Join the command line into one string.
+ */
+void command_line_string(char *buf, int size)
+{
+	int i, len = 0;
 
-	fflush(log_fp);
-	return;
+	buf[0] = 0;
+	for (i = 0; (i < saved_argc) && (len < size); i++)
+		len += snprintf(buf + len, size - len, "%s%s", i ? " " : "",
+				saved_argv[i]);
+}
+
+/*
+ * Print the --cpu-stats of the phases that ran as a "cpu" member.
+ */
+void json_print_cpu_usage(FILE *fp, cpu_usage_t *usage)
+{
+	int phase, i = 0;
+
+	fprintf(fp, "\"cpu\":{");
+	for (phase = 0; phase < NUM_CPU_PHASES; phase++) {
+		if (!cpu_phase_used(phase))
+			continue;
+		if (i++)
+			fputc(',', fp);
+		fprintf(fp,
+			"\"%s\":{\"user_ns\":%llu,\"sys_ns\":%llu,"
+			"\"voluntary_csw\":%llu,\"involuntary_csw\":%llu,"
+			"\"run_ns\":%llu,\"runq_wait_ns\":%llu,\"blocked_ns\":%llu}",
+			cpu_phase_string[phase], usage[phase].user_nsec,
+			usage[phase].sys_nsec, usage[phase].voluntary_csw,
+			usage[phase].involuntary_csw, usage[phase].run_nsec,
+			usage[phase].wait_nsec, cpu_blocked_nsec(&usage[phase]));
+	}
+	fprintf(fp, "},");
+}
+
+/*
+ * Print the stats of one system call as a JSON object.
+ */
+void json_print_op(FILE *fp, fs_mark_hist_t *hist)
+{
+	fprintf(fp,
+		"{\"count\":%llu,\"min_ns\":%llu,\"avg_ns\":%llu,\"max_ns\":%llu,"
+		"\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+		hist->count, hist->min,
+		hist->count ? hist->total / hist->count : 0ULL, hist->max,
+		hist_percentile(hist, 50.0), hist_percentile(hist, 99.0),
+		hist_percentile(hist, 99.9));
+}
+
+/*
+ * One JSON object, on one line, per iteration.
+ */
+void print_iteration_json(FILE *fp, fs_mark_stat_t *iteration_stats,
+			  unsigned int files_written, unsigned int iteration)
+{
+	char command_line[PATH_MAX];
+	unsigned long long dir_files[num_dirs];
+	int i, op, phase, class;
+
+	command_line_string(command_line, sizeof(command_line));
+	dir_file_counts(dir_files);
+
+	fprintf(fp, "{\"iteration\":%u,\"timestamp\":%ld,", iteration,
+		(long)time(0));
+
+	fprintf(fp, "\"config\":{\"version\":");
+	json_print_string(fp, fs_mark_version);
+	fprintf(fp, ",\"command_line\":");
+	json_print_string(fp, command_line);
+	fprintf(fp, ",\"threads\":%d,\"directories\":[", num_threads);
+	for (i = 0; i < num_dirs; i++) {
+		if (i)
+			fputc(',', fp);
+		json_print_string(fp, child_tasks[i].test_dir);
+	}
+	fprintf(fp,
+		"],\"files_per_thread\":%d,\"file_size\":%u,\"io_size\":%d,"
+		"\"sync_method\":%d,\"subdirs\":%d,\"dir_policy\":",
+		num_files, file_size, io_buffer_size, sync_method_type,
+		num_subdirs);
+	json_print_string(fp, dir_policy_string[dir_policy]);
+	fprintf(fp, ",\"file_sizes\":");
+	json_print_string(fp, size_dist_spec);
+	fprintf(fp, ",\"name_len\":%d,\"rand_len\":%d,\"io_engine\":",
+		name_len, rand_len);
+	json_print_string(fp, io_engine_string[io_engine]);
+	fprintf(fp, ",\"files_in_flight\":%d,\"steal_batch\":%d,"
+		"\"direct\":%s,\"direct_align\":%u,\"open_sync\":",
+		files_in_flight, steal_batch, direct_io ? "true" : "false",
+		direct_align);
+	json_print_string(fp, open_sync_string[open_sync]);
+	fprintf(fp, ",\"hugepages\":%s,\"write_mode\":",
+		use_hugepages ? "true" : "false");
+	json_print_string(fp, write_mode_string[write_mode]);
+	fprintf(fp, ",\"iovecs\":%d,\"payload\":", write_iovecs);
+	json_print_string(fp, payload_string[payload]);
+	fprintf(fp, ",\"compress_ratio\":%.2f,\"dedup_ratio\":%.2f,\"mix\":",
+		compress_ratio, dedup_ratio);
+	json_print_string(fp, (mix_mode && !churn_target) ? mix_spec : "");
+	fprintf(fp, ",\"mix_files\":%d,\"churn_percent\":%d,\"affinity\":",
+		mix_mode ? mix_files : 0, churn_target);
+	json_print_string(fp, affinity == AFFINITY_LIST ? affinity_cpus :
+			  affinity_string[affinity]);
+	fprintf(fp, ",\"read_phases\":[");
+	for (phase = 0, i = 0; phase < NUM_READ_PHASES; phase++) {
+		if (!(read_phases & (1 << phase)))
+			continue;
+		if (i++)
+			fputc(',', fp);
+		json_print_string(fp, read_phase_string[phase]);
+	}
+	fprintf(fp, "],\"clock\":");
+	json_print_string(fp, timing_clock_name());
+	fprintf(fp, "},");
+
+	fprintf(fp,
+		"\"fs\":{\"use_percent\":%d,\"bytes_free\":%llu},",
+		get_df_full(child_tasks[0].test_dir),
+		get_bytes_free(child_tasks[0].test_dir));
+
+	fprintf(fp,
+		"\"files_written\":%u,\"files\":%u,\"files_stolen\":%u,"
+		"\"files_per_sec\":%.1f,\"bytes_written\":%llu,\"bytes_per_sec\":%.1f,"
+		"\"app_overhead_ns\":%llu,"
+		"\"wall_ns\":%llu,\"start_skew_ns\":%llu,\"finish_skew_ns\":%llu,",
+		files_written, iteration_stats->file_count,
+		iteration_stats->files_stolen, iteration_stats->files_per_sec,
+		iteration_stats->bytes_written, iteration_stats->bytes_per_sec,
+		iteration_stats->app_overhead_nsec, iteration_stats->wall_nsec,
+		iteration_stats->start_skew_nsec,
+		iteration_stats->finish_skew_nsec);
+
+	fprintf(fp, "\"per_dir\":[");
+	for (i = 0; i < num_dirs; i++) {
+		if (i)
+			fputc(',', fp);
+		fprintf(fp, "{\"dir\":");
+		json_print_string(fp, child_tasks[i].test_dir);
+		fprintf(fp, ",\"files\":%llu}", dir_files[i]);
+	}
+	fprintf(fp, "],");
+
+	fprintf(fp, "\"phases\":{");
+	for (phase = 0, i = 0; phase < NUM_READ_PHASES; phase++) {
+		if (!(read_phases & (1 << phase)))
+			continue;
+		if (i++)
+			fputc(',', fp);
+		fprintf(fp, "\"%s_per_sec\":%.1f", read_phase_string[phase],
+			iteration_stats->phase_files_per_sec[phase]);
+	}
+	fprintf(fp, "},");
+
+	if (mix_mode) {
+		fprintf(fp, "\"mix\":{");
+		for (op = 0; op < NUM_MIX_OPS; op++)
+			fprintf(fp, "\"%s\":%llu,\"%s_per_sec\":%.1f,",
+				mix_op_string[op], iteration_stats->mix_ops[op],
+				mix_op_string[op], iteration_stats->mix_ops_per_sec[op]);
+		fprintf(fp, "\"misses\":%llu},", iteration_stats->mix_misses);
+	}
+
+	if (cpu_stats)
+		json_print_cpu_usage(fp, iteration_stats->cpu_usage);
+
+	if (dev_stats) {
+		fprintf(fp,
+			"\"dev\":{\"ios\":%llu,\"iops\":%.1f,\"bytes_written\":%llu,"
+			"\"queue_depth\":%.2f,\"write_amplification\":%.2f,"
+			"\"wall_ns\":%llu,\"devices\":[",
+			iteration_stats->dev_ios, iteration_stats->dev_iops,
+			iteration_stats->dev_bytes_written,
+			iteration_stats->dev_queue_depth,
+			iteration_stats->write_amplification, dev_wall_nsec);
+		for (i = 0; i < num_block_devs; i++) {
+			block_dev_t *bdev = &block_devs[i];
+
+			if (i)
+				fputc(',', fp);
+			fprintf(fp, "{\"name\":");
+			json_print_string(fp, bdev->name);
+			fprintf(fp,
+				",\"read_ios\":%llu,\"read_bytes\":%llu,"
+				"\"write_ios\":%llu,\"write_bytes\":%llu,"
+				"\"io_ticks_ms\":%llu,\"time_in_queue_ms\":%llu,"
+				"\"logical_bytes\":%llu}",
+				bdev->delta.read_ios,
+				bdev->delta.read_sectors * DISK_SECTOR_SIZE,
+				bdev->delta.write_ios,
+				bdev->delta.write_sectors * DISK_SECTOR_SIZE,
+				bdev->delta.io_ticks_ms, bdev->delta.time_in_queue_ms,
+				bdev->logical_bytes);
+		}
+		fprintf(fp,
+			"],\"nr_dirty\":[%llu,%llu],\"nr_writeback\":[%llu,%llu]},",
+			vm_start.nr_dirty, vm_stop.nr_dirty, vm_start.nr_writeback,
+			vm_stop.nr_writeback);
+	}
+
+	fprintf(fp, "\"ops\":{");
+	for (op = 0; op < NUM_OPS; op++) {
+		if (op)
+			fputc(',', fp);
+		fprintf(fp, "\"%s\":", op_name_string[op]);
+		json_print_op(fp, &iteration_stats->op_hist[op]);
+	}
+	fprintf(fp, "},");
+
+	fprintf(fp, "\"size_classes\":{");
+	for (class = 0, i = 0; class < NUM_SIZE_CLASSES; class++) {
+		if (iteration_stats->size_hist[class].count == 0)
+			continue;
+		if (i++)
+			fputc(',', fp);
+		fprintf(fp, "\"%s\":", size_class_string[class]);
+		json_print_op(fp, &iteration_stats->size_hist[class]);
+	}
+	fprintf(fp, "},");
+
+	fprintf(fp, "\"per_thread\":[");
+	for (i = 0; i < num_threads; i++) {
+		fs_mark_stat_t *thread_stats = &child_tasks[i].thread_stats;
+
+		if (i)
+			fputc(',', fp);
+		fprintf(fp, "{\"thread\":%d,\"dir\":", i);
+		json_print_string(fp, child_tasks[i].test_dir);
+		if (affinity != AFFINITY_NONE) {
+			char cpus[MAX_STRING_SIZE];
+
+			fprintf(fp, ",\"cpus\":");
+			json_print_string(fp, format_cpu_list(&child_tasks[i].cpus,
+							      cpus, sizeof(cpus)));
+			fprintf(fp, ",\"node\":%d", child_tasks[i].numa_node);
+		}
+		fprintf(fp,
+			",\"files\":%u,\"files_stolen\":%u,\"files_per_sec\":%.1f,"
+			"\"bytes_written\":%llu,"
+			"\"app_overhead_ns\":%llu,\"start_offset_ns\":%llu,"
+			"\"loop_ns\":%llu,",
+			thread_stats->file_count, thread_stats->files_stolen,
+			thread_stats->files_per_sec, thread_stats->bytes_written,
+			thread_stats->app_overhead_nsec,
+			thread_stats->loop_start_nsec -
+			iteration_stats->loop_start_nsec,
+			thread_stats->loop_stop_nsec -
+			thread_stats->loop_start_nsec);
+		if (cpu_stats)
+			json_print_cpu_usage(fp, thread_stats->cpu_usage);
+		fprintf(fp, "\"ops\":{");
+		for (op = 0; op < NUM_OPS; op++) {
+			if (op)
+				fputc(',', fp);
+			fprintf(fp, "\"%s\":", op_name_string[op]);
+			json_print_op(fp, &thread_stats->op_hist[op]);
+		}
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "]}\n");
+
+	fflush(fp);
+}
+
+/*
+ * CSV column names, printed once before the first row.
+ */
+void print_csv_header(FILE *fp)
+{
+	int i, op, phase;
+
+	fprintf(fp,
+		"iteration,timestamp,command_line,threads,files_per_thread,file_size,"
+		"io_size,sync_method,subdirs,io_engine,files_in_flight,clock,"
+		"fs_use_percent,fs_bytes_free,files_written,files,files_stolen,"
+		"files_per_sec,app_overhead_ns,wall_ns,start_skew_ns,finish_skew_ns,"
+		"bytes_written,bytes_per_sec");
+	for (phase = 0; phase < NUM_READ_PHASES; phase++)
+		if (read_phases & (1 << phase))
+			fprintf(fp, ",%s_per_sec", read_phase_string[phase]);
+	for (op = 0; mix_mode && (op < NUM_MIX_OPS); op++)
+		fprintf(fp, ",mix_%s,mix_%s_per_sec", mix_op_string[op],
+			mix_op_string[op]);
+	if (mix_mode)
+		fprintf(fp, ",mix_misses");
+	if (dev_stats)
+		fprintf(fp,
+			",dev_ios,dev_iops,dev_bytes_written,dev_queue_depth,"
+			"write_amplification,nr_dirty,nr_writeback");
+	for (phase = 0; cpu_stats && (phase < NUM_CPU_PHASES); phase++)
+		if (cpu_phase_used(phase))
+			fprintf(fp,
+				",cpu_%s_user_ns,cpu_%s_sys_ns,cpu_%s_voluntary_csw,"
+				"cpu_%s_involuntary_csw,cpu_%s_runq_wait_ns,cpu_%s_blocked_ns",
+				cpu_phase_string[phase], cpu_phase_string[phase],
+				cpu_phase_string[phase], cpu_phase_string[phase],
+				cpu_phase_string[phase], cpu_phase_string[phase]);
+	for (op = 0; op < NUM_OPS; op++)
+		fprintf(fp,
+			",%s_count,%s_min_ns,%s_avg_ns,%s_max_ns,%s_p50_ns,%s_p99_ns,%s_p999_ns",
+			op_name_string[op], op_name_string[op], op_name_string[op],
+			op_name_string[op], op_name_string[op], op_name_string[op],
+			op_name_string[op]);
+	for (i = 0; i < num_threads; i++)
+		fprintf(fp,
+			",thread%d_files,thread%d_files_stolen,thread%d_files_per_sec,"
+			"thread%d_app_overhead_ns,thread%d_loop_ns", i, i, i, i, i);
+	for (i = 0; cpu_stats && (i < num_threads); i++)
+		fprintf(fp,
+			",thread%d_user_ns,thread%d_sys_ns,thread%d_voluntary_csw,"
+			"thread%d_involuntary_csw,thread%d_runq_wait_ns", i, i, i, i, i);
+	fprintf(fp, "\n");
+
+	fflush(fp);
+}
+
+/*
+ * One CSV row per iteration, matching print_csv_header().
+ */
+void print_iteration_csv(FILE *fp, fs_mark_stat_t *iteration_stats,
+			 unsigned int files_written, unsigned int iteration)
+{
+	char command_line[PATH_MAX];
+	int i, op, phase;
+
+	command_line_string(command_line, sizeof(command_line));
+
+	fprintf(fp, "%u,%ld,", iteration, (long)time(0));
+	csv_print_string(fp, command_line);
+	fprintf(fp, ",%d,%d,%u,%d,%d,%d,%s,%d,", num_threads, num_files,
+		file_size, io_buffer_size, sync_method_type, num_subdirs,
+		io_engine_string[io_engine], files_in_flight);
+	csv_print_string(fp, timing_clock_name());
+	fprintf(fp, ",%d,%llu,%u,%u,%u,%.1f,%llu,%llu,%llu,%llu,%llu,%.1f",
+		get_df_full(child_tasks[0].test_dir),
+		get_bytes_free(child_tasks[0].test_dir), files_written,
+		iteration_stats->file_count, iteration_stats->files_stolen,
+		iteration_stats->files_per_sec,
+		iteration_stats->app_overhead_nsec, iteration_stats->wall_nsec,
+		iteration_stats->start_skew_nsec,
+		iteration_stats->finish_skew_nsec,
+		iteration_stats->bytes_written, iteration_stats->bytes_per_sec);
+	for (phase = 0; phase < NUM_READ_PHASES; phase++)
+		if (read_phases & (1 << phase))
+			fprintf(fp, ",%.1f",
+				iteration_stats->phase_files_per_sec[phase]);
+	for (op = 0; mix_mode && (op < NUM_MIX_OPS); op++)
+		fprintf(fp, ",%llu,%.1f", iteration_stats->mix_ops[op],
+			iteration_stats->mix_ops_per_sec[op]);
+	if (mix_mode)
+		fprintf(fp, ",%llu", iteration_stats->mix_misses);
+	if (dev_stats)
+		fprintf(fp, ",%llu,%.1f,%llu,%.2f,%.2f,%llu,%llu",
+			iteration_stats->dev_ios, iteration_stats->dev_iops,
+			iteration_stats->dev_bytes_written,
+			iteration_stats->dev_queue_depth,
+			iteration_stats->write_amplification, vm_stop.nr_dirty,
+			vm_stop.nr_writeback);
+	for (phase = 0; cpu_stats && (phase < NUM_CPU_PHASES); phase++) {
+		cpu_usage_t *usage = &iteration_stats->cpu_usage[phase];
+
+		if (cpu_phase_used(phase))
+			fprintf(fp, ",%llu,%llu,%llu,%llu,%llu,%llu",
+				usage->user_nsec, usage->sys_nsec,
+				usage->voluntary_csw, usage->involuntary_csw,
+				usage->wait_nsec, cpu_blocked_nsec(usage));
+	}
+	for (op = 0; op < NUM_OPS; op++) {
+		fs_mark_hist_t *hist = &iteration_stats->op_hist[op];
+
+		fprintf(fp, ",%llu,%llu,%llu,%llu,%llu,%llu,%llu", hist->count,
+			hist->min,
+			hist->count ? hist->total / hist->count : 0ULL,
+			hist->max, hist_percentile(hist, 50.0),
+			hist_percentile(hist, 99.0), hist_percentile(hist, 99.9));
+	}
+	for (i = 0; i < num_threads; i++)
+		fprintf(fp, ",%u,%u,%.1f,%llu,%llu",
+			child_tasks[i].thread_stats.file_count,
+			child_tasks[i].thread_stats.files_stolen,
+			child_tasks[i].thread_stats.files_per_sec,
+			child_tasks[i].thread_stats.app_overhead_nsec,
+			child_tasks[i].thread_stats.loop_stop_nsec -
+			child_tasks[i].thread_stats.loop_start_nsec);
+	for (i = 0; cpu_stats && (i < num_threads); i++) {
+		cpu_usage_t *usage =
+		    &child_tasks[i].thread_stats.cpu_usage[CPU_PHASE_WRITE];
+
+		fprintf(fp, ",%llu,%llu,%llu,%llu,%llu", usage->user_nsec,
+			usage->sys_nsec, usage->voluntary_csw,
+			usage->involuntary_csw, usage->wait_nsec);
+	}
+	fprintf(fp, "\n");
+
+	fflush(fp);
 }
 
 int main(int argc, char **argv, char **envp)
 {
 	unsigned int files_written = 0;
 	unsigned int loops_done = 0;
+	unsigned int fill_loops = 0;		/* --churn iterations still filling up */
+	unsigned long long run_start_nsec;
 
 	process_args(argc, argv, envp);
 
+	if (direct_io)
+		check_direct_io();
+	if (payload != PAYLOAD_ZERO)
+		setup_payload();
+	if (dev_stats)
+		setup_dev_stats();
+	if (churn_target)
+		check_churn_start();
+
+	/*
+	 * Calibrate the clock before any thread takes a time stamp.
+	 */
+	timing_init();
+
+	/*
+	 * The workers of every iteration wait for each other here before
+	 * starting the timed loop.
+	 */
+	pthread_barrier_init(&loop_start_barrier, NULL, num_threads);
+
 	/*
 	 * Open the specified log file - at the end, each child's log file will be written out to this one.
 	 * Note that each child uses its copy of this fp for its own sub log file.
@@ -1219,19 +5745,32 @@ int main(int argc, char **argv, char **envp)
 	/*
 	 * Print some information about this test run
 	 */
-	print_run_info(stdout, argc, argv);
+	if (output_format == FORMAT_TEXT)
+		print_run_info(stdout, argc, argv);
+	else if (output_format == FORMAT_CSV)
+		print_csv_header(stdout);
 	print_run_info(log_file_fp, argc, argv);
 
+	if (interval_nsecs)
+		start_interval_reporter();
+	run_start_nsec = nsnow();
+
 	/*
 	 * This is the main loop of the program - we loop here until
 	 * the file system is full when running in "-F" fill mode
 	 */
 	do {
-		fs_mark_stat_t thread_stats, iteration_stats;
+		/*
+		 * The latency histograms make these too big for the stack.
+		 */
+		static fs_mark_stat_t thread_stats, iteration_stats;
 
 		memset(&thread_stats, 0, sizeof(thread_stats));
 		memset(&iteration_stats, 0, sizeof(iteration_stats));
 
+		reset_file_queues();
+		if (dev_stats)
+			dev_stats_start();
 		fork_threads();
 
 		/*
@@ -1240,18 +5779,68 @@ int main(int argc, char **argv, char **envp)
 		 * and writes the result to stdout.
 		 */
 		aggregate_thread_stats(&thread_stats, &iteration_stats);
+		if (dev_stats)
+			dev_stats_stop(&iteration_stats);
 
 		/*
 		 * Track how many files have been written
 		 */
 		files_written += iteration_stats.file_count;
 
-		print_iteration_stats(stdout, &iteration_stats, files_written);
+		if (output_format == FORMAT_JSON)
+			print_iteration_json(stdout, &iteration_stats,
+					     files_written, loops_done);
+		else if (output_format == FORMAT_CSV)
+			print_iteration_csv(stdout, &iteration_stats,
+					    files_written, loops_done);
+		else
+			print_iteration_stats(stdout, &iteration_stats,
+					      files_written);
 		print_iteration_stats(log_file_fp, &iteration_stats,
 				      files_written);
+		if (steal_batch) {
+			if (output_format == FORMAT_TEXT)
+				print_work_distribution(stdout, &iteration_stats);
+			print_work_distribution(log_file_fp, &iteration_stats);
+		}
+		if (num_threads > 1) {
+			if (output_format == FORMAT_TEXT)
+				print_thread_skew(stdout, &iteration_stats);
+			print_thread_skew(log_file_fp, &iteration_stats);
+		}
+		if (size_dist != SIZE_DIST_FIXED) {
+			if (output_format == FORMAT_TEXT)
+				print_size_classes(stdout, &iteration_stats);
+			print_size_classes(log_file_fp, &iteration_stats);
+		}
+		if (dev_stats) {
+			if (output_format == FORMAT_TEXT)
+				print_dev_stats(stdout);
+			print_dev_stats(log_file_fp);
+		}
+		if (cpu_stats) {
+			if (output_format == FORMAT_TEXT)
+				print_cpu_usage(stdout, &iteration_stats);
+			print_cpu_usage(log_file_fp, &iteration_stats);
+		}
+		if (churn_target) {
+			if (output_format == FORMAT_TEXT)
+				print_churn_status(stdout, &iteration_stats,
+						   nsnow() - run_start_nsec);
+			print_churn_status(log_file_fp, &iteration_stats,
+					   nsnow() - run_start_nsec);
+			if (iteration_stats.churn_filling)
+				fill_loops++;
+		}
 		loops_done++;
 
-	} while (do_fill_fs || (loop_count > loops_done));
+	} while (do_fill_fs || (loop_count + fill_loops > loops_done));
+
+	stop_worker_pool();
+	stop_sync_pools();
+
+	if (interval_nsecs)
+		stop_interval_reporter();
 
 	return (0);
 }
@@ -22,10 +22,10 @@
 /*
  * Default and maximum parameters.
  */
-#define MAX_IO_BUFFER_SIZE 	(1024 * 1024) 	/* Max write buffer size is 1MB */
-#define MAX_FILES		(1000000)	/* Max number of files to test of each size */
-#define MAX_THREADS		(64)		/* Max number of threads allowed */
+#define CACHE_LINE_SIZE		(64)		/* Alignment of each entry in the job table */
 #define MAX_NAME_PATH		(40)		/* Length of the pathname before the leaf */
+#define MAX_DIR_PATH		(MAX_NAME_PATH + 16)	/* Pathname plus the "/xx" subdirectory */
+#define MAX_FILE_PATH		(MAX_DIR_PATH + FILENAME_SIZE + 1)	/* Full path of a test file */
 #define FILENAME_SIZE		(128) 		/* Max length of filenames */
 #define MAX_STRING_SIZE		(160)	    	/* Max number of bytes in a string */
 
@@ -39,6 +39,9 @@
 #define DEFAULT_NAME_LEN	(40)
 #define DEFAULT_RAND_NAME	(24)
 #define DEFAULT_SUBDIR_CNT	(0)
+#define DEFAULT_FILES_IN_FLIGHT	(16)
+#define MAX_FILES_IN_FLIGHT	(1024)
+#define MAX_URING_ENTRIES	(32768)		/* Kernel limit on submission queue size */
 
 
 /*
@@ -70,6 +73,10 @@ int	dir_policy = DIR_NO_SUBDIRS;
 #define FSYNC_FIRST_FILE	(0x4)
 #define FSYNC_POST_REVERSE	(0x8)
 #define FSYNC_POST_IN_ORDER	(0x10)
+#define FSYNC_BATCH		(0x20)	/* Post in order fsync of every batch of files, in the loop */
+#define FSYNC_PARALLEL		(0x40)	/* ... with the batch spread over a pool of helper threads */
+#define FSYNC_SYNCFS		(0x80)	/* syncfs() of each thread's directory after the loop */
+#define FSYNC_RANGE		(0x100)	/* sync_file_range() writeback, then wait and fsync the directories */
 
 
 #define SYNC_TEST_NONE		(0)	    					/* -S 0 */
@@ -79,7 +86,11 @@ int	dir_policy = DIR_NO_SUBDIRS;
 #define SYNC_TEST_REVERSE_SYNC	(FSYNC_POST_REVERSE | FSYNC_SYNC_SYSCALL)	/* -S 4 */
 #define SYNC_TEST_POST		(FSYNC_POST_IN_ORDER)				/* -S 5 */
 #define SYNC_TEST_POST_SYNC	(FSYNC_POST_IN_ORDER | FSYNC_SYNC_SYSCALL)	/* -S 6 */
-#define NUM_SYNC_METHODS		(7)
+#define SYNC_TEST_BATCH		(FSYNC_BATCH)					/* -S 7 */
+#define SYNC_TEST_PARALLEL_BATCH (FSYNC_BATCH | FSYNC_PARALLEL)			/* -S 8 */
+#define SYNC_TEST_SYNCFS	(FSYNC_SYNCFS)					/* -S 9 */
+#define SYNC_TEST_RANGE		(FSYNC_RANGE)					/* -S 10 */
+#define NUM_SYNC_METHODS		(11)
 
 const char sync_policy_string[NUM_SYNC_METHODS][MAX_STRING_SIZE] = {
 	"NO SYNC: Test does not issue sync() or fsync() calls.",
@@ -88,9 +99,178 @@ const char sync_policy_string[NUM_SYNC_METHODS][MAX_STRING_SIZE] = {
 	"POST REVERSE: Reopen and fsync() each file in reverse order after main write loop.",
 	"SYNC POST REVERSE: Issue sync() and then reopen and fsync() each file in reverse order after main write loop.",
 	"POST: Reopen and fsync() each file in order after main write loop.",
-	"SYNC POST: Issue sync() and then reopen and fsync() each file in order after main write loop."
+	"SYNC POST: Issue sync() and then reopen and fsync() each file in order after main write loop.",
+	"BATCH: Reopen and fsync() each file in order after every batch of files in the write loop.",
+	"PARALLEL BATCH: Reopen and fsync() the files of every batch in parallel from a pool of helper threads.",
+	"SYNCFS: Issue syncfs() on each thread's directory after main write loop.",
+	"SYNC FILE RANGE: Start writeback of each file in the write loop, wait for it after the loop and fsync() each directory."
 };
 
+/*
+ * Group commit parameters for -S 7 and -S 8
+ */
+#define DEFAULT_SYNC_BATCH	(32)
+#define DEFAULT_SYNC_THREADS	(4)
+
+int	sync_batch = DEFAULT_SYNC_BATCH;	/* Files per group commit (and --dir-sync) batch */
+int	sync_threads = DEFAULT_SYNC_THREADS;	/* fsync()s in flight per thread with -S 8 */
+
+/*
+ * When to fsync() the directories new files were created in (--dir-sync).
+ * Without it a create is not durable on most file systems even with -S 1.
+ */
+#define DIRSYNC_NONE		(0)
+#define DIRSYNC_FILE		(1)	    /* The file's directory after each file */
+#define DIRSYNC_BATCH		(2)	    /* Directories touched, every --sync-batch files */
+#define DIRSYNC_SUBDIR		(3)	    /* Each directory touched, once after the loop */
+#define NUM_DIRSYNC_MODES	(4)
+
+const char dir_sync_string[NUM_DIRSYNC_MODES][MAX_STRING_SIZE] = {
+	"none",
+	"file",
+	"batch",
+	"subdir"
+};
+
+int	dir_sync = DIRSYNC_NONE;
+
+/*
+ * Write then rename into place (--rename).
+ * Each file is created and written under a temporary directory and then
+ * renamed into its target directory under the same name.
+ */
+#define RENAME_NONE		(0)
+#define RENAME_TMPDIR		(1)	    /* Write in <dir>/tmp, rename into the (sub)directory */
+#define RENAME_SUBDIR		(2)	    /* Write in the next subdirectory, rename across */
+#define NUM_RENAME_MODES	(3)
+
+const char rename_mode_string[NUM_RENAME_MODES][MAX_STRING_SIZE] = {
+	"none",
+	"tmpdir",
+	"subdir"
+};
+
+#define RENAME_TMP_DIR_NAME	"tmp"
+
+int	rename_mode = RENAME_NONE;
+int	rename_noreplace = 0;			/* renameat2(RENAME_NOREPLACE) */
+int	rename_sync = 0;			/* fsync() both directories after each rename */
+
+/*
+ * Flags the test files are opened with (--direct, --open-sync).
+ * With O_DIRECT the file and IO sizes must be multiples of the direct IO
+ * alignment of every -d file system, found at start up.
+ */
+#define OPEN_SYNC_NONE		(0)
+#define OPEN_SYNC_DSYNC		(1)	    /* O_DSYNC: each write() waits for the data */
+#define OPEN_SYNC_SYNC		(2)	    /* O_SYNC: ... and the file metadata */
+#define NUM_OPEN_SYNC_MODES	(3)
+
+const char open_sync_string[NUM_OPEN_SYNC_MODES][MAX_STRING_SIZE] = {
+	"none",
+	"dsync",
+	"sync"
+};
+
+#define DEFAULT_DIRECT_ALIGN	(512)		/* Used if nothing can tell us */
+#define HUGE_PAGE_SIZE		(2 * 1024 * 1024)
+#define DIRECT_PROBE_NAME	".fs_mark_direct"
+
+int	direct_io = 0;				/* O_DIRECT, bypass the page cache */
+int	open_sync = OPEN_SYNC_NONE;
+int	use_hugepages = 0;			/* IO buffers on MAP_HUGETLB pages */
+int	write_open_flags;			/* open() flags of new files, set in process_args() */
+int	read_open_flags;			/* ... and of the read back phase */
+unsigned int direct_align = 0;			/* Largest direct IO alignment of the -d file systems */
+
+
+/*
+ * How the data of each file is written (--write-mode).
+ * The fallocate() or ftruncate() done before the writes is timed as ALLOC,
+ * the writes themselves as WRITE.
+ */
+#define WRITE_MODE_SEQ		(0)	    /* write() io size chunks in order (default) */
+#define WRITE_MODE_FALLOCATE	(1)	    /* fallocate() the whole file, then as seq */
+#define WRITE_MODE_RANDOM	(2)	    /* ftruncate(), then pwrite() the chunks in random order */
+#define WRITE_MODE_APPEND	(3)	    /* O_APPEND, write() io size chunks */
+#define WRITE_MODE_PWRITEV	(4)	    /* pwritev() of --iovecs io size chunks per call */
+#define NUM_WRITE_MODES		(5)
+
+const char write_mode_string[NUM_WRITE_MODES][MAX_STRING_SIZE] = {
+	"seq",
+	"fallocate",
+	"random",
+	"append",
+	"pwritev"
+};
+
+const char write_mode_desc[NUM_WRITE_MODES][MAX_STRING_SIZE] = {
+	"SEQ: write() each file in order.",
+	"FALLOCATE: fallocate() each file to its size, then write() it in order.",
+	"RANDOM: ftruncate() each file to its size, then pwrite() its chunks in random order.",
+	"APPEND: open each file with O_APPEND and write() it in order.",
+	"PWRITEV: pwritev() each file in order, several chunks per call."
+};
+
+#define DEFAULT_IOVECS		(4)
+
+int	write_mode = WRITE_MODE_SEQ;
+int	write_iovecs = DEFAULT_IOVECS;		/* Chunks per pwritev() call */
+
+/*
+ * What is written into the files (--payload, --compress-ratio, --dedup-ratio).
+ * Zeros are free to produce, but compressing or deduplicating file systems
+ * store next to nothing for them. Random data is generated per write chunk
+ * into a ring of buffers owned by each thread.
+ */
+#define PAYLOAD_ZERO		(0)	    /* Zero filled buffer (default) */
+#define PAYLOAD_RANDOM		(1)	    /* Fresh random data for each chunk */
+#define NUM_PAYLOADS		(2)
+
+const char payload_string[NUM_PAYLOADS][MAX_STRING_SIZE] = {
+	"zero",
+	"random"
+};
+
+#define PAYLOAD_LANES		(4)	    /* Generators stepped side by side, see payload_random() */
+#define PAYLOAD_SEGMENT		(4096)	    /* Unit of --compress-ratio: random head, zero tail */
+#define PAYLOAD_DUP_SEED	(0xd0b1e5ULL)  /* Seed of the shared duplicate chunk */
+
+int	payload = PAYLOAD_ZERO;
+double	compress_ratio = 1.0;			/* Target raw to compressed size ratio */
+double	dedup_ratio = 1.0;			/* Target written to unique chunk ratio */
+unsigned long long dedup_threshold = 0;		/* Chunks drawing below this (of 2^32) are duplicates */
+char	*dup_chunk;				/* Content of every duplicate chunk */
+
+/*
+ * Placement of the worker threads (--affinity).
+ * Threads are pinned when they are created. With more threads than CPUs
+ * the CPUs are used again in the same order.
+ */
+#define AFFINITY_NONE		(0)	    /* Left to the scheduler (default) */
+#define AFFINITY_COMPACT	(1)	    /* One CPU each, filling a node before the next */
+#define AFFINITY_SCATTER	(2)	    /* One CPU each, round robin over the nodes */
+#define AFFINITY_NODE		(3)	    /* All CPUs of one node per -d directory */
+#define AFFINITY_LIST		(4)	    /* One CPU each, in turn from a CPU list */
+#define NUM_AFFINITIES		(5)
+
+const char affinity_string[NUM_AFFINITIES][MAX_STRING_SIZE] = {
+	"none",
+	"compact",
+	"scatter",
+	"node",
+	"list"
+};
+
+#define MAX_NUMA_NODES		(64)
+#define NUMA_NODE_PATH		"/sys/devices/system/node"
+#define FS_MARK_MPOL_PREFERRED	(1)	    /* MPOL_PREFERRED from <numaif.h> (libnuma) */
+
+int	affinity = AFFINITY_NONE;
+char	*affinity_cpus = NULL;			/* CPU list given to --affinity */
+int	num_numa_nodes = 0;			/* Nodes with CPUs we may run on */
+int	numa_node_id[MAX_NUMA_NODES];		/* -1 when there is no NUMA information */
+cpu_set_t numa_node_cpus[MAX_NUMA_NODES];	/* ... and those CPUs */
 
 /*
  * Use the normal fsync() per file by default
@@ -98,6 +278,21 @@ const char sync_policy_string[NUM_SYNC_METHODS][MAX_STRING_SIZE] = {
 int sync_method = SYNC_TEST_PER_FILE;
 int sync_method_type = 1;
 
+/*
+ * IO engines used for the main file write loop
+ */
+#define IO_ENGINE_SYNC		(0)	    /* Blocking open/write/fsync/close */
+#define IO_ENGINE_URING		(1)	    /* Linked io_uring chains, several files in flight */
+#define NUM_IO_ENGINES		(2)
+
+const char io_engine_string[NUM_IO_ENGINES][MAX_STRING_SIZE] = {
+	"sync",
+	"uring"
+};
+
+int	io_engine = IO_ENGINE_SYNC;
+int	files_in_flight = DEFAULT_FILES_IN_FLIGHT;	/* Files in flight per thread with -E uring */
+
 /*
  * File and IO control variables
  */
@@ -107,17 +302,100 @@ int	num_files = DEFAULT_NUM_FILES;		/* Number of times to test each file size */
 int	name_len = DEFAULT_NAME_LEN;		/* Number of characters in a filename */
 int	rand_len = DEFAULT_RAND_NAME;		/* Number of random characters in a filename */
 
+/*
+ * File size distributions (-s).
+ * A plain number gives every file that size. A list of "size[:weight]"
+ * entries picks each file's size from the list in proportion to the
+ * weights, and "lognormal:median,sigma[,max]" draws it from a log-normal
+ * distribution. Sizes are picked per file from the thread's generator.
+ * For the distributions file_size holds the largest possible size.
+ */
+#define SIZE_DIST_FIXED		(0)
+#define SIZE_DIST_LIST		(1)
+#define SIZE_DIST_LOGNORMAL	(2)
+
+#define MAX_SIZE_DIST_ENTRIES	(32)
+#define LOGNORMAL_MAX_FACTOR	(100)		/* Default max is 100 times the median */
+
+int	size_dist = SIZE_DIST_FIXED;
+char	size_dist_spec[MAX_STRING_SIZE];	/* -s argument, as given */
+int	size_dist_count;			/* Entries of a list */
+unsigned int size_dist_size[MAX_SIZE_DIST_ENTRIES];
+unsigned long long size_dist_cumul[MAX_SIZE_DIST_ENTRIES];	/* Cumulative weights, scaled to 2^32 */
+double	size_dist_mu;				/* log() of the log-normal median */
+double	size_dist_sigma;
+double	size_dist_mean = DEFAULT_FILE_SIZE;	/* Expected bytes per file */
+
+/*
+ * File size classes the FILE latency is broken down by.
+ * Class 0 is below 4KB, every following class is 4 times larger.
+ */
+#define SIZE_CLASS_SHIFT	(12)
+#define NUM_SIZE_CLASSES	(8)
+
+const char size_class_string[NUM_SIZE_CLASSES][MAX_STRING_SIZE] = {
+	"<4K",
+	"4K-16K",
+	"16K-64K",
+	"64K-256K",
+	"256K-1M",
+	"1M-4M",
+	"4M-16M",
+	">=16M"
+};
+
 /*
  * Variables to control how many subdirectories & how to fill them
  */
 int	num_subdirs = DEFAULT_SUBDIR_CNT;	/* Number of subdirectories to use */
 int	num_per_subdir = 0;			/* Determine how many files to write to each subdirectory */
 int	num_dirs = 0;				/* Number of directories passed in as args */
-int 	files_in_subdir = 0;
-int 	current_subdir = 0;
 unsigned long secs_per_directory = DEFAULT_SECS_PER_DIR;
 
 
+/*
+ * Output formats for the per iteration results on stdout (--format)
+ */
+#define FORMAT_TEXT		(0)	    /* Column aligned text (default) */
+#define FORMAT_JSON		(1)	    /* One JSON object per line per iteration */
+#define FORMAT_CSV		(2)	    /* Header row, then one row per iteration */
+#define NUM_FORMATS		(3)
+
+const char format_string[NUM_FORMATS][MAX_STRING_SIZE] = {
+	"text",
+	"json",
+	"csv"
+};
+
+int	output_format = FORMAT_TEXT;
+
+/*
+ * Long only options
+ */
+#define OPT_FORMAT		(256)
+#define OPT_STEAL		(257)
+#define OPT_RATE		(258)
+#define OPT_SYNC_BATCH		(259)
+#define OPT_SYNC_THREADS	(260)
+#define OPT_DIR_SYNC		(261)
+#define OPT_RENAME		(262)
+#define OPT_RENAME_NOREPLACE	(263)
+#define OPT_RENAME_SYNC		(264)
+#define OPT_DIRECT		(265)
+#define OPT_OPEN_SYNC		(266)
+#define OPT_HUGEPAGES		(267)
+#define OPT_WRITE_MODE		(268)
+#define OPT_IOVECS		(269)
+#define OPT_PAYLOAD		(270)
+#define OPT_COMPRESS_RATIO	(271)
+#define OPT_DEDUP_RATIO		(272)
+#define OPT_MIX			(273)
+#define OPT_MIX_FILES		(274)
+#define OPT_CHURN		(275)
+#define OPT_AFFINITY		(276)
+#define OPT_CPU_STATS		(277)
+#define OPT_DEV_STATS		(278)
+
 /*
  * Misc booleans & globals
  */
@@ -125,84 +403,537 @@ int	keep_files = 0;				/* Should the test clean up after itself */
 int	num_threads = 1;			/* Number of threads */
 int	do_fill_fs = 0;				/* Run until the file system is full  */
 int	verbose_stats = 0;		    	/* Print complete stats for each system call */
+int	persistent_threads = 0;			/* Keep worker threads alive across iterations */
 char 	log_file_name[PATH_MAX] = "fs_log.txt"; /* Log file name for run */
 FILE	*log_file_fp;				/* Parent file pointer for log file  */
+int	saved_argc;				/* Command line, kept for machine readable records */
+char	**saved_argv;
 
 unsigned int loop_count = 0;			/* How many times to loop */
-unsigned int file_count = 0;			/* How many files written in this run  */
-unsigned long long start_sec_time = 0;
+
+/*
+ * Print latency percentiles for each system call
+ */
+int	print_percentiles = 0;
 
 struct name_entry {
     char f_name[FILENAME_SIZE];			/* Actual name of file in directory without path */
-    char write_dir[MAX_NAME_PATH]; 		/* Name of directory file is written to */
-    char target_dir[MAX_NAME_PATH];	 	/* Name of directory when & if file is renamed */
+    char write_dir[MAX_DIR_PATH]; 		/* Name of directory file is written to */
+    char target_dir[MAX_DIR_PATH];	 	/* Name of directory when & if file is renamed */
+    unsigned int size;				/* Bytes written to the file */
+};
+
+/*
+ * System calls that we keep latency histograms for.
+ */
+#define OP_CREAT		(0)
+#define OP_WRITE		(1)
+#define OP_FSYNC		(2)
+#define OP_SYNC			(3)
+#define OP_CLOSE		(4)
+#define OP_UNLINK		(5)
+#define OP_STAT			(6)
+#define OP_READ			(7)	    /* open + read whole file + close */
+#define OP_READDIR		(8)	    /* opendir + readdir all entries + closedir */
+#define OP_FILE			(9)	    /* Whole file, from its (intended) start to close */
+#define OP_DIRSYNC		(10)	    /* open + fsync + close of a directory */
+#define OP_RENAME		(11)	    /* rename() from write_dir into target_dir */
+#define OP_ALLOC		(12)	    /* fallocate() or ftruncate() before the writes */
+#define NUM_OPS			(13)
+
+const char op_name_string[NUM_OPS][MAX_STRING_SIZE] = {
+	"CREAT",
+	"WRITE",
+	"FSYNC",
+	"SYNC",
+	"CLOSE",
+	"UNLINK",
+	"STAT",
+	"READ",
+	"READDIR",
+	"FILE",
+	"DIRSYNC",
+	"RENAME",
+	"ALLOC"
+};
+
+/*
+ * Optional read back phases run after the write loop (-R)
+ */
+#define PHASE_STAT		(0)	    /* stat() every file */
+#define PHASE_READ		(1)	    /* open and read every file fully */
+#define PHASE_READDIR		(2)	    /* readdir() every subdirectory */
+#define NUM_READ_PHASES		(3)
+
+const char read_phase_string[NUM_READ_PHASES][MAX_STRING_SIZE] = {
+	"stat",
+	"read",
+	"readdir"
+};
+
+const char read_phase_column[NUM_READ_PHASES][MAX_STRING_SIZE] = {
+	"Stats/sec",
+	"Reads/sec",
+	"Entries/sec"
+};
+
+const int read_phase_op[NUM_READ_PHASES] = {
+	OP_STAT,
+	OP_READ,
+	OP_READDIR
+};
+
+int	read_phases = 0;			/* Bit mask of (1 << PHASE_*) */
+
+/*
+ * Per thread CPU and scheduler accounting (--cpu-stats).
+ * getrusage(RUSAGE_THREAD) and /proc/self/task/<tid>/schedstat are sampled
+ * around the write loop, each read back phase and the unlinks, to split the
+ * time of a phase into CPU, run queue wait and time spent blocked.
+ */
+#define CPU_PHASE_WRITE		(0)
+#define CPU_PHASE_UNLINK	(NUM_READ_PHASES + 1)	/* Read phase n is n + 1 */
+#define NUM_CPU_PHASES		(NUM_READ_PHASES + 2)
+
+const char cpu_phase_string[NUM_CPU_PHASES][MAX_STRING_SIZE] = {
+	"write",
+	"stat",
+	"read",
+	"readdir",
+	"unlink"
+};
+
+#define SCHEDSTAT_PATH		"/proc/self/task/%ld/schedstat"
+
+typedef struct {
+	unsigned long long user_nsec;		/* User CPU time */
+	unsigned long long sys_nsec;		/* System CPU time */
+	unsigned long long voluntary_csw;	/* Context switches, blocked */
+	unsigned long long involuntary_csw;	/* ... and preempted */
+	unsigned long long run_nsec;		/* On CPU, from schedstat */
+	unsigned long long wait_nsec;		/* Runnable but waiting on a run queue */
+	unsigned long long wall_nsec;		/* Length of the phase */
+} cpu_usage_t;
+
+int	cpu_stats = 0;
+
+/*
+ * Block device and VM statistics (--dev-stats).
+ * The block device under each -d directory and the dirty and writeback
+ * page counts are sampled before and after each iteration.
+ */
+#define SYS_DEV_BLOCK_PATH	"/sys/dev/block"	    /* <major>:<minor>/stat */
+#define DISKSTATS_PATH		"/proc/diskstats"	    /* ... when there is no sysfs */
+#define MOUNTINFO_PATH		"/proc/self/mountinfo"
+#define VMSTAT_PATH		"/proc/vmstat"
+#define DISK_SECTOR_SIZE	(512)			    /* Unit of the sector counts */
+
+typedef struct {
+	unsigned long long read_ios;
+	unsigned long long read_sectors;
+	unsigned long long write_ios;
+	unsigned long long write_sectors;
+	unsigned long long io_ticks_ms;		/* Time the device was busy */
+	unsigned long long time_in_queue_ms;	/* Busy time weighted by IOs in flight */
+} disk_stat_t;
+
+typedef struct {
+	dev_t	dev;
+	char	name[MAX_STRING_SIZE];		/* As in /proc/diskstats */
+	disk_stat_t start;			/* Sample before the iteration */
+	disk_stat_t delta;			/* ... and what the iteration did */
+	unsigned long long logical_bytes;	/* Written by fs_mark into its directories */
+} block_dev_t;
+
+typedef struct {
+	unsigned long long nr_dirty;		/* Pages */
+	unsigned long long nr_writeback;
+} vm_stat_t;
+
+int	dev_stats = 0;
+block_dev_t *block_devs;			/* One per device, not per -d */
+int	num_block_devs = 0;
+int	*dir_block_dev;				/* Index into block_devs of each -d, or -1 */
+vm_stat_t vm_start, vm_stop;
+unsigned long long dev_start_nsec;		/* Timing clock at the start sample */
+unsigned long long dev_wall_nsec;		/* ... and from there to the stop sample */
+
+/*
+ * Mixed workload (--mix create:W,read:W,stat:W,unlink:W).
+ * Instead of the write loop, each thread does -n operations drawn by weight
+ * against one population of files shared by all threads. The latency of
+ * each operation goes into the histogram of the system call it stands for.
+ */
+#define MIX_CREATE		(0)	    /* Create, write (fsync) and close a new file */
+#define MIX_READ		(1)	    /* open + read whole file + close */
+#define MIX_STAT		(2)	    /* stat() */
+#define MIX_UNLINK		(3)	    /* unlink() */
+#define NUM_MIX_OPS		(4)
+
+const char mix_op_string[NUM_MIX_OPS][MAX_STRING_SIZE] = {
+	"create",
+	"read",
+	"stat",
+	"unlink"
+};
+
+const char mix_op_column[NUM_MIX_OPS][MAX_STRING_SIZE] = {
+	"Creates/sec",
+	"Reads/sec",
+	"Stats/sec",
+	"Unlinks/sec"
 };
 
+const int mix_op_hist[NUM_MIX_OPS] = {
+	OP_FILE,
+	OP_READ,
+	OP_STAT,
+	OP_UNLINK
+};
+
+int	mix_mode = 0;
+char	mix_spec[MAX_STRING_SIZE];		/* --mix as given, for the records */
+double	mix_weight[NUM_MIX_OPS];
+unsigned long long mix_cumul[NUM_MIX_OPS];	/* Cumulative weights, scaled to 2^32 */
+int	mix_files = -1;				/* Files per thread in the population to start with */
+
+/*
+ * Aging (--churn percent), built on the --mix population.
+ * Threads only create files until the file system of their -d directory
+ * is "percent" full. After that every file created replaces a random one
+ * of the population, so the use stays put while free space gets more and
+ * more fragmented. Each iteration starts by checking the use again, so
+ * it is topped up if it drifted down. Iterations that only filled are not
+ * counted in -L.
+ */
+#define CHURN_CHECK_FILES	(16)	    /* Files created between looks at the use while filling */
+
+int	churn_target = 0;			/* 0: no --churn */
+
+/*
+ * Log bucketed latency histogram (HDR style).
+ * Values below HIST_SUB_BUCKETS are recorded exactly, above that each power of two
+ * is split into HIST_SUB_BUCKETS/2 linear buckets, so the recorded value is
+ * within ~3% of the real one.
+ */
+#define HIST_SUB_BUCKET_BITS	(6)
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BUCKET_BITS)
+#define HIST_HALF_BUCKETS	(HIST_SUB_BUCKETS / 2)
+#define HIST_NUM_BUCKETS	(HIST_SUB_BUCKETS + (64 - HIST_SUB_BUCKET_BITS) * HIST_HALF_BUCKETS)
+
+typedef struct {
+	unsigned long long count;		/* Number of values recorded */
+	unsigned long long total;		/* Sum of all values recorded */
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long buckets[HIST_NUM_BUCKETS];
+} fs_mark_hist_t;
+
 /*
  * Structure used to record statisitics on each run of files.
  */
 typedef struct {
 	unsigned int file_count;	    	/* Number of files in run */
+	unsigned int files_stolen;		/* Files claimed from other directories' queues (--steal) */
 	float files_per_sec;			/* Effective (wallclock time based) number of files written/second */
-    	unsigned long long app_overhead_usec; 	/* Time spent by application not in "file writing" related system calls */
+	unsigned long long bytes_written;	/* File data written by the write loop */
+	double bytes_per_sec;			/* ... over the same time as files_per_sec */
+    	unsigned long long app_overhead_nsec; 	/* Time spent by application not in "file writing" related system calls */
+
+	/*
+	 * Timing clock readings around the file write loop. For the iteration,
+	 * wall_nsec runs from the first thread starting to the last finishing
+	 * and the skews are the spread of the thread start and finish times.
+	 */
+	unsigned long long loop_start_nsec;
+	unsigned long long loop_stop_nsec;
+	unsigned long long wall_nsec;
+	unsigned long long start_skew_nsec;
+	unsigned long long finish_skew_nsec;
     
 	/*
-	 * Times for creat() system call in usecs
+	 * Times for creat() system call in nsecs
 	 */
-	unsigned long long min_creat_usec;
-	unsigned long long avg_creat_usec;
-	unsigned long long max_creat_usec;
+	unsigned long long min_creat_nsec;
+	unsigned long long avg_creat_nsec;
+	unsigned long long max_creat_nsec;
 
 	/*
-	 * Times for write() system call in usecs
+	 * Times for write() system call in nsecs
 	 */
-	unsigned long long min_write_usec;
-	unsigned long long avg_write_usec;
-	unsigned long long max_write_usec;
+	unsigned long long min_write_nsec;
+	unsigned long long avg_write_nsec;
+	unsigned long long max_write_nsec;
 
 	/*
-	 * Times for fsync() system call in usecs
+	 * Times for fsync() system call in nsecs
 	 */
-	unsigned long long min_fsync_usec;
-	unsigned long long avg_fsync_usec;
-	unsigned long long max_fsync_usec;
+	unsigned long long min_fsync_nsec;
+	unsigned long long avg_fsync_nsec;
+	unsigned long long max_fsync_nsec;
 
 	/*
 	 * Times in sync() system call
 	 */
-	unsigned long long min_sync_usec;
-	unsigned long long avg_sync_usec;
-	unsigned long long max_sync_usec;
+	unsigned long long min_sync_nsec;
+	unsigned long long avg_sync_nsec;
+	unsigned long long max_sync_nsec;
 	
 	/*
-	 * Times for unlink() system call in usecs
+	 * Times for unlink() system call in nsecs
+	 */
+	unsigned long long min_unlink_nsec;
+	unsigned long long avg_unlink_nsec;
+	unsigned long long max_unlink_nsec;
+
+	/*
+	 * Times for close() system call in nsecs
+	 */
+	unsigned long long min_close_nsec;
+	unsigned long long avg_close_nsec;
+	unsigned long long max_close_nsec;
+
+	/*
+	 * Times for directory fsync() (--dir-sync) in nsecs
+	 */
+	unsigned long long min_dirsync_nsec;
+	unsigned long long avg_dirsync_nsec;
+	unsigned long long max_dirsync_nsec;
+
+	/*
+	 * Times for rename() (--rename) in nsecs
+	 */
+	unsigned long long min_rename_nsec;
+	unsigned long long avg_rename_nsec;
+	unsigned long long max_rename_nsec;
+
+	/*
+	 * Times for fallocate() or ftruncate() (--write-mode) in nsecs
+	 */
+	unsigned long long min_alloc_nsec;
+	unsigned long long avg_alloc_nsec;
+	unsigned long long max_alloc_nsec;
+
+	/*
+	 * Files (or directory entries for readdir) per second in each read back phase
+	 */
+	float phase_files_per_sec[NUM_READ_PHASES];
+
+	/*
+	 * Operations done by the --mix loop, their rate over the same time as
+	 * files_per_sec, and reads and stats that lost their file to
+	 * an unlink by another thread (not counted in mix_ops).
+	 */
+	unsigned long long mix_ops[NUM_MIX_OPS];
+	double mix_ops_per_sec[NUM_MIX_OPS];
+	unsigned long long mix_misses;
+	unsigned int churn_filling;		/* Threads that started the iteration filling (--churn) */
+
+	/*
+	 * CPU used and scheduling in each phase (--cpu-stats)
 	 */
-	unsigned long long min_unlink_usec;
-	unsigned long long avg_unlink_usec;
-	unsigned long long max_unlink_usec;
+	cpu_usage_t cpu_usage[NUM_CPU_PHASES];
 
 	/*
-	 * Times for close() system call in usecs
+	 * All block devices under the -d directories over the whole
+	 * iteration (--dev-stats). The write amplification is the device
+	 * bytes written over the bytes fs_mark wrote to those devices.
 	 */
-	unsigned long long min_close_usec;
-	unsigned long long avg_close_usec;
-	unsigned long long max_close_usec;
+	unsigned long long dev_ios;
+	unsigned long long dev_bytes_written;
+	double dev_iops;
+	double dev_queue_depth;
+	double write_amplification;
+
+	/*
+	 * Latency histograms for each system call in nsecs
+	 */
+	fs_mark_hist_t op_hist[NUM_OPS];
+
+	/*
+	 * FILE latency in nsecs of the files in each size class
+	 */
+	fs_mark_hist_t size_hist[NUM_SIZE_CLASSES];
 } fs_mark_stat_t;
 
+/*
+ * Helper threads that fsync() one batch of files in parallel (-S 8).
+ * The owning worker fills in the batch, releases the helpers, takes part
+ * itself and collects the per file times once they are all done.
+ */
+struct child_job;
+
 typedef struct {
+	pthread_t *threads;			/* sync_threads - 1 helpers */
+	int	nr_threads;
+	pthread_barrier_t start_barrier;
+	pthread_barrier_t done_barrier;
+	struct child_job *child_task;		/* Worker that owns the files */
+	int	first;				/* First file of the batch */
+	int	count;				/* Files in the batch */
+	int	next;				/* Next file of the batch to take */
+	unsigned long long *latency;		/* Time of each fsync() in the batch */
+	volatile int exit;
+} sync_pool_t;
+
+/*
+ * Per thread state. The table is sized from the arguments and each entry is
+ * cache line aligned so that threads do not share lines. The large buffers
+ * are allocated by the worker itself so they are local to the node it runs on.
+ */
+typedef struct child_job {
         long    child_tid;
-        char    test_dir[PATH_MAX];             /* Directory name to use to create test files in */
-        char    io_buffer[MAX_IO_BUFFER_SIZE];  /* Buffer used in writes to files */
+        int     thread_index;                   /* Position in child_tasks, used to seed the RNG */
+        char    test_dir[MAX_NAME_PATH];        /* Directory name to use to create test files in */
+        int     dir_index;                      /* Which -d directory (and file queue) is ours */
+        char    *io_buffer;                     /* Buffer used in writes to files (page or huge page aligned) */
         struct name_entry *names;               /* Array of names & paths used in test  */
-        char rand_name[FILENAME_SIZE];
-        char seq_name[FILENAME_SIZE];
+        int     names_size;                     /* Entries allocated in names */
+        int     files_claimed;                  /* Files to write in this iteration so far */
+        unsigned int files_stolen;              /* Of those, claimed from other directories */
+        char seq_name[FILENAME_SIZE];           /* Sequential part of the names for seq_sec */
+        unsigned long seq_sec;                  /* Time stamp encoded in seq_name */
+        char (*subdir_names)[MAX_DIR_PATH];     /* Full path of each subdirectory (or test_dir) */
+        char    *subdir_dirty;                  /* New files since its last --dir-sync */
+        char    tmp_dir[MAX_DIR_PATH];          /* Where files are written with --rename tmpdir */
+        char    target_path[MAX_FILE_PATH];     /* Reusable buffer for rename targets */
+        char path[MAX_FILE_PATH];               /* Reusable buffer for full file paths */
+        int     *chunk_order;                   /* Chunk write order with --write-mode random */
+        struct iovec *iov;                      /* --iovecs entries with --write-mode pwritev */
+        char    *payload_ring;                  /* Chunk buffers for --payload random */
+        int     payload_ring_size;              /* Buffers in payload_ring */
+
+        /*
+         * Wall clock seconds are derived from the timing clock, so naming a
+         * file needs no gettimeofday()
+         */
+        unsigned long wall_base_sec;
+        unsigned long long clock_base_nsec;
         fs_mark_stat_t thread_stats;
-} child_job_t;
+
+        /*
+         * Subdirectory policy state, private to each thread
+         */
+        int     current_subdir;
+        int     files_in_subdir;
+        unsigned long long start_sec_time;
+
+        unsigned long long rng_state[4];        /* xoshiro256** state */
+        unsigned long long payload_state[4][PAYLOAD_LANES]; /* xoshiro256+ lanes of the payload */
+        int     mix_filled;                     /* Added our --mix starting files */
+        int     churn_fill;                     /* --churn: still filling up this iteration */
+        cpu_set_t cpus;                         /* Where --affinity pins us */
+        int     numa_node;                      /* Node of those CPUs, -1 if unknown */
+        sync_pool_t *sync_pool;                 /* -S 8 helpers, kept for the whole run */
+
+        /*
+         * Running totals sampled by the interval reporter (-i).
+         * Written only by the owning thread, never reset.
+         */
+        unsigned long long progress_files;
+        unsigned long long progress_op_count[NUM_OPS];
+        unsigned long long progress_op_nsec[NUM_OPS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) child_job_t;
+
+/*
+ * For each child, we need to track its pid and the directory that it is to run in.
+ * Allocated in process_args() once the number of threads is known.
+ */
+child_job_t *child_tasks;
+size_t	child_tasks_size;
+
+/*
+ * Directories given with -d, in command line order
+ */
+char	**dir_args;
+
+/*
+ * Work stealing (--steal batch).
+ * Each -d directory has a queue holding the files of all of its threads for
+ * one iteration. A worker claims batches from its own queue and, once that
+ * is empty, from the queues of the other directories, so threads on a fast
+ * device keep writing (into their own directory) while a slow one catches up.
+ * A queue is a single atomic claim counter, so claiming never takes a lock.
+ */
+typedef struct {
+	unsigned long long next;		/* First file not claimed yet */
+	unsigned long long total;		/* Files in the queue each iteration */
+} __attribute__((aligned(CACHE_LINE_SIZE))) file_queue_t;
+
+file_queue_t *file_queues;
+int	steal_batch = 0;			/* 0: each thread writes exactly -n files */
 
 /*
- * For each child, we need to track its pid and the directory that it is to run in
+ * The files of the --mix population, one per -d directory so --churn holds
+ * each file system at its target. The threads of a directory add the files
+ * they create and take files out to unlink them, under the lock.
  */
-child_job_t child_tasks[MAX_THREADS];
+typedef struct {
+	pthread_mutex_t lock;
+	struct name_entry *files;
+	int	count;
+	int	size;				/* Entries allocated in files */
+} mix_population_t;
+
+mix_population_t *mix_populations;		/* Indexed by dir_index */
+
+/*
+ * Open loop load (--rate files/sec across all threads).
+ * Each thread starts its files on a fixed timeline of one file every
+ * rate_interval_nsec, and the FILE latency is taken from the intended start
+ * on that timeline, so time spent queued behind a slow file is counted.
+ */
+double	target_rate = 0.0;			/* 0: closed loop, as fast as possible */
+double	rate_interval_nsec = 0.0;		/* Per thread gap between file starts */
+
+/*
+ * Interval reporter state (-i)
+ */
+unsigned long long	interval_nsecs = 0;	/* 0: no interval reports */
+pthread_t		interval_thread;
+volatile int		interval_exit = 0;
+
+/*
+ * Persistent worker pool state (-T): workers are created once and parked on
+ * these barriers between iterations.
+ */
+pthread_t		*worker_threads;
+pthread_barrier_t	iteration_start_barrier;
+pthread_barrier_t	iteration_done_barrier;
+int			worker_pool_running = 0;
+volatile int		worker_pool_exit = 0;
+
+/*
+ * The -S 8 helpers of every worker are created along with the first
+ * iteration and parked between batches until the run is over.
+ */
+int			sync_pools_running = 0;
+
+/*
+ * All workers meet here right before the timed file write loop, so the
+ * threads of an iteration start together.
+ */
+pthread_barrier_t	loop_start_barrier;
+
+/*
+ * Clock used for all timing, selected at build time with one of
+ * -DFS_MARK_CLOCK_MONOTONIC (default), -DFS_MARK_CLOCK_TSC or
+ * -DFS_MARK_CLOCK_GETTIMEOFDAY.
+ * Times are always measured in nanoseconds. The gettimeofday clock only has
+ * microsecond resolution, so that build keeps reporting microseconds.
+ */
+#if !defined(FS_MARK_CLOCK_GETTIMEOFDAY) && !defined(FS_MARK_CLOCK_TSC) && \
+    !defined(FS_MARK_CLOCK_MONOTONIC)
+#define FS_MARK_CLOCK_MONOTONIC
+#endif
+
+#ifdef FS_MARK_CLOCK_GETTIMEOFDAY
+#define REPORT_NSECS_PER_UNIT	(1000ULL)
+#define REPORT_UNIT_STRING	"microseconds"
+#else
+#define REPORT_NSECS_PER_UNIT	(1ULL)
+#define REPORT_UNIT_STRING	"nanoseconds"
+#endif
 
 /*
  * lib_timing.c prototypes
@@ -210,3 +941,8 @@ child_job_t child_tasks[MAX_THREADS];
 void start(struct timeval *);
 unsigned long long stop(struct timeval *, struct timeval *);
 unsigned long long tvnow(void);
+void timing_init(void);
+const char *timing_clock_name(void);
+unsigned long long nsnow(void);
+void start_ns(unsigned long long *);
+unsigned long long stop_ns(unsigned long long *, unsigned long long *);
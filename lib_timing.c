@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 
 #define	nz(x)	((x) == 0 ? 1 : (x))
@@ -126,6 +127,141 @@ stop(struct timeval *begin, struct timeval *end)
 }
 
 
+/*
+ * Nanosecond clock layer.
+ *
+ * The clock is picked at build time:
+ *	FS_MARK_CLOCK_MONOTONIC		clock_gettime(CLOCK_MONOTONIC_RAW) (default)
+ *	FS_MARK_CLOCK_TSC		calibrated x86 time stamp counter
+ *	FS_MARK_CLOCK_GETTIMEOFDAY	gettimeofday(), microsecond resolution
+ * All of them return nanoseconds, only their resolution and cost differ.
+ */
+#if !defined(FS_MARK_CLOCK_GETTIMEOFDAY) && !defined(FS_MARK_CLOCK_TSC) && \
+    !defined(FS_MARK_CLOCK_MONOTONIC)
+#define FS_MARK_CLOCK_MONOTONIC
+#endif
 
+#if defined(FS_MARK_CLOCK_TSC) && !defined(__x86_64__) && !defined(__i386__)
+#error "FS_MARK_CLOCK_TSC is only supported on x86"
+#endif
 
+/*
+ * OSv does not implement the raw monotonic clock.
+ */
+#if defined(CLOCK_MONOTONIC_RAW) && !defined(__OSV__)
+#define	FS_MARK_MONOTONIC_CLOCK_ID	CLOCK_MONOTONIC_RAW
+#define	FS_MARK_MONOTONIC_CLOCK_NAME	"CLOCK_MONOTONIC_RAW"
+#else
+#define	FS_MARK_MONOTONIC_CLOCK_ID	CLOCK_MONOTONIC
+#define	FS_MARK_MONOTONIC_CLOCK_NAME	"CLOCK_MONOTONIC"
+#endif
 
+/*
+ * The gettimeofday build has no use for the monotonic clock.
+ */
+#if !defined(FS_MARK_CLOCK_GETTIMEOFDAY)
+static unsigned long long
+monotonic_nsecs(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(FS_MARK_MONOTONIC_CLOCK_ID, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+#ifdef FS_MARK_CLOCK_TSC
+/*
+ * TSC ticks are converted with a 32.32 fixed point multiplier computed
+ * against the monotonic clock in timing_init().
+ */
+static unsigned long long tsc_base;
+static unsigned long long tsc_ns_base;
+static unsigned long long tsc_mult;
+
+static inline unsigned long long
+rdtsc_ordered(void)
+{
+	__asm__ __volatile__("lfence" ::: "memory");
+	return (__builtin_ia32_rdtsc());
+}
+#endif
+
+/*
+ * Must be called once before any other thread asks for the time.
+ */
+void
+timing_init(void)
+{
+#ifdef FS_MARK_CLOCK_TSC
+	unsigned long long ns0, ns1, tsc0, tsc1;
+	struct timespec calibrate = { 0, 20 * 1000 * 1000 };	/* 20ms */
+
+	ns0 = monotonic_nsecs();
+	tsc0 = rdtsc_ordered();
+	(void) nanosleep(&calibrate, NULL);
+	ns1 = monotonic_nsecs();
+	tsc1 = rdtsc_ordered();
+
+	if (tsc1 <= tsc0) {
+		fprintf(stderr, "lat_fs: TSC is not usable as a clock\n");
+		exit(1);
+	}
+	tsc_mult = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+	tsc_base = tsc1;
+	tsc_ns_base = ns1;
+#endif
+}
+
+const char *
+timing_clock_name(void)
+{
+#if defined(FS_MARK_CLOCK_TSC)
+	return ("calibrated TSC");
+#elif defined(FS_MARK_CLOCK_GETTIMEOFDAY)
+	return ("gettimeofday");
+#else
+	return ("clock_gettime(" FS_MARK_MONOTONIC_CLOCK_NAME ")");
+#endif
+}
+
+/*
+ * Return the current time in nanoseconds.
+ * Only differences between two values are meaningful.
+ */
+unsigned long long
+nsnow(void)
+{
+#if defined(FS_MARK_CLOCK_TSC)
+	return (tsc_ns_base +
+		(unsigned long long)(((unsigned __int128)(rdtsc_ordered() - tsc_base) *
+				      tsc_mult) >> 32));
+#elif defined(FS_MARK_CLOCK_GETTIMEOFDAY)
+	return (tvnow() * 1000ULL);
+#else
+	return (monotonic_nsecs());
+#endif
+}
+
+/*
+ * Start timing now.
+ */
+void
+start_ns(unsigned long long *begin)
+{
+	*begin = nsnow();
+}
+
+/*
+ * Stop timing and return elapsed time in nanoseconds.
+ */
+unsigned long long
+stop_ns(unsigned long long *begin, unsigned long long *end)
+{
+	*end = nsnow();
+
+	/* time shouldn't go backwards!!! */
+	if (*end < *begin)
+		return (0ULL);
+	return (*end - *begin);
+}
@@ -0,0 +1,279 @@
+/*
+ * Minimal io_uring wrapper used by the fs_mark "-E uring" engine.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lib_uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct uring_ctx {
+	int		ring_fd;
+
+	/*
+	 * Submission queue
+	 */
+	unsigned int	*sq_head;
+	unsigned int	*sq_tail;
+	unsigned int	*sq_mask;
+	unsigned int	*sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int	sq_entries;
+	unsigned int	sqe_tail;	/* Local tail, published on submit */
+
+	/*
+	 * Completion queue
+	 */
+	unsigned int	*cq_head;
+	unsigned int	*cq_tail;
+	unsigned int	*cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void		*sq_ring_ptr;
+	size_t		sq_ring_size;
+	void		*cq_ring_ptr;
+	size_t		cq_ring_size;
+	size_t		sqes_size;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return ((int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			     flags, NULL, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return ((int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+int uring_init(uring_ctx_t **ringp, unsigned int entries, unsigned int nr_files)
+{
+	struct io_uring_params p;
+	uring_ctx_t *ring;
+	int *files;
+	unsigned int i;
+	int ret;
+
+	if ((ring = calloc(1, sizeof(*ring))) == NULL)
+		return (-ENOMEM);
+
+	memset(&p, 0, sizeof(p));
+	if ((ring->ring_fd = sys_io_uring_setup(entries, &p)) < 0) {
+		ret = -errno;
+		free(ring);
+		return (ret);
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+				 IORING_OFF_SQ_RING);
+	if (ring->sq_ring_ptr == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring_ptr = ring->sq_ring_ptr;
+	} else {
+		ring->cq_ring_ptr = mmap(NULL, ring->cq_ring_size,
+					 PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+					 IORING_OFF_CQ_RING);
+		if (ring->cq_ring_ptr == MAP_FAILED)
+			goto fail;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_head = (void *)((char *)ring->sq_ring_ptr + p.sq_off.head);
+	ring->sq_tail = (void *)((char *)ring->sq_ring_ptr + p.sq_off.tail);
+	ring->sq_mask = (void *)((char *)ring->sq_ring_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (void *)((char *)ring->sq_ring_ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = (void *)((char *)ring->cq_ring_ptr + p.cq_off.head);
+	ring->cq_tail = (void *)((char *)ring->cq_ring_ptr + p.cq_off.tail);
+	ring->cq_mask = (void *)((char *)ring->cq_ring_ptr + p.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->cq_ring_ptr + p.cq_off.cqes);
+
+	/*
+	 * Register a sparse table of direct descriptors so that each linked
+	 * chain can open into a known slot and reuse it for write/fsync/close.
+	 */
+	if ((files = malloc(nr_files * sizeof(int))) == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < nr_files; i++)
+		files[i] = -1;
+	ret = sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES, files,
+				    nr_files);
+	free(files);
+	if (ret < 0)
+		goto fail;
+
+	*ringp = ring;
+	return (0);
+
+fail:
+	ret = -errno;
+	uring_exit(ring);
+	return (ret);
+}
+
+void uring_exit(uring_ctx_t *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_ptr && ring->cq_ring_ptr != MAP_FAILED &&
+	    ring->cq_ring_ptr != ring->sq_ring_ptr)
+		munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+	if (ring->sq_ring_ptr && ring->sq_ring_ptr != MAP_FAILED)
+		munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+	close(ring->ring_fd);
+	free(ring);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_ctx_t *ring)
+{
+	unsigned int head;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return (NULL);
+
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sq_array[ring->sqe_tail & *ring->sq_mask] =
+	    ring->sqe_tail & *ring->sq_mask;
+	ring->sqe_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return (sqe);
+}
+
+int uring_submit_and_wait(uring_ctx_t *ring, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int ret;
+
+	to_submit = ring->sqe_tail - *ring->sq_tail;
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(ring->ring_fd, to_submit, wait_nr,
+					 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return (ret < 0 ? -errno : ret);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_ctx_t *ring)
+{
+	unsigned int head;
+
+	head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+
+	return (&ring->cqes[head & *ring->cq_mask]);
+}
+
+void uring_cqe_seen(uring_ctx_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_openat_direct(struct io_uring_sqe *sqe, const char *path,
+			      int flags, mode_t mode, unsigned int slot)
+{
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)path;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+	sqe->file_index = slot + 1;
+}
+
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, unsigned int slot,
+			    const void *buf, unsigned int len,
+			    unsigned long long offset)
+{
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = slot;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+}
+
+void uring_prep_fsync_fixed(struct io_uring_sqe *sqe, unsigned int slot)
+{
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = slot;
+}
+
+void uring_prep_close_direct(struct io_uring_sqe *sqe, unsigned int slot)
+{
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = slot + 1;
+}
+
+void uring_prep_renameat(struct io_uring_sqe *sqe, const char *old_path,
+			 const char *new_path, unsigned int flags)
+{
+	sqe->opcode = IORING_OP_RENAMEAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)old_path;
+	sqe->len = AT_FDCWD;
+	sqe->addr2 = (unsigned long)new_path;
+	sqe->rename_flags = flags;
+}
+
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts)
+{
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)ts;
+	sqe->len = 1;
+	sqe->off = 0;		/* Do not complete on other completions */
+}
+
+#endif /* HAVE_IO_URING */
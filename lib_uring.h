@@ -0,0 +1,74 @@
+/*
+ * Minimal io_uring wrapper used by the fs_mark "-E uring" engine.
+ *
+ * This talks to the kernel through the raw io_uring_setup/io_uring_enter/
+ * io_uring_register system calls, so fs_mark does not depend on liburing.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef LIB_URING_H
+#define LIB_URING_H
+
+/*
+ * OSv has no io_uring, the engine is only built for Linux.
+ */
+#ifndef __OSV__
+#define HAVE_IO_URING
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+typedef struct uring_ctx uring_ctx_t;
+
+/*
+ * Create a ring with "entries" submission slots and a sparse table of
+ * "nr_files" direct descriptors. Returns 0 or a negative errno.
+ */
+int uring_init(uring_ctx_t **ring, unsigned int entries, unsigned int nr_files);
+void uring_exit(uring_ctx_t *ring);
+
+/*
+ * Return the next free SQE (zeroed), or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_ctx_t *ring);
+
+/*
+ * Submit all queued SQEs and wait for at least "wait_nr" completions.
+ * Returns the number submitted or a negative errno.
+ */
+int uring_submit_and_wait(uring_ctx_t *ring, unsigned int wait_nr);
+
+/*
+ * Return the next completion without blocking, or NULL if none is ready.
+ * Each returned CQE must be released with uring_cqe_seen().
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_ctx_t *ring);
+void uring_cqe_seen(uring_ctx_t *ring);
+
+/*
+ * SQE preparation helpers. "slot" is an index into the direct descriptor table.
+ */
+void uring_prep_openat_direct(struct io_uring_sqe *sqe, const char *path,
+			      int flags, mode_t mode, unsigned int slot);
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, unsigned int slot,
+			    const void *buf, unsigned int len,
+			    unsigned long long offset);
+void uring_prep_fsync_fixed(struct io_uring_sqe *sqe, unsigned int slot);
+void uring_prep_close_direct(struct io_uring_sqe *sqe, unsigned int slot);
+void uring_prep_renameat(struct io_uring_sqe *sqe, const char *old_path,
+			 const char *new_path, unsigned int flags);
+
+/*
+ * Relative timeout, completes with -ETIME once "ts" has passed. The
+ * timespec only has to stay valid until the SQE is submitted.
+ */
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* LIB_URING_H */